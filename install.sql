@@ -19,14 +19,44 @@
 
 DROP FUNCTION IF EXISTS mqtt_info;
 DROP FUNCTION IF EXISTS mqtt_lasterror;
+DROP FUNCTION IF EXISTS mqtt_stats;
+DROP FUNCTION IF EXISTS mqtt_connections;
+DROP FUNCTION IF EXISTS mqtt_trace;
+DROP FUNCTION IF EXISTS mqtt_trace_dump;
 DROP FUNCTION IF EXISTS mqtt_connect;
 DROP FUNCTION IF EXISTS mqtt_disconnect;
 DROP FUNCTION IF EXISTS mqtt_publish;
 DROP FUNCTION IF EXISTS mqtt_subscribe;
+DROP FUNCTION IF EXISTS mqtt_async_status;
+DROP FUNCTION IF EXISTS mqtt_publish_batch;
+DROP FUNCTION IF EXISTS mqtt_queue_start;
+DROP FUNCTION IF EXISTS mqtt_queue_stop;
+DROP FUNCTION IF EXISTS mqtt_queue_status;
+DROP FUNCTION IF EXISTS mqtt_enqueue;
+DROP FUNCTION IF EXISTS mqtt_open;
+DROP FUNCTION IF EXISTS mqtt_close;
+DROP FUNCTION IF EXISTS mqtt_receive;
+DROP FUNCTION IF EXISTS mqtt_unsubscribe;
+DROP FUNCTION IF EXISTS mqtt_consume;
 
 CREATE FUNCTION mqtt_info RETURNS STRING SONAME 'lib_mysqludf_mqtt.so';
 CREATE FUNCTION mqtt_lasterror RETURNS STRING SONAME 'lib_mysqludf_mqtt.so';
+CREATE FUNCTION mqtt_stats RETURNS STRING SONAME 'lib_mysqludf_mqtt.so';
+CREATE FUNCTION mqtt_connections RETURNS STRING SONAME 'lib_mysqludf_mqtt.so';
+CREATE FUNCTION mqtt_trace RETURNS INTEGER SONAME 'lib_mysqludf_mqtt.so';
+CREATE FUNCTION mqtt_trace_dump RETURNS STRING SONAME 'lib_mysqludf_mqtt.so';
 CREATE FUNCTION mqtt_connect RETURNS INTEGER SONAME 'lib_mysqludf_mqtt.so';
 CREATE FUNCTION mqtt_disconnect RETURNS INTEGER SONAME 'lib_mysqludf_mqtt.so';
 CREATE FUNCTION mqtt_publish RETURNS INTEGER SONAME 'lib_mysqludf_mqtt.so';
 CREATE FUNCTION mqtt_subscribe RETURNS STRING SONAME 'lib_mysqludf_mqtt.so';
+CREATE FUNCTION mqtt_async_status RETURNS STRING SONAME 'lib_mysqludf_mqtt.so';
+CREATE AGGREGATE FUNCTION mqtt_publish_batch RETURNS STRING SONAME 'lib_mysqludf_mqtt.so';
+CREATE FUNCTION mqtt_queue_start RETURNS INTEGER SONAME 'lib_mysqludf_mqtt.so';
+CREATE FUNCTION mqtt_queue_stop RETURNS INTEGER SONAME 'lib_mysqludf_mqtt.so';
+CREATE FUNCTION mqtt_queue_status RETURNS STRING SONAME 'lib_mysqludf_mqtt.so';
+CREATE FUNCTION mqtt_enqueue RETURNS INTEGER SONAME 'lib_mysqludf_mqtt.so';
+CREATE FUNCTION mqtt_open RETURNS INTEGER SONAME 'lib_mysqludf_mqtt.so';
+CREATE FUNCTION mqtt_close RETURNS INTEGER SONAME 'lib_mysqludf_mqtt.so';
+CREATE FUNCTION mqtt_receive RETURNS STRING SONAME 'lib_mysqludf_mqtt.so';
+CREATE FUNCTION mqtt_unsubscribe RETURNS INTEGER SONAME 'lib_mysqludf_mqtt.so';
+CREATE FUNCTION mqtt_consume RETURNS STRING SONAME 'lib_mysqludf_mqtt.so';
@@ -17,12 +17,27 @@
     Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <time.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <mysql.h>
 #include <MQTTClient.h>
 #include <json-parser/json.h>
+#include <zlib.h>
 #include "lib_mysqludf_mqtt.h"
 
 #ifdef DEBUG
@@ -30,51 +45,206 @@
 #endif  // DEBUG
 
 
-volatile int last_rc = 0;
-char last_func[128] = {0};
+/* Last error of the calling thread, MySQL executes a statement within one thread */
+_Thread_local int last_rc = 0;
+_Thread_local const char *last_func = "";
 
-/* Helper */
-char *strcrpl(char *str, char find, char replace)
+/*
+ * Tracing
+ *
+ * TRACE() records a printf style message if level is enabled by
+ * mqtt_trace(). Each thread writes into its own ring buffer without locks,
+ * so disabled levels cost a relaxed load and enabled ones a vsnprintf().
+ * Levels above TRACE_MAX_LEVEL are removed at compile time.
+ */
+#ifdef DEBUG
+atomic_int trace_level = TRACE_DEBUG;
+#else
+atomic_int trace_level = TRACE_OFF;
+#endif
+_Atomic(trace_ring *) trace_rings = NULL;
+atomic_ullong trace_cleared = 0;        // records up to this time are not dumped
+_Thread_local trace_ring *trace_own = NULL;
+pthread_key_t trace_key;
+pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+bool trace_key_valid = false;
+
+#if TRACE_MAX_LEVEL > TRACE_OFF
+#define TRACE(level, ...)   do { \
+        if ((level) <= TRACE_MAX_LEVEL && (level) <= atomic_load_explicit(&trace_level, memory_order_relaxed)) { \
+            trace_write((level), __VA_ARGS__); \
+        } \
+    } while (0)
+#else
+#define TRACE(level, ...)   do { } while (0)
+#endif
+
+/* Release the ring of an exiting thread for reuse, its records are kept */
+void trace_detach(void *ring)
 {
-    for (char *p = str; *p; p++) {
-        if (find == *p) {
-            *p = replace;
+    atomic_store(&((trace_ring *)ring)->in_use, 0);
+}
+
+void trace_key_create(void)
+{
+    trace_key_valid = 0 == pthread_key_create(&trace_key, trace_detach);
+}
+
+/* Returns the ring of the calling thread, an unused or a new one, or NULL */
+trace_ring *trace_attach(void)
+{
+    trace_ring *ring;
+
+    pthread_once(&trace_once, trace_key_create);
+    if (!trace_key_valid) {
+        return NULL;
+    }
+    for (ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next) {
+        int unused = 0;
+        if (atomic_compare_exchange_strong(&ring->in_use, &unused, 1)) {
+            break;
         }
     }
-    return str;
+    if (ring == NULL) {
+        if ((ring = calloc(1, sizeof(trace_ring))) == NULL) {
+            return NULL;
+        }
+        atomic_init(&ring->in_use, 1);
+        ring->next = atomic_load(&trace_rings);
+        while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring));
+    }
+    pthread_setspecific(trace_key, ring);
+    return trace_own = ring;
 }
 
-const char *GetUUID(void)
+__attribute__((format(printf, 2, 3)))
+void trace_write(int level, const char *fmt, ...)
 {
-    static char struuid[sizeof(LIBNAME) + sizeof(LIBVERSION) + UUID_LEN*2 + 16 + 1];
-    char uuid[UUID_LEN*2 + 1];
+    trace_ring *ring = trace_own != NULL ? trace_own : trace_attach();
+    trace_record *rec;
+    struct timespec ts;
+    unsigned long seq;
+    va_list ap;
+
+    if (ring == NULL) {
+        return;
+    }
+    rec = &ring->records[ring->pos & (TRACE_RING_SIZE - 1)];
+    seq = 2 * ring->pos + 1;
+    // seqlock: readers skip records being overwritten
+    atomic_store_explicit(&rec->seq, seq, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->time = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    rec->tid = (int)syscall(SYS_gettid);
+    rec->level = level;
+    va_start(ap, fmt);
+    vsnprintf(rec->msg, TRACE_MSG_LEN, fmt, ap);
+    va_end(ap);
+    atomic_store_explicit(&rec->seq, seq + 1, memory_order_release);
+    ring->pos++;
+#ifdef DEBUG
+    syslog (level == TRACE_ERROR ? LOG_ERR : LOG_NOTICE, "%s", rec->msg);
+#endif
+}
 
 #ifdef DEBUG
-    setlogmask (LOG_UPTO (LOG_NOTICE));
+__attribute__((constructor)) void trace_openlog(void)
+{
     openlog (LIBNAME, LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-    syslog (LOG_NOTICE, "GetUUID()");
+}
 #endif
-    for (int i = 0; i < UUID_LEN; i += 2)
-    {
-        sprintf(&uuid[i], "%02x", rand() % 256);
+
+/* Free all rings when the library is unloaded */
+__attribute__((destructor)) void trace_cleanup(void)
+{
+    trace_ring *ring;
+
+    if (trace_key_valid) {
+        // no destructor of an unloaded library may run on thread exit
+        pthread_key_delete(trace_key);
+    }
+    while ((ring = atomic_load(&trace_rings)) != NULL) {
+        atomic_store(&trace_rings, ring->next);
+        free(ring);
     }
-    sprintf(struuid, "%s_%s_%s", LIBNAME, LIBVERSION, uuid);
 #ifdef DEBUG
-    syslog (LOG_NOTICE, "GetUUID() return %s", struuid);
     closelog ();
 #endif
-    return struuid;
+}
+
+/* Helper */
+char *strcrpl(char *str, char find, char replace)
+{
+    for (char *p = str; *p; p++) {
+        if (find == *p) {
+            *p = replace;
+        }
+    }
+    return str;
+}
+
+unsigned int named_hash(const char *name, size_t len)
+{
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (size_t i=0; i<len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Client ids are LIBNAME_LIBVERSION_ followed by UUID_LEN hex chars of a
+ * 64 bit value: a bijective mix of a per process random seed, the pid and
+ * an atomic counter, so ids never repeat within a process and collide
+ * across processes or hosts only with 64 bit random seed probability.
+ */
+uint64_t uuid_seed;
+atomic_ullong uuid_counter = 0;
+pthread_once_t uuid_once = PTHREAD_ONCE_INIT;
+
+/* splitmix64 finalizer, a bijection on 64 bit values */
+uint64_t uuid_mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+void uuid_seed_init(void)
+{
+    struct timespec ts;
+
+    if (getentropy(&uuid_seed, sizeof(uuid_seed)) != 0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uuid_seed = uuid_mix(((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ (uint64_t)syscall(SYS_gettid) << 20);
+    }
+}
+
+/* Returns the next value of the id sequence, also used as random number */
+uint64_t uuid_next(void)
+{
+    uint64_t n;
+
+    pthread_once(&uuid_once, uuid_seed_init);
+    n = atomic_fetch_add_explicit(&uuid_counter, 1, memory_order_relaxed);
+    return uuid_mix((uuid_seed ^ (uint64_t)getpid() << 40) + n * 0x9e3779b97f4a7c15ULL);
+}
+
+/* Writes a new unique client id into buf of CLIENT_ID_SIZE chars and returns it */
+char *GetUUID(char *buf)
+{
+    snprintf(buf, CLIENT_ID_SIZE, "%s_%s_%0*llx", LIBNAME, LIBVERSION, UUID_LEN, (unsigned long long)uuid_next());
+    TRACE(TRACE_DEBUG, "GetUUID() return %s", buf);
+    return buf;
 }
 
 void parmerror(const char *context, UDF_ARGS *args)
 {
     char *type;
 
-#ifdef DEBUG
-    setlogmask (LOG_UPTO (LOG_NOTICE));
-    openlog (LIBNAME, LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-    syslog (LOG_NOTICE, "parmerror()");
-#endif
+    TRACE(TRACE_DEBUG, "parmerror()");
     fprintf(stderr, "%s parameter error:\n", context);
     for (int i=0; i<args->arg_count; i++) {
         switch (args->arg_type[i]) {
@@ -107,1267 +277,5964 @@ void parmerror(const char *context, UDF_ARGS *args)
                 (args->arg_type[i]==STRING_RESULT && args->args[i]!=NULL) ? (char *)args->args[i] : ""
                 );
     }
-#ifdef DEBUG
-    closelog ();
-#endif
 }
 
-int get_json_value(const char *jsonstr, const char *key, int type, void *jsonvalue)
+/* options JSON keys, their expected type and target in mqtt_options */
+static const struct {
+    const char *name;
+    json_type type;
+    size_t offset;
+} option_keys[] = {
+    // Connection options
+    {"username",            json_string,  offsetof(mqtt_options, username)},
+    {"password",            json_string,  offsetof(mqtt_options, password)},
+    {"keepAliveInterval",   json_integer, offsetof(mqtt_options, keepAliveInterval)},
+    {"cleansession",        json_boolean, offsetof(mqtt_options, cleansession)},
+    {"MQTTVersion",         json_integer, offsetof(mqtt_options, MQTTVersion)},
+    {"reliable",            json_integer, offsetof(mqtt_options, reliable)},
+    {"connectTimeout",      json_integer, offsetof(mqtt_options, connectTimeout)},
+    {"maxInflightMessages", json_integer, offsetof(mqtt_options, maxInflightMessages)},
+    {"clientId",            json_string,  offsetof(mqtt_options, clientId)},
+    // SSL options
+    {"CApath",              json_string,  offsetof(mqtt_options, CApath)},
+    {"CAfile",              json_string,  offsetof(mqtt_options, CAfile)},
+    {"keyStore",            json_string,  offsetof(mqtt_options, keyStore)},
+    {"privateKey",          json_string,  offsetof(mqtt_options, privateKey)},
+    {"privateKeyPassword",  json_string,  offsetof(mqtt_options, privateKeyPassword)},
+    {"enabledCipherSuites", json_string,  offsetof(mqtt_options, enabledCipherSuites)},
+    {"verify",              json_boolean, offsetof(mqtt_options, verify)},
+    {"enableServerCertAuth",json_boolean, offsetof(mqtt_options, enableServerCertAuth)},
+    {"sslVersion",          json_integer, offsetof(mqtt_options, sslVersion)},
+    // Last Will and Testament options
+    {"willTopic",           json_string,  offsetof(mqtt_options, willTopic)},
+    {"willMessage",         json_string,  offsetof(mqtt_options, willMessage)},
+    {"willRetained",        json_boolean, offsetof(mqtt_options, willRetained)},
+    {"willQos",             json_integer, offsetof(mqtt_options, willQos)},
+    // Library options
+    {"pool",                json_boolean, offsetof(mqtt_options, pool)},
+    {"async",               json_boolean, offsetof(mqtt_options, async)},
+    {"queueSize",           json_integer, offsetof(mqtt_options, queueSize)},
+    {"queueOverflow",       json_string,  offsetof(mqtt_options, queueOverflow)},
+    {"queueBatch",          json_integer, offsetof(mqtt_options, queueBatch)},
+    {"queueLinger",         json_integer, offsetof(mqtt_options, queueLinger)},
+    {"coalesceWindow",      json_integer, offsetof(mqtt_options, coalesceWindow)},
+    {"receiveQueue",        json_integer, offsetof(mqtt_options, receiveQueue)},
+    {"maxPayload",          json_integer, offsetof(mqtt_options, maxPayload)},
+    {"shareGroup",          json_string,  offsetof(mqtt_options, shareGroup)},
+    {"compress",            json_integer, offsetof(mqtt_options, compress)},
+    {"compressLevel",       json_integer, offsetof(mqtt_options, compressLevel)},
+    {"compressDict",        json_string,  offsetof(mqtt_options, compressDict)},
+    {"reconnect",           json_boolean, offsetof(mqtt_options, reconnect)},
+    {"reconnectDelay",      json_integer, offsetof(mqtt_options, reconnectDelay)},
+    {"reconnectMaxDelay",   json_integer, offsetof(mqtt_options, reconnectMaxDelay)},
+    {"offlineBuffer",       json_integer, offsetof(mqtt_options, offlineBuffer)},
+    {"persistence",         json_string,  offsetof(mqtt_options, persistence)},
+    {"persistenceSize",     json_integer, offsetof(mqtt_options, persistenceSize)},
+    {"persistenceSync",     json_integer, offsetof(mqtt_options, persistenceSync)},
+    // MQTT 5 options
+    {"messageExpiry",       json_integer, offsetof(mqtt_options, messageExpiry)},
+    {"contentType",         json_string,  offsetof(mqtt_options, contentType)},
+    {"userProperties",      json_object,  offsetof(mqtt_options, userProperties)},
+    {"topicAliasMaximum",   json_integer, offsetof(mqtt_options, topicAliasMaximum)},
+};
+
+void clear_options(mqtt_options *opts)
+{
+    memset(opts, 0, sizeof(mqtt_options));
+    for (int k=0; k<sizeof(option_keys)/sizeof(option_keys[0]); k++) {
+        if (json_string != option_keys[k].type && json_object != option_keys[k].type) {
+            *(long *)((char *)opts + option_keys[k].offset) = OPTION_UNSET;
+        }
+    }
+}
+
+void free_options(mqtt_options *opts)
+{
+    if (opts->json != NULL) {
+        json_value_free(opts->json);
+    }
+    clear_options(opts);
+}
+
+/*
+ * Parse options JSON string into opts using a single pass over the object
+ * members. String values point into opts->json and remain valid until
+ * free_options() is called. Unknown keys and keys with wrong value type
+ * are ignored.
+ */
+int parse_options(mqtt_options *opts, const char *jsonstr, unsigned long length)
 {
-    int rc = JSON_OK;
-    int i;
+    json_value *value;
 
-    if (NULL == jsonstr || !*jsonstr) {
+    clear_options(opts);
+    if (NULL == jsonstr || 0 == length) {
         return JSON_ERROR_EMPTY_STR;
     }
 
-    json_char *json = (json_char*)jsonstr;
-    json_value *value = json_parse(json, strlen(jsonstr));
-    if (value == NULL || json_object != value->type) {
+    value = json_parse((json_char*)jsonstr, length);
+    if (value == NULL) {
+        return JSON_ERROR_INVALID_STR;
+    }
+    if (json_object != value->type) {
+        json_value_free(value);
         return JSON_ERROR_INVALID_STR;
     }
+    opts->json = value;
 
-    for (i=0; i<value->u.object.length; i++) {
-        if(0 == strcmp(key, value->u.object.values[i].name)) {
-            if (type != value->u.object.values[i].value->type) {
-                rc = JSON_ERROR_WRONG_TYPE;
+    for (int i=0; i<value->u.object.length; i++) {
+        json_value *member = value->u.object.values[i].value;
+        for (int k=0; k<sizeof(option_keys)/sizeof(option_keys[0]); k++) {
+            if (0 != strcmp(option_keys[k].name, value->u.object.values[i].name)) {
+                continue;
             }
-            else {
-                switch (value->u.object.values[i].value->type) {
-                    case json_none:
-                            rc = JSON_ERROR_WRONG_VALUE;
-                            break;
-                    case json_null:
-                            rc = JSON_ERROR_WRONG_VALUE;
-                            break;
-                    case json_object:
-                            rc = JSON_ERROR_WRONG_VALUE;
-                            break;
-                    case json_array:
-                            rc = JSON_ERROR_WRONG_VALUE;
-                            break;
+            if (option_keys[k].type == member->type) {
+                void *target = (char *)opts + option_keys[k].offset;
+                switch (member->type) {
                     case json_integer:
-                            *(long *)jsonvalue = (long)value->u.object.values[i].value->u.integer;
-                            break;
-                    case json_double:
-                            rc = JSON_ERROR_WRONG_VALUE;
-                            break;
-                    case json_string:
-                            *(char **)jsonvalue = value->u.object.values[i].value->u.string.ptr;
-                            break;
+                        *(long *)target = (long)member->u.integer;
+                        break;
                     case json_boolean:
-                            *(bool *)jsonvalue = (bool)value->u.object.values[i].value->u.boolean;
-                            break;
+                        *(long *)target = (long)member->u.boolean;
+                        break;
+                    case json_string:
+                        *(const char **)target = member->u.string.ptr;
+                        break;
+                    case json_object:
+                        *(json_value **)target = member;
+                        break;
+                    default:
+                        break;
                 }
-                break;
             }
+            break;
         }
     }
-    if (i>=value->u.object.length) {
-        rc = JSON_ERROR_NOT_FOUND;
-    }
-    json_value_free(value);
-   return rc;
+    return JSON_OK;
 }
 
-void create_conn(connection *conn, const char* username, const char*password, const char *options)
+void create_conn(connection *conn, const char* username, const char*password, const mqtt_options *opts)
 {
-    char *opt_str;
-    long opt_long;
-    bool opt_bool;
-
-#ifdef DEBUG
-    setlogmask (LOG_UPTO (LOG_NOTICE));
-    openlog (LIBNAME, LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-    syslog (LOG_NOTICE, "create_conn()");
-#endif
+    TRACE(TRACE_DEBUG, "create_conn()");
     memcpy(&conn->conn_opts, &(MQTTClient_connectOptions)MQTTClient_connectOptions_initializer, sizeof(MQTTClient_connectOptions));
     memcpy(&conn->ssl_opts, &(MQTTClient_SSLOptions)MQTTClient_SSLOptions_initializer, sizeof(MQTTClient_SSLOptions));
     memcpy(&conn->will_opts, &(MQTTClient_willOptions)MQTTClient_willOptions_initializer, sizeof(MQTTClient_willOptions));
     conn->conn_opts.ssl = &conn->ssl_opts;
 
     // Connection options
-    if (JSON_OK == get_json_value(options, "username", json_string, &opt_str)) {
-        conn->conn_opts.username = opt_str;
-    }
-    else {
-        conn->conn_opts.username = username;
-    }
-    if (JSON_OK == get_json_value(options, "password", json_string, &opt_str)) {
-        conn->conn_opts.password = opt_str;
-    }
-    else {
-        conn->conn_opts.password = password;
-    }
-    if (JSON_OK == get_json_value(options, "keepAliveInterval", json_integer, &opt_long)) {
-        conn->conn_opts.keepAliveInterval = opt_long;
-    }
-    else {
-        conn->conn_opts.keepAliveInterval = DEFAULT_KEEPALIVEINTERVAL;
-    }
-    if (JSON_OK == get_json_value(options, "cleansession", json_boolean, &opt_bool)) {
-        conn->conn_opts.cleansession = opt_bool;
-    }
-    else {
-        conn->conn_opts.cleansession = 1;
+    conn->conn_opts.username = opts->username != NULL ? opts->username : username;
+    conn->conn_opts.password = opts->password != NULL ? opts->password : password;
+    conn->conn_opts.keepAliveInterval = opts->keepAliveInterval != OPTION_UNSET ? opts->keepAliveInterval : DEFAULT_KEEPALIVEINTERVAL;
+    conn->conn_opts.cleansession = opts->cleansession != OPTION_UNSET ? opts->cleansession : 1;
+    conn->conn_opts.MQTTVersion = opts->MQTTVersion != OPTION_UNSET ? opts->MQTTVersion : MQTTVERSION_DEFAULT;
+    if (conn->conn_opts.MQTTVersion >= MQTTVERSION_5) {
+        // MQTT 5 replaces clean session by clean start
+        conn->conn_opts.cleanstart = conn->conn_opts.cleansession;
+        conn->conn_opts.cleansession = 0;
     }
-    if (JSON_OK == get_json_value(options, "MQTTVersion", json_integer, &opt_long)) {
-        conn->conn_opts.MQTTVersion = opt_long;
+    if (opts->reliable != OPTION_UNSET) {
+        conn->conn_opts.reliable = opts->reliable;
     }
-    else {
-        conn->conn_opts.MQTTVersion = MQTTVERSION_DEFAULT;
-    }
-    if (JSON_OK == get_json_value(options, "reliable", json_integer, &opt_long)) {
-        conn->conn_opts.reliable = opt_long;
+    if (opts->connectTimeout != OPTION_UNSET) {
+        conn->conn_opts.connectTimeout = opts->connectTimeout;
     }
-    if (JSON_OK == get_json_value(options, "connectTimeout", json_integer, &opt_long)) {
-        conn->conn_opts.connectTimeout = opt_long;
-    }
-    if (JSON_OK == get_json_value(options, "maxInflightMessages", json_integer, &opt_long)) {
-        conn->conn_opts.maxInflightMessages = opt_long;
+    if (opts->maxInflightMessages != OPTION_UNSET) {
+        conn->conn_opts.maxInflightMessages = opts->maxInflightMessages;
     }
 
     // SSL options
-    if (JSON_OK == get_json_value(options, "CApath", json_string, &opt_str)) {
-        conn->ssl_opts.CApath = opt_str;
+    if (opts->CApath != NULL) {
+        conn->ssl_opts.CApath = opts->CApath;
     }
-    if (JSON_OK == get_json_value(options, "CAfile", json_string, &opt_str)) {
-        conn->ssl_opts.trustStore = opt_str;
+    if (opts->CAfile != NULL) {
+        conn->ssl_opts.trustStore = opts->CAfile;
     }
-    if (JSON_OK == get_json_value(options, "keyStore", json_string, &opt_str)) {
-        conn->ssl_opts.keyStore = opt_str;
+    if (opts->keyStore != NULL) {
+        conn->ssl_opts.keyStore = opts->keyStore;
     }
-    if (JSON_OK == get_json_value(options, "privateKey", json_string, &opt_str)) {
-        conn->ssl_opts.privateKey = opt_str;
+    if (opts->privateKey != NULL) {
+        conn->ssl_opts.privateKey = opts->privateKey;
     }
-    if (JSON_OK == get_json_value(options, "privateKeyPassword", json_string, &opt_str)) {
-        conn->ssl_opts.privateKeyPassword = opt_str;
+    if (opts->privateKeyPassword != NULL) {
+        conn->ssl_opts.privateKeyPassword = opts->privateKeyPassword;
     }
-    if (JSON_OK == get_json_value(options, "enabledCipherSuites", json_string, &opt_str)) {
-        conn->ssl_opts.enabledCipherSuites = opt_str;
+    if (opts->enabledCipherSuites != NULL) {
+        conn->ssl_opts.enabledCipherSuites = opts->enabledCipherSuites;
     }
-    if (JSON_OK == get_json_value(options, "verify", json_boolean, &opt_bool)) {
-        conn->ssl_opts.verify = opt_bool;
+    if (opts->verify != OPTION_UNSET) {
+        conn->ssl_opts.verify = opts->verify;
     }
-    if (JSON_OK == get_json_value(options, "enableServerCertAuth", json_boolean, &opt_bool)) {
-        conn->ssl_opts.enableServerCertAuth = opt_bool;
+    if (opts->enableServerCertAuth != OPTION_UNSET) {
+        conn->ssl_opts.enableServerCertAuth = opts->enableServerCertAuth;
     }
-    if (JSON_OK == get_json_value(options, "sslVersion", json_integer, &opt_long)) {
-        conn->ssl_opts.sslVersion = opt_long;
+    if (opts->sslVersion != OPTION_UNSET) {
+        conn->ssl_opts.sslVersion = opts->sslVersion;
     }
 
     // Last Will and Testament options
-    if (JSON_OK == get_json_value(options, "willTopic", json_string, &opt_str)) {
-        conn->will_opts.topicName = opt_str;
+    if (opts->willTopic != NULL) {
+        conn->will_opts.topicName = opts->willTopic;
         conn->conn_opts.will = &conn->will_opts;
     }
-    if (JSON_OK == get_json_value(options, "willMessage", json_string, &opt_str)) {
-        conn->will_opts.message = opt_str;
+    if (opts->willMessage != NULL) {
+        conn->will_opts.message = opts->willMessage;
         conn->conn_opts.will = &conn->will_opts;
     }
-    if (JSON_OK == get_json_value(options, "willRetained", json_boolean, &opt_bool)) {
-        conn->will_opts.retained = opt_bool;
+    if (opts->willRetained != OPTION_UNSET) {
+        conn->will_opts.retained = opts->willRetained;
         conn->conn_opts.will = &conn->will_opts;
     }
-    if (JSON_OK == get_json_value(options, "willQos", json_integer, &opt_long)) {
-        conn->will_opts.qos = opt_long;
+    if (opts->willQos != OPTION_UNSET) {
+        conn->will_opts.qos = opts->willQos;
         conn->conn_opts.will = &conn->will_opts;
     }
 
-#ifdef DEBUG
-    closelog ();
-#endif
- }
+}
 
-/* Library functions */
+/* Strings of connect options copied by connect_keep() */
+static const size_t connect_strings[] = {
+    offsetof(connect_copy, conn_opts.username),
+    offsetof(connect_copy, conn_opts.password),
+    offsetof(connect_copy, ssl_opts.trustStore),
+    offsetof(connect_copy, ssl_opts.keyStore),
+    offsetof(connect_copy, ssl_opts.privateKey),
+    offsetof(connect_copy, ssl_opts.privateKeyPassword),
+    offsetof(connect_copy, ssl_opts.enabledCipherSuites),
+    offsetof(connect_copy, ssl_opts.CApath),
+    offsetof(connect_copy, will_opts.topicName),
+    offsetof(connect_copy, will_opts.message),
+};
 
-/**
- * mqtt_info
- *
- * Returns udf library info as JSON string
- * mqtt_info()
- *
+/*
+ * Copy the connect options set up by create_conn() including their strings,
+ * which point into the options of a statement, into a single allocation.
+ * Returns NULL on memory allocation error.
  */
-bool mqtt_info_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+connect_copy *connect_keep(const MQTTClient_connectOptions *conn_opts)
 {
-    if (args->arg_count != 0) {
-        parmerror("mqtt_info()", args);
-        strcpy(message, "No arguments allowed (udf: mqtt_info)");
-        return 1;
+    connect_copy head = {
+        .conn_opts = *conn_opts,
+        .ssl_opts = MQTTClient_SSLOptions_initializer,
+        .will_opts = MQTTClient_willOptions_initializer,
+    };
+    connect_copy *copy;
+    size_t size = 0;
+    char *p;
+
+    if (conn_opts->ssl != NULL) {
+        head.ssl_opts = *conn_opts->ssl;
     }
-    initid->ptr = malloc(MAX_RET_STRLEN+1);
-    if (initid->ptr == NULL) {
-        strcpy(message, "memory allocation error");
-        return 1;
+    if (conn_opts->will != NULL) {
+        head.will_opts = *conn_opts->will;
     }
-    initid->max_length = MAX_RET_STRLEN;
+    for (int i=0; i<sizeof(connect_strings)/sizeof(connect_strings[0]); i++) {
+        const char *str = *(const char **)((char *)&head + connect_strings[i]);
+        size += str != NULL ? strlen(str) + 1 : 0;
+    }
+    if ((copy = malloc(sizeof(connect_copy) + size)) == NULL) {
+        return NULL;
+    }
+    memcpy(copy, &head, sizeof(connect_copy));
+    p = copy->strings;
+    for (int i=0; i<sizeof(connect_strings)/sizeof(connect_strings[0]); i++) {
+        const char **str = (const char **)((char *)copy + connect_strings[i]);
+        if (*str != NULL) {
+            size = strlen(*str) + 1;
+            memcpy(p, *str, size);
+            *str = p;
+            p += size;
+        }
+    }
+    copy->conn_opts.ssl = conn_opts->ssl != NULL ? &copy->ssl_opts : NULL;
+    copy->conn_opts.will = conn_opts->will != NULL ? &copy->will_opts : NULL;
+    return copy;
+}
 
-    return 0;
+/* Statistics of all connections, see mqtt_stats() */
+client_stats stats_global;
+
+/* Monotonic time in us */
+uint64_t stats_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
 }
 
-void mqtt_info_deinit(UDF_INIT *initid)
+/* Absolute time now + ms for pthread_cond_timedwait() */
+void deadline(struct timespec *ts, long ms)
 {
-    if (initid->ptr != NULL) {
-        free(initid->ptr);
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec  += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
     }
 }
 
-char* mqtt_info(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error)
+/*
+ * Histogram bucket of us: values below 2^HIST_SUB_BITS are exact, above
+ * each power of 2 is split into 2^HIST_SUB_BITS linear buckets.
+ */
+unsigned int hist_index(uint64_t us)
 {
-    MQTTClient_nameValue *mqttClientVersion;
-    char libinfo[MAX_RET_STRLEN] = {0};
-    char *res = (char *)initid->ptr;
+    unsigned int e, idx;
 
-#ifdef DEBUG
-    setlogmask (LOG_UPTO (LOG_NOTICE));
-    openlog (LIBNAME, LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-    syslog (LOG_NOTICE, "mqtt_info()");
-#endif
-
-    *is_null = 0;
-    *error = 0;
-
-    if (res == NULL) {
-        strcpy(result, "memory allocation error");
-        *length = strlen(result);
-        *error = 1;
-        return result;
+    if (us < (1u << HIST_SUB_BITS)) {
+        return (unsigned int)us;
     }
+    e = 63 - __builtin_clzll(us);
+    idx = ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + (unsigned int)((us >> (e - HIST_SUB_BITS)) - (1u << HIST_SUB_BITS));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
 
-    mqttClientVersion = MQTTClient_getVersionInfo();
-    while (mqttClientVersion != NULL &&
-           mqttClientVersion->name != NULL &&
-           mqttClientVersion->value != NULL &&
-           strlen(libinfo) < MAX_RET_STRLEN-1) {
-        if (*libinfo) {
-            strcat(libinfo, ",");
-        }
-        if( (strlen(libinfo) + strlen(mqttClientVersion->name) + strlen(mqttClientVersion->value) + 5) < MAX_RET_STRLEN-1) {
-            char *value = malloc(strlen(mqttClientVersion->value));
-            if (value != NULL) {
-                strcpy(value, mqttClientVersion->value);
-                sprintf(libinfo+strlen(libinfo), "\"%s\":\"%s\"", mqttClientVersion->name, strcrpl(value, '"', '\''));
-                free(value);
-            }
-            mqttClientVersion++;
-        }
+/* Highest value counted by bucket idx */
+uint64_t hist_value(unsigned int idx)
+{
+    unsigned int e;
+
+    if (idx < (1u << HIST_SUB_BITS)) {
+        return idx;
     }
+    e = (idx >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    return ((uint64_t)((idx & ((1u << HIST_SUB_BITS) - 1)) + (1u << HIST_SUB_BITS) + 1) << (e - HIST_SUB_BITS)) - 1;
+}
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wformat-truncation"
-    snprintf(res, MAX_RET_STRLEN, "{\"Name\": \"%s\", \"Version\": \"%s\", \"Build\": \"%s\", \"Library\": {%s}}", LIBNAME, LIBVERSION, LIBBUILD, libinfo);
-#pragma GCC diagnostic pop
+void hist_record(histogram *h, uint64_t us)
+{
+    unsigned long max = atomic_load(&h->max);
 
-    *length = strlen(res);
-#ifdef DEBUG
-    syslog (LOG_NOTICE, "mqtt_info(): %s", res);
-    closelog ();
-#endif
-    return res;
+    atomic_fetch_add(&h->count, 1);
+    atomic_fetch_add(&h->sum, us);
+    atomic_fetch_add(&h->buckets[hist_index(us)], 1);
+    while (us > max && !atomic_compare_exchange_weak(&h->max, &max, us));
 }
 
-/**
- * mqtt_lasterror
- *
- * Returns last error as JSON string
- * mqtt_lasterror()
- *
- */
-bool mqtt_lasterror_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+/* Record the latency since start (see stats_clock()) globally and for st (may be NULL) */
+void stats_latency(client_stats *st, int type, uint64_t start)
 {
-    if (args->arg_count != 0) {
-        parmerror("mqtt_lasterror()", args);
-        strcpy(message, "No arguments allowed (udf: mqtt_lasterror)");
-        return 1;
-    }
-    initid->ptr = malloc(MAX_RET_STRLEN+1);
-    if (initid->ptr == NULL) {
-        strcpy(message, "memory allocation error");
-        return 1;
-    }
+    uint64_t us = stats_clock() - start;
 
-    return 0;
+    hist_record(&stats_global.latency[type], us);
+    if (st != NULL) {
+        hist_record(&st->latency[type], us);
+    }
 }
 
-void mqtt_lasterror_deinit(UDF_INIT *initid)
+void stats_add(client_stats *st, int counter, unsigned long n)
 {
-    if (initid->ptr != NULL) {
-        free(initid->ptr);
+    atomic_fetch_add(&stats_global.counters[counter], n);
+    if (st != NULL) {
+        atomic_fetch_add(&st->counters[counter], n);
     }
 }
 
-char* mqtt_lasterror(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error)
+void stats_error(client_stats *st, int rc)
 {
-    char *res = (char *)initid->ptr;
-
-#ifdef DEBUG
-    setlogmask (LOG_UPTO (LOG_NOTICE));
-    openlog (LIBNAME, LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-    syslog (LOG_NOTICE, "mqtt_lasterror()");
-#endif
+    int idx = rc < 0 && rc > -STATS_RC_MAX ? -rc : 0;
 
-    *is_null = 0;
-    *error = 0;
-    if (res == NULL) {
-        strcpy(result, "memory allocation error");
-        *length = strlen(result);
-        *error = 1;
-        return result;
+    stats_add(st, STAT_ERRORS, 1);
+    atomic_fetch_add(&stats_global.errors[idx], 1);
+    if (st != NULL) {
+        atomic_fetch_add(&st->errors[idx], 1);
     }
-    snprintf(res, MAX_RET_STRLEN, "{\"func\":\"%s\",\"rc\":%d, \"desc\": \"%s\"}", last_func, last_rc, MQTTClient_strerror(last_rc));
-    *length = strlen(res);
-#ifdef DEBUG
-    syslog (LOG_NOTICE, "mqtt_lasterror(): %s", res);
-    closelog ();
-#endif
-    return res;
 }
 
-
-/**
- * mqtt_connect
+/*
+ * Client persistence
  *
- * Connect to a mqtt server and returns a handle.
- * mqtt_connect(server {,username} {,password {,options}}})
- *      returns connect handle or 0 on error
+ * Paho keeps unconfirmed QoS 1/2 messages in its persistence. With option
+ * persistence they are stored in a preallocated, memory-mapped append log
+ * per client id and server: each put or remove appends a record, the log
+ * is compacted into a new file once it is full. Records written to the
+ * shared mapping survive a crash of mysqld at once; they are synced to
+ * disk as a group at most every persistenceSync ms instead of once per
+ * message.
  */
-bool mqtt_connect_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+
+/* Returns the size of a record with n bytes of key and data */
+size_t plog_record_size(size_t n)
 {
-    initid->ptr = NULL;
-    if (   // server
-        (args->arg_count == 1 && args->arg_type[0]==STRING_RESULT && args->args[0]!=NULL)
-        || // server, username
-        (args->arg_count == 2 && args->arg_type[0]==STRING_RESULT && args->args[0]!=NULL
-                              && args->arg_type[1]==STRING_RESULT)
-        || // server, username, password
-        (args->arg_count == 3 && args->arg_type[0]==STRING_RESULT && args->args[0]!=NULL
-                              && args->arg_type[1]==STRING_RESULT
-                              && args->arg_type[2]==STRING_RESULT)
-        || // server, username, password, options
-        (args->arg_count == 4 && args->arg_type[0]==STRING_RESULT && args->args[0]!=NULL
-                              && args->arg_type[1]==STRING_RESULT
-                              && args->arg_type[2]==STRING_RESULT
-                              && args->arg_type[3]==STRING_RESULT)
-       ) {
-        initid->ptr = malloc(sizeof(connection));
-        if (initid->ptr == NULL) {
-            parmerror("mqtt_connect()", args);
-            strcpy(message, "memory allocation error");
-            return 1;
+    return (sizeof(plog_record) + n + PLOG_ALIGN - 1) & ~(size_t)(PLOG_ALIGN - 1);
+}
+
+/* Returns the link to the key or to NULL */
+plog_key **plog_find(plog *log, const char *key, unsigned int hash)
+{
+    plog_key **pp;
+
+    for (pp = &log->keys[hash % PLOG_BUCKETS]; *pp != NULL; pp = &(*pp)->next) {
+        if ((*pp)->hash == hash && 0 == strcmp((*pp)->key, key)) {
+            break;
         }
-        return 0;
     }
-    else {
-        parmerror("mqtt_connect()", args);
-        strcpy(message, "function argument(s) error");
-        return 1;
+    return pp;
+}
+
+/* Apply the record at offset to the keys, returns false on memory allocation error */
+bool plog_index(plog *log, size_t offset)
+{
+    plog_record *rec = (plog_record *)(log->map + offset);
+    const char *key = (const char *)(rec + 1);
+    unsigned int hash = named_hash(key, rec->keylen);
+    plog_key **pp, *entry;
+    char buf[rec->keylen + 1];
+
+    memcpy(buf, key, rec->keylen);
+    buf[rec->keylen] = '\0';
+    pp = plog_find(log, buf, hash);
+    if (rec->type == PLOG_REMOVE) {
+        if ((entry = *pp) != NULL) {
+            *pp = entry->next;
+            free(entry);
+            log->count--;
+        }
+        return true;
+    }
+    if ((entry = *pp) == NULL) {
+        if ((entry = malloc(sizeof(plog_key) + rec->keylen + 1)) == NULL) {
+            return false;
+        }
+        entry->next = NULL;
+        entry->hash = hash;
+        memcpy(entry->key, buf, rec->keylen + 1);
+        *pp = entry;
+        log->count++;
     }
+    entry->offset = offset;
+    return true;
 }
 
-void mqtt_connect_deinit(UDF_INIT *initid)
+/* Checksum of a record with len bytes of key and data */
+uint32_t plog_crc(const plog_record *rec, uint32_t len)
 {
-    if (initid->ptr != NULL) {
-        free(initid->ptr);
+    uLong crc = crc32(0L, Z_NULL, 0);
+
+    crc = crc32(crc, (const Bytef *)&rec->keylen, sizeof(plog_record) - offsetof(plog_record, keylen));
+    return (uint32_t)crc32(crc, (const Bytef *)(rec + 1), len);
+}
+
+/*
+ * Create or open the file at path with at least size bytes, lock it
+ * exclusively, so no two clients with the same id and server append to
+ * it, and map it. Returns false on error, errno is EWOULDBLOCK if locked.
+ */
+bool plog_map(plog *log, const char *path, size_t size)
+{
+    struct stat st, cur;
+
+    for (;;) {
+        log->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (log->fd < 0) {
+            return false;
+        }
+        if (flock(log->fd, LOCK_EX | LOCK_NB) != 0 || fstat(log->fd, &st) != 0) {
+            close(log->fd);
+            return false;
+        }
+        // a compaction may have replaced the file before it was locked
+        if (stat(path, &cur) == 0 && cur.st_ino == st.st_ino && cur.st_dev == st.st_dev) {
+            break;
+        }
+        close(log->fd);
+    }
+    if ((size_t)st.st_size > size) {
+        size = st.st_size;
+    }
+    // preallocated, so appending never hits a full disk as SIGBUS
+    if (((size_t)st.st_size < size && posix_fallocate(log->fd, 0, size) != 0)
+        || (log->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0)) == MAP_FAILED) {
+        close(log->fd);
+        log->map = NULL;
+        return false;
     }
+    log->size = size;
+    return true;
 }
 
-ulonglong mqtt_connect(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+/* Sync the records written since the last sync if due or forced, log->mutex must be held */
+void plog_sync(plog *log, bool force)
 {
-    connection *conn = (connection *)initid->ptr;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t start = log->synced & ~(size_t)(page - 1);
+    uint64_t now = stats_clock();
 
-#ifdef DEBUG
-    setlogmask (LOG_UPTO (LOG_NOTICE));
-    openlog (LIBNAME, LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-#endif
+    if (log->synced < log->end && (force || log->sync <= 0 || now - log->last_sync >= (uint64_t)log->sync * 1000)) {
+        if (msync(log->map + start, log->end - start, MS_SYNC) == 0) {
+            log->synced = log->end;
+        }
+        log->last_sync = now;
+    }
+}
 
-    *is_null = 0;
-    *error = 0;
+/*
+ * Open logs are synced by a background thread once their sync interval
+ * has passed, so the last records of a burst don't wait for the next put.
+ */
+pthread_mutex_t plog_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t plog_cond = PTHREAD_COND_INITIALIZER;
+plog *plog_list = NULL;
+bool plog_running = false;
+bool plog_stopping = false;
+pthread_t plog_thread;
 
-    char *address  = "";
-    char *username = "";
-    char *password = "";
-    char *options  = "";
+void *plog_run(void *arg)
+{
+    struct timespec ts;
+    long wait, due;
 
-    // Do not assume that the string is null-terminated
-    // see https://dev.mysql.com/doc/refman/5.7/en/udf-arguments.html
-    if (args->arg_count >= 1 && args->args[0]!=NULL) {
-        address   = (char *)args->args[0];
-        address[args->lengths[0]]  = '\0';
+    pthread_mutex_lock(&plog_mutex);
+    while (!plog_stopping) {
+        wait = 0;
+        for (plog *log = plog_list; log != NULL; log = log->next) {
+            pthread_mutex_lock(&log->mutex);
+            plog_sync(log, false);
+            // records appended after this are due no earlier than a full interval
+            due = log->sync;
+            if (log->synced < log->end) {
+                due -= (long)((stats_clock() - log->last_sync) / 1000);
+                due = due > 0 ? due : 1;
+            }
+            pthread_mutex_unlock(&log->mutex);
+            if (wait == 0 || due < wait) {
+                wait = due;
+            }
+        }
+        if (wait == 0) {
+            pthread_cond_wait(&plog_cond, &plog_mutex);
+        }
+        else {
+            deadline(&ts, wait);
+            pthread_cond_timedwait(&plog_cond, &plog_mutex, &ts);
+        }
     }
-    if (args->arg_count >= 2 && args->args[1]!=NULL) {
-        username  = (char *)args->args[1];
-        username[args->lengths[1]] = '\0';
+    pthread_mutex_unlock(&plog_mutex);
+    return NULL;
+}
+
+/* Add log to the logs synced in the background, returns false if the thread can't be started */
+bool plog_watch(plog *log)
+{
+    pthread_mutex_lock(&plog_mutex);
+    if (!plog_running && !plog_stopping) {
+        plog_running = 0 == pthread_create(&plog_thread, NULL, plog_run, NULL);
     }
-    if (args->arg_count >= 3 && args->args[2]!=NULL) {
-        password  = (char *)args->args[2];
-        password[args->lengths[2]] = '\0';
+    if (plog_running) {
+        log->next = plog_list;
+        plog_list = log;
+        pthread_cond_signal(&plog_cond);
     }
-    if (args->arg_count >= 4 && args->args[3]!=NULL) {
-        options  = (char *)args->args[3];
-        options[args->lengths[3]] = '\0';
+    pthread_mutex_unlock(&plog_mutex);
+    return plog_running;
+}
+
+void plog_unwatch(plog *log)
+{
+    pthread_mutex_lock(&plog_mutex);
+    for (plog **pp = &plog_list; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == log) {
+            *pp = log->next;
+            break;
+        }
     }
+    pthread_mutex_unlock(&plog_mutex);
+}
 
-#ifdef DEBUG
-    syslog (LOG_NOTICE, "mqtt_connect(): MQTTClient_create \"%s\"", address);
-#endif
-    strcpy(last_func, "MQTTClient_create");
-    int rc = last_rc = MQTTClient_create(&conn->client, address, GetUUID(), MQTTCLIENT_PERSISTENCE_NONE, NULL);
-    if (rc != MQTTCLIENT_SUCCESS)
-    {
-#ifdef DEBUG
-        syslog (LOG_NOTICE, "mqtt_connect rc=%d", rc);
-        closelog ();
-#endif
-        *is_null = 1;
-        *error = 1;
-        return rc;
+/* Stop the sync thread before the library is unloaded */
+__attribute__((destructor)) void plog_cleanup(void)
+{
+    pthread_mutex_lock(&plog_mutex);
+    plog_stopping = true;
+    pthread_cond_signal(&plog_cond);
+    pthread_mutex_unlock(&plog_mutex);
+    if (plog_running) {
+        pthread_join(plog_thread, NULL);
+        plog_running = false;
     }
+}
 
-    create_conn(conn, username, password, options);
+/* Sync the directory of path, so a renamed file persists */
+void plog_sync_dir(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    size_t len = slash != NULL ? (size_t)(slash - path) : 0;
+    char dir[len + 2];
+    int fd;
 
-#ifdef DEBUG
-    syslog (LOG_NOTICE, "mqtt_connect 'client %p", conn->client);
-#endif
-    strcpy(last_func, "MQTTClient_connect");
-    rc = last_rc = MQTTClient_connect(conn->client, &conn->conn_opts);
-    if (rc != MQTTCLIENT_SUCCESS)
-    {
-#ifdef DEBUG
-        syslog (LOG_NOTICE, "mqtt_connect rc=%d", rc);
-        closelog ();
-#endif
-        *is_null = 1;
-        *error = 1;
-        return rc;
+    if (len == 0) {
+        strcpy(dir, slash != NULL ? "/" : ".");
     }
-#ifdef DEBUG
-    closelog ();
-#endif
-    return (longlong)conn->client;
+    else {
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+    }
+    if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/*
+ * Copy the live records into a new file replacing the log, with room for
+ * need more bytes. Returns false on error, the log remains unchanged.
+ */
+bool plog_compact(plog *log, size_t need)
+{
+    plog copy = {.sync = log->sync};
+    size_t live = 0, pathlen = strlen(log->path);
+    char tmp[pathlen + 5];
+
+    for (int i=0; i<PLOG_BUCKETS; i++) {
+        for (plog_key *entry = log->keys[i]; entry != NULL; entry = entry->next) {
+            live += plog_record_size(((plog_record *)(log->map + entry->offset))->len);
+        }
+    }
+    // keep at least half of the log free
+    for (copy.size = log->size; 2 * (live + need) > copy.size; copy.size *= 2);
+    memcpy(tmp, log->path, pathlen);
+    memcpy(tmp + pathlen, ".tmp", 5);
+    unlink(tmp);
+    if (!plog_map(&copy, tmp, copy.size)) {
+        unlink(tmp);
+        return false;
+    }
+    for (int i=0; i<PLOG_BUCKETS; i++) {
+        for (plog_key *entry = log->keys[i]; entry != NULL; entry = entry->next) {
+            size_t n = plog_record_size(((plog_record *)(log->map + entry->offset))->len);
+            memcpy(copy.map + copy.end, log->map + entry->offset, n);
+            copy.end += n;
+        }
+    }
+    if (msync(copy.map, copy.end, MS_SYNC) != 0 || rename(tmp, log->path) != 0) {
+        munmap(copy.map, copy.size);
+        close(copy.fd);
+        unlink(tmp);
+        return false;
+    }
+    plog_sync_dir(log->path);
+    // same order as copied above
+    copy.end = 0;
+    for (int i=0; i<PLOG_BUCKETS; i++) {
+        for (plog_key *entry = log->keys[i]; entry != NULL; entry = entry->next) {
+            size_t n = plog_record_size(((plog_record *)(log->map + entry->offset))->len);
+            entry->offset = copy.end;
+            copy.end += n;
+        }
+    }
+    munmap(log->map, log->size);
+    close(log->fd);
+    log->map = copy.map;
+    log->fd = copy.fd;
+    log->size = copy.size;
+    log->end = log->synced = copy.end;
+    TRACE(TRACE_INFO, "plog_compact(): %s, %lu bytes live", log->path, (unsigned long)live);
+    return true;
 }
 
+/* Append a record of type with the concatenated buffers as data, returns false on error */
+bool plog_append(plog *log, int type, const char *key, int bufcount, char *buffers[], int buflens[])
+{
+    size_t keylen = strlen(key), len = keylen, n;
+    plog_record *rec;
+    char *p;
 
+    for (int i=0; i<bufcount; i++) {
+        len += buflens[i];
+    }
+    n = plog_record_size(len);
+    if (keylen > UINT16_MAX || len > UINT32_MAX || (log->end + n > log->size && !plog_compact(log, n))) {
+        return false;
+    }
+    rec = (plog_record *)(log->map + log->end);
+    rec->keylen = (uint16_t)keylen;
+    rec->type = (uint8_t)type;
+    rec->reserved = 0;
+    p = memcpy((char *)(rec + 1), key, keylen) + keylen;
+    for (int i=0; i<bufcount; i++) {
+        memcpy(p, buffers[i], buflens[i]);
+        p += buflens[i];
+    }
+    rec->crc = plog_crc(rec, (uint32_t)len);
+    // a record becomes valid with its length, a crash before leaves the end marker
+    atomic_thread_fence(memory_order_release);
+    rec->len = (uint32_t)len;
+    if (!plog_index(log, log->end)) {
+        rec->len = 0;
+        return false;
+    }
+    log->end += n;
+    return true;
+}
 
+/* Free all keys */
+void plog_forget(plog *log)
+{
+    plog_key *entry;
 
+    for (int i=0; i<PLOG_BUCKETS; i++) {
+        while ((entry = log->keys[i]) != NULL) {
+            log->keys[i] = entry->next;
+            free(entry);
+        }
+    }
+    log->count = 0;
+}
 
-/**
- * mqtt_disconnect
- *
- * Disconnect from a mqtt server.
- * mqtt_disconnect(handle(, timeout))
- *  returns 0 if successful
+/*
+ * Paho persistence interface: context is the plog_config of the
+ * plog_persistence set up by client_create().
+ * Opens the log <dir>/<clientID>-<serverURI>.plog and restores its keys.
  */
-bool mqtt_disconnect_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+int plog_open(void **handle, const char *clientID, const char *serverURI, void *context)
 {
-    if ( args->arg_count == 1
-        // handle
-         && args->arg_type[0]==INT_RESULT
-         ) {
-        return 0;
+    const plog_config *config = (const plog_config *)context;
+    size_t dirlen = strlen(config->dir), n;
+    plog *log;
+    char *p;
+
+    *handle = NULL;
+    if ((log = calloc(1, sizeof(plog))) == NULL) {
+        return MQTTCLIENT_PERSISTENCE_ERROR;
     }
-    else {
-        parmerror("mqtt_disconnect()", args);
-        strcpy(message, "function argument(s) error");
-        return 1;
+    n = dirlen + strlen(clientID) + strlen(serverURI) + sizeof("/-.plog");
+    if ((log->path = malloc(n)) == NULL) {
+        free(log);
+        return MQTTCLIENT_PERSISTENCE_ERROR;
+    }
+    p = log->path + snprintf(log->path, n, "%s/", config->dir);
+    snprintf(p, n - (p - log->path), "%s-%s", clientID, serverURI);
+    // no path separators or other special characters from client id and server
+    for (; *p; p++) {
+        if (!isalnum((unsigned char)*p) && *p != '-' && *p != '_' && *p != '.') {
+            *p = '_';
+        }
+    }
+    strcpy(p, ".plog");
+    log->sync = config->sync;
+    if (!plog_map(log, log->path, config->size)) {
+        TRACE(TRACE_ERROR, "plog_open(): %s, errno=%d", log->path, errno);
+        free(log->path);
+        free(log);
+        return MQTTCLIENT_PERSISTENCE_ERROR;
+    }
+    // restore the keys up to the end marker or a torn record
+    while (log->end + sizeof(plog_record) <= log->size) {
+        plog_record *rec = (plog_record *)(log->map + log->end);
+
+        if (rec->len == 0 || rec->len < rec->keylen || log->end + plog_record_size(rec->len) > log->size
+            || rec->crc != plog_crc(rec, rec->len) || !plog_index(log, log->end)) {
+            break;
+        }
+        log->end += plog_record_size(rec->len);
+    }
+    // anything behind the end is overwritten by the next records
+    memset(log->map + log->end, 0, log->end + sizeof(plog_record) <= log->size ? sizeof(plog_record) : log->size - log->end);
+    log->synced = log->end;
+    log->last_sync = stats_clock();
+    pthread_mutex_init(&log->mutex, NULL);
+    // without the sync thread every put syncs
+    if (log->sync > 0 && !plog_watch(log)) {
+        log->sync = 0;
     }
+    TRACE(TRACE_INFO, "plog_open(): %s, %d keys", log->path, log->count);
+    *handle = log;
+    return MQTTCLIENT_SUCCESS;
 }
 
-void mqtt_disconnect_deinit(UDF_INIT *initid)
+int plog_close(void *handle)
 {
+    plog *log = (plog *)handle;
+
+    plog_unwatch(log);
+    plog_sync(log, true);
+    munmap(log->map, log->size);
+    close(log->fd);
+    plog_forget(log);
+    pthread_mutex_destroy(&log->mutex);
+    free(log->path);
+    free(log);
+    return MQTTCLIENT_SUCCESS;
 }
 
-ulonglong mqtt_disconnect(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+int plog_put(void *handle, char *key, int bufcount, char *buffers[], int buflens[])
 {
-    MQTTClient client = (MQTTClient)*(longlong*)args->args[0];
+    plog *log = (plog *)handle;
+    bool ok;
 
-#ifdef DEBUG
-    setlogmask (LOG_UPTO (LOG_NOTICE));
-    openlog (LIBNAME, LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-    syslog (LOG_NOTICE, "mqtt_disconnect()");
-#endif
-    strcpy(last_func, "MQTTClient_disconnect");
-    int rc = last_rc = MQTTClient_disconnect(client, DEFAULT_TIMEOUT);
-    if (rc == MQTTCLIENT_SUCCESS) {
-        MQTTClient_destroy(&client);
+    pthread_mutex_lock(&log->mutex);
+    if ((ok = plog_append(log, PLOG_PUT, key, bufcount, buffers, buflens))) {
+        plog_sync(log, false);
     }
-    else {
-        *error = 1;
+    pthread_mutex_unlock(&log->mutex);
+    return ok ? MQTTCLIENT_SUCCESS : MQTTCLIENT_PERSISTENCE_ERROR;
+}
+
+int plog_get(void *handle, char *key, char **buffer, int *buflen)
+{
+    plog *log = (plog *)handle;
+    plog_key *entry;
+    int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+    pthread_mutex_lock(&log->mutex);
+    if ((entry = *plog_find(log, key, named_hash(key, strlen(key)))) != NULL) {
+        plog_record *rec = (plog_record *)(log->map + entry->offset);
+
+        *buflen = rec->len - rec->keylen;
+        if ((*buffer = MQTTClient_malloc(*buflen > 0 ? *buflen : 1)) != NULL) {
+            memcpy(*buffer, (char *)(rec + 1) + rec->keylen, *buflen);
+            rc = MQTTCLIENT_SUCCESS;
+        }
     }
-#ifdef DEBUG
-    syslog (LOG_NOTICE, "mqtt_disconnect() rc=%d", rc);
-    closelog ();
-#endif
+    pthread_mutex_unlock(&log->mutex);
     return rc;
 }
 
+int plog_remove(void *handle, char *key)
+{
+    plog *log = (plog *)handle;
+    int rc = MQTTCLIENT_PERSISTENCE_ERROR;
 
-/**
- * mqtt_publish
- *
- * Publish a mqtt payload and returns its status.
- *
- * Possible calls
- * mqtt_publish(server, [username], [password], topic, [payload] {,[qos] {,[retained] {,[timeout] {,[options]}}}})
- * mqtt_publish(client, topic, [payload] {,[qos] {,[retained] {,[timeout] {,[options]}}}})
- */
-bool mqtt_publish_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+    pthread_mutex_lock(&log->mutex);
+    // a lost remove record only causes a duplicate delivery, no sync needed
+    if (*plog_find(log, key, named_hash(key, strlen(key))) != NULL && plog_append(log, PLOG_REMOVE, key, 0, NULL, NULL)) {
+        rc = MQTTCLIENT_SUCCESS;
+    }
+    pthread_mutex_unlock(&log->mutex);
+    return rc;
+}
+
+int plog_keys(void *handle, char ***keys, int *nkeys)
 {
-#ifdef DEBUG
-    setlogmask (LOG_UPTO (LOG_NOTICE));
-    openlog (LIBNAME, LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-#endif
-#ifdef DEBUG
-    syslog (LOG_NOTICE, "mqtt_publish_init()");
-#endif
-    initid->ptr = malloc(sizeof(connection));
-    if (initid->ptr == NULL) {
-        parmerror("mqtt_publish()", args);
-        strcpy(message, "memory allocation error");
-#ifdef DEBUG
-        closelog ();
-#endif
-        return 1;
+    plog *log = (plog *)handle;
+    int n = 0;
+
+    pthread_mutex_lock(&log->mutex);
+    *keys = NULL;
+    if (log->count > 0 && (*keys = MQTTClient_malloc(log->count * sizeof(char *))) != NULL) {
+        for (int i=0; i<PLOG_BUCKETS; i++) {
+            for (plog_key *entry = log->keys[i]; entry != NULL; entry = entry->next) {
+                size_t len = strlen(entry->key) + 1;
+                if (((*keys)[n] = MQTTClient_malloc(len)) != NULL) {
+                    memcpy((*keys)[n++], entry->key, len);
+                }
+            }
+        }
     }
-    connection *conn = (connection *)initid->ptr;
-    conn->client = NULL;
-    strcpy(last_func, "mqtt_publish_init");
-    conn->rc = last_rc = MQTTCLIENT_DISCONNECTED;
+    *nkeys = n;
+    pthread_mutex_unlock(&log->mutex);
+    return log->count > 0 && *keys == NULL ? MQTTCLIENT_PERSISTENCE_ERROR : MQTTCLIENT_SUCCESS;
+}
 
-    conn->mqtt_publish_format = 0;
-    //~ 1: mqtt_publish(server, [username], [password], topic, [payload])
-    if ( args->arg_count==5
-        // server
-         && args->arg_type[0]==STRING_RESULT
-         && args->args[0]!=NULL
-        // username
-         && args->arg_type[1]==STRING_RESULT
-        // password
-         && args->arg_type[2]==STRING_RESULT
-        // topic
-         && args->arg_type[3]==STRING_RESULT
-         && args->args[3]!=NULL
-        // payload
-         && args->arg_type[4]==STRING_RESULT
-        ) {
-        conn->mqtt_publish_format = 1;
-#ifdef DEBUG
-        closelog ();
-#endif
-        return 0;
+int plog_clear(void *handle)
+{
+    plog *log = (plog *)handle;
+
+    pthread_mutex_lock(&log->mutex);
+    plog_forget(log);
+    memset(log->map, 0, log->end);
+    log->synced = 0;
+    plog_sync(log, true);
+    log->end = log->synced = 0;
+    pthread_mutex_unlock(&log->mutex);
+    return MQTTCLIENT_SUCCESS;
+}
+
+int plog_containskey(void *handle, char *key)
+{
+    plog *log = (plog *)handle;
+    int rc;
+
+    pthread_mutex_lock(&log->mutex);
+    rc = *plog_find(log, key, named_hash(key, strlen(key))) != NULL ? MQTTCLIENT_SUCCESS : MQTTCLIENT_PERSISTENCE_ERROR;
+    pthread_mutex_unlock(&log->mutex);
+    return rc;
+}
+
+/*
+ * MQTT version dependent client calls: MQTT 5 clients must be created with
+ * MQTTClient_createWithOptions() and use the *5() functions throughout.
+ * sess (may be NULL) gets a malloc'd copy of the client id, the clientId
+ * option of handle connections or a generated one otherwise.
+ * Handle connections with options clientId and persistence keep their
+ * unconfirmed messages in a persistence log, see plog_open(). The client
+ * refers to sess->persistence until it is destroyed.
+ */
+int client_create(MQTTClient *client, const char *address, const mqtt_options *opts, session *sess)
+{
+    MQTTClient_createOptions create_opts = MQTTClient_createOptions_initializer;
+    char uuid[CLIENT_ID_SIZE];
+    const char *id = sess != NULL && opts->clientId != NULL ? opts->clientId : GetUUID(uuid);
+    int persistence_type = MQTTCLIENT_PERSISTENCE_NONE;
+    plog_persistence *pers = NULL;
+
+    if (sess != NULL) {
+        sess->client_id = strdup(id);
     }
-    //~ 2: mqtt_publish(server, [username], [password], topic, [payload], [qos])
-    else if ( args->arg_count==6
-        // server
-         && args->arg_type[0]==STRING_RESULT
-         && args->args[0]!=NULL
-        // username
-         && args->arg_type[1]==STRING_RESULT
-        // password
-         && args->arg_type[2]==STRING_RESULT
-        // topic
-         && args->arg_type[3]==STRING_RESULT
-         && args->args[3]!=NULL
-        // payload
-         && args->arg_type[4]==STRING_RESULT
-        // qos
-         && ((args->args[5]==NULL) || (args->arg_type[5]==INT_RESULT && ((int)*((longlong*)args->args[5])>=0 && (int)*((longlong*)args->args[5])<=2)))
-        ) {
-        conn->mqtt_publish_format = 2;
-#ifdef DEBUG
-        closelog ();
-#endif
-        return 0;
+    if (sess != NULL && opts->persistence != NULL) {
+        if (opts->clientId == NULL) {
+            // the messages of a generated id would never be restored
+            return MQTTCLIENT_PERSISTENCE_ERROR;
+        }
+        if ((pers = malloc(sizeof(plog_persistence) + strlen(opts->persistence) + 1)) == NULL) {
+            return MQTTCLIENT_PERSISTENCE_ERROR;
+        }
+        strcpy(pers->dir, opts->persistence);
+        pers->config.dir = pers->dir;
+        pers->config.size = opts->persistenceSize > 0 ? (size_t)opts->persistenceSize : PLOG_DEFAULT_SIZE;
+        pers->config.sync = opts->persistenceSync != OPTION_UNSET ? opts->persistenceSync : PLOG_DEFAULT_SYNC;
+        pers->persistence = (MQTTClient_persistence) {
+            .context = &pers->config,
+            .popen = plog_open,
+            .pclose = plog_close,
+            .pput = plog_put,
+            .pget = plog_get,
+            .premove = plog_remove,
+            .pkeys = plog_keys,
+            .pclear = plog_clear,
+            .pcontainskey = plog_containskey,
+        };
+        sess->persistence = pers;
+        persistence_type = MQTTCLIENT_PERSISTENCE_USER;
     }
-    //~ 3: mqtt_publish(server, [username], [password], topic, [payload], [qos], [retained])
-    else if ( args->arg_count==7
-        // server
+    if (opts->MQTTVersion >= MQTTVERSION_5) {
+        create_opts.MQTTVersion = MQTTVERSION_5;
+        return MQTTClient_createWithOptions(client, address, id, persistence_type, pers, &create_opts);
+    }
+    return MQTTClient_create(client, address, id, persistence_type, pers);
+}
+
+/*
+ * Connect client, alias_max (may be NULL) returns the topic alias maximum
+ * of the server. The latency is recorded for st (may be NULL).
+ */
+int client_connect(MQTTClient client, MQTTClient_connectOptions *conn_opts, int *alias_max, client_stats *st)
+{
+    uint64_t start = stats_clock();
+    MQTTResponse response;
+    int rc;
+
+    if (alias_max != NULL) {
+        *alias_max = 0;
+    }
+    if (conn_opts->MQTTVersion < MQTTVERSION_5) {
+        rc = MQTTClient_connect(client, conn_opts);
+    }
+    else {
+        response = MQTTClient_connect5(client, conn_opts, NULL, NULL);
+        rc = response.reasonCode;
+        if (rc == MQTTCLIENT_SUCCESS && alias_max != NULL && response.properties != NULL
+            && MQTTProperties_hasProperty(response.properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM)) {
+            *alias_max = MQTTProperties_getNumericValue(response.properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM);
+        }
+        MQTTResponse_free(response);
+    }
+    stats_latency(st, HIST_CONNECT, start);
+    if (rc != MQTTCLIENT_SUCCESS) {
+        stats_error(st, rc);
+    }
+    return rc;
+}
+
+int client_publish(MQTTClient client, int version, const char *topic, MQTTClient_message *msg, MQTTClient_deliveryToken *token, client_stats *st)
+{
+    uint64_t start = stats_clock();
+    MQTTResponse response;
+    int rc;
+
+    if (version < MQTTVERSION_5) {
+        rc = MQTTClient_publishMessage(client, topic, msg, token);
+    }
+    else {
+        response = MQTTClient_publishMessage5(client, topic, msg, token);
+        rc = response.reasonCode;
+        MQTTResponse_free(response);
+    }
+    stats_latency(st, HIST_PUBLISH, start);
+    if (rc == MQTTCLIENT_SUCCESS) {
+        stats_add(st, STAT_PUBLISHED, 1);
+        stats_add(st, STAT_PUBLISHED_BYTES, msg->payloadlen);
+    }
+    else {
+        stats_error(st, rc);
+    }
+    return rc;
+}
+
+int client_wait(MQTTClient client, MQTTClient_deliveryToken token, unsigned long timeout, client_stats *st)
+{
+    uint64_t start = stats_clock();
+    int rc = MQTTClient_waitForCompletion(client, token, timeout);
+
+    stats_latency(st, HIST_WAIT, start);
+    if (rc != MQTTCLIENT_SUCCESS) {
+        stats_error(st, rc);
+    }
+    return rc;
+}
+
+/* MQTT 5 returns the granted QoS per topic, reason codes >= 0x80 are failures */
+int client_subscribe_many(MQTTClient client, int version, int count, char * const *topics, int *qos)
+{
+    MQTTResponse response;
+    int rc;
+
+    if (version < MQTTVERSION_5) {
+        return count == 1 ? MQTTClient_subscribe(client, topics[0], qos[0]) : MQTTClient_subscribeMany(client, count, topics, qos);
+    }
+    response = MQTTClient_subscribeMany5(client, count, topics, qos, NULL, NULL);
+    rc = response.reasonCode >= 0x80 ? MQTTCLIENT_FAILURE : response.reasonCode < 0 ? response.reasonCode : MQTTCLIENT_SUCCESS;
+    for (int i=0; i<response.reasonCodeCount && rc == MQTTCLIENT_SUCCESS; i++) {
+        if (response.reasonCodes[i] >= 0x80) {
+            rc = MQTTCLIENT_FAILURE;
+        }
+    }
+    MQTTResponse_free(response);
+    return rc;
+}
+
+int client_subscribe(MQTTClient client, int version, const char *topic, int qos)
+{
+    return client_subscribe_many(client, version, 1, (char * const *)&topic, &qos);
+}
+
+int client_unsubscribe(MQTTClient client, int version, const char *topic)
+{
+    MQTTResponse response;
+    int rc;
+
+    if (version < MQTTVERSION_5) {
+        return MQTTClient_unsubscribe(client, topic);
+    }
+    response = MQTTClient_unsubscribe5(client, topic, NULL);
+    rc = response.reasonCode >= 0x80 ? MQTTCLIENT_FAILURE : response.reasonCode;
+    MQTTResponse_free(response);
+    return rc;
+}
+
+/* MQTT 5 properties of published messages given by opts, the values are copied */
+void properties_init(MQTTProperties *props, const mqtt_options *opts)
+{
+    MQTTProperty prop;
+
+    memcpy(props, &(MQTTProperties)MQTTProperties_initializer, sizeof(MQTTProperties));
+    if (opts->messageExpiry > 0) {
+        prop.identifier = MQTTPROPERTY_CODE_MESSAGE_EXPIRY_INTERVAL;
+        prop.value.integer4 = (unsigned int)opts->messageExpiry;
+        MQTTProperties_add(props, &prop);
+    }
+    if (opts->contentType != NULL) {
+        prop.identifier = MQTTPROPERTY_CODE_CONTENT_TYPE;
+        prop.value.data.data = (char *)opts->contentType;
+        prop.value.data.len = strlen(opts->contentType);
+        MQTTProperties_add(props, &prop);
+    }
+    if (opts->userProperties != NULL) {
+        for (int i=0; i<opts->userProperties->u.object.length; i++) {
+            json_value *value = opts->userProperties->u.object.values[i].value;
+            if (json_string != value->type) {
+                continue;
+            }
+            prop.identifier = MQTTPROPERTY_CODE_USER_PROPERTY;
+            prop.value.data.data = opts->userProperties->u.object.values[i].name;
+            prop.value.data.len = opts->userProperties->u.object.values[i].name_length;
+            prop.value.value.data = value->u.string.ptr;
+            prop.value.value.len = value->u.string.length;
+            MQTTProperties_add(props, &prop);
+        }
+    }
+}
+
+/*
+ * Prepare the options argument at position arg within *_init().
+ * A constant options argument is parsed once here and reused for all rows.
+ * On error initid->ptr is released.
+ */
+bool init_options(UDF_INIT *initid, UDF_ARGS *args, int arg, char *message)
+{
+    connection *conn = (connection *)initid->ptr;
+
+    clear_options(&conn->options);
+    conn->options_const = false;
+    conn->options_arg = arg;
+    if (arg >= 0 && args->args[arg] != NULL) {
+        if (JSON_ERROR_INVALID_STR == parse_options(&conn->options, args->args[arg], args->lengths[arg])) {
+            strcpy(message, "options JSON error");
+            free(initid->ptr);
+            initid->ptr = NULL;
+            return 1;
+        }
+        conn->options_const = true;
+    }
+    return 0;
+}
+
+/*
+ * Returns the options for the current row: either the ones cached by
+ * init_options() or the row argument parsed into rowopts.
+ * rowopts must be released by free_options() afterwards.
+ */
+const mqtt_options *row_options(connection *conn, UDF_ARGS *args, mqtt_options *rowopts)
+{
+    clear_options(rowopts);
+    if (conn->options_const || conn->options_arg < 0) {
+        return &conn->options;
+    }
+    parse_options(rowopts, args->args[conn->options_arg], args->lengths[conn->options_arg]);
+    return rowopts;
+}
+
+/* Make room for n more bytes in sb, returns false on memory allocation error */
+bool strbuf_reserve(strbuf *sb, size_t n)
+{
+    if (sb->len + n > sb->size) {
+        size_t size = sb->size ? sb->size : 1024;
+        while (size < sb->len + n) {
+            size *= 2;
+        }
+        char *buf = realloc(sb->buf, size);
+        if (buf == NULL) {
+            return false;
+        }
+        sb->buf = buf;
+        sb->size = size;
+    }
+    return true;
+}
+
+bool strbuf_append(strbuf *sb, const char *str, size_t len)
+{
+    if (!strbuf_reserve(sb, len)) {
+        return false;
+    }
+    memcpy(sb->buf + sb->len, str, len);
+    sb->len += len;
+    return true;
+}
+
+/*
+ * Length of the well-formed UTF-8 character at p before end, its code
+ * point in *cp. Returns 0 for an invalid, overlong or truncated sequence,
+ * a surrogate or a code point beyond U+10FFFF.
+ */
+size_t utf8_char(const unsigned char *p, const unsigned char *end, unsigned int *cp)
+{
+    unsigned int c = *p;
+    int n = c < 0x80 ? 0 : (c & 0xe0) == 0xc0 ? 1 : (c & 0xf0) == 0xe0 ? 2 : (c & 0xf8) == 0xf0 ? 3 : -1;
+
+    if (n < 0 || end - p <= n) {
+        return 0;
+    }
+    c &= 0x7f >> n;
+    for (int i=1; i<=n; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        c = (c << 6) | (p[i] & 0x3f);
+    }
+    if ((n == 1 && c < 0x80) || (n == 2 && c < 0x800) || (n == 3 && (c < 0x10000 || c > 0x10ffff))
+        || (c >= 0xd800 && c <= 0xdfff)) {
+        return 0;
+    }
+    *cp = c;
+    return n + 1;
+}
+
+/*
+ * Append str as quoted JSON string, control characters are escaped and
+ * each byte of invalid UTF-8 is replaced by \ufffd
+ */
+bool strbuf_append_json(strbuf *sb, const char *str, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)str, *end = s + len;
+    size_t extra = 2, n;
+    unsigned int cp;
+    char *p;
+
+    for (size_t i=0; i<len; i+=n) {
+        unsigned char c = s[i];
+        n = c < 0x80 ? 1 : utf8_char(s + i, end, &cp);
+        extra += n == 0 ? 5 : (c == '"' || c == '\\') ? 1 : c < 0x20 ? 5 : 0;
+        n += n == 0;
+    }
+    if (!strbuf_reserve(sb, len + extra)) {
+        return false;
+    }
+    p = sb->buf + sb->len;
+    *p++ = '"';
+    for (size_t i=0; i<len; i+=n) {
+        unsigned char c = s[i];
+        n = c < 0x80 ? 1 : utf8_char(s + i, end, &cp);
+        if (n == 0) {
+            memcpy(p, "\\ufffd", 6);
+            p += 6;
+            n = 1;
+        }
+        else if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        }
+        else if (c < 0x20) {
+            sprintf(p, "\\u%04x", c);
+            p += 6;
+        }
+        else {
+            memcpy(p, s + i, n);
+            p += n;
+        }
+    }
+    *p++ = '"';
+    sb->len = p - sb->buf;
+    return true;
+}
+
+/* Append NUL-terminated str as quoted JSON string, NULL as null */
+bool strbuf_append_json_str(strbuf *sb, const char *str)
+{
+    return str != NULL ? strbuf_append_json(sb, str, strlen(str)) : strbuf_append(sb, "null", 4);
+}
+
+/*
+ * Call plans
+ *
+ * mqtt_publish() and mqtt_subscribe() accept a server and a handle form,
+ * each with optional trailing arguments. plan_compile() matches the
+ * signature once in *_init(), records the argument index of every kind
+ * and resolves the constant arguments, so per row plan_bind() only reads
+ * the variable ones.
+ */
+const longlong plan_defaults[ARG_KINDS] = {
+    [ARG_QOS] = DEFAULT_QOS,
+    [ARG_RETAINED] = DEFAULT_RETAINED,
+    [ARG_TIMEOUT] = DEFAULT_TIMEOUT,
+};
+
+#define ARG_IS_STRING(k)        ((k) <= ARG_PAYLOAD)
+#define ARG_IS_INT(k)           ((k) >= ARG_QOS && (k) <= ARG_TIMEOUT)
+
+/* Constant INT arguments must be within min..max, NULL uses the default */
+bool plan_int_valid(UDF_ARGS *args, int i, longlong min, longlong max)
+{
+    if (args->args[i] == NULL) {
+        return true;
+    }
+    return args->arg_type[i] == INT_RESULT && *(longlong*)args->args[i] >= min && *(longlong*)args->args[i] <= max;
+}
+
+bool plan_arg_valid(int kind, UDF_ARGS *args, int i)
+{
+    switch (kind) {
+        case ARG_HANDLE:
+            // client or name
+            return args->arg_type[i] == INT_RESULT || args->arg_type[i] == STRING_RESULT;
+        case ARG_QOS:
+            return plan_int_valid(args, i, 0, 2);
+        case ARG_RETAINED:
+            return plan_int_valid(args, i, 0, 1);
+        case ARG_TIMEOUT:
+            return plan_int_valid(args, i, 0, 0x7fffffff);
+        default:
+            return args->arg_type[i] == STRING_RESULT;
+    }
+}
+
+/*
+ * A literal NULL argument: not constant in *_init() like an expression, but
+ * nullable and named NULL, which no column or expression can be.
+ */
+bool plan_null_literal(UDF_ARGS *args, int i)
+{
+    return args->args[i] == NULL && args->maybe_null[i]
+        && args->attribute_lengths[i] == 4 && 0 == strncasecmp(args->attributes[i], "NULL", 4);
+}
+
+/*
+ * Match args against forms (the first matching one wins) and compile the
+ * plan. Returns 1 with message set if no form matches, like *_init().
+ */
+bool plan_compile(call_plan *plan, const call_form *forms, int nforms, UDF_ARGS *args, char *message)
+{
+    const call_form *form = NULL;
+    size_t size = 0;
+    char *p;
+
+    for (int f=0; f<nforms && form == NULL; f++) {
+        form = &forms[f];
+        if ((int)args->arg_count < form->min || (int)args->arg_count > form->max) {
+            form = NULL;
+            continue;
+        }
+        for (int i=0; i<(int)args->arg_count && form != NULL; i++) {
+            if (!plan_arg_valid(form->kinds[i], args, i)) {
+                form = NULL;
+            }
+            // a literal NULL is a STRING_RESULT too: e.g. ('name', 't', NULL, NULL) is the handle form
+            else if (form->kinds[0] == ARG_SERVER && form->kinds[i] == ARG_TOPIC && plan_null_literal(args, i)) {
+                form = NULL;
+            }
+        }
+    }
+    if (form == NULL) {
+        strcpy(message, "function argument(s) error");
+        return 1;
+    }
+
+    plan->server_form = form->kinds[0] == ARG_SERVER;
+    plan->nvars = 0;
+    for (int k=0; k<ARG_KINDS; k++) {
+        plan->arg[k].index = -1;
+        plan->arg[k].constant = true;
+        plan->arg[k].value = plan_defaults[k];
+        plan->arg[k].str = NULL;
+        plan->arg[k].len = 0;
+    }
+    for (int i=0; i<(int)args->arg_count; i++) {
+        int kind = form->kinds[i];
+        plan_arg *arg = &plan->arg[kind];
+
+        arg->index = i;
+        arg->constant = args->args[i] != NULL;
+        if (ARG_IS_INT(kind) && arg->constant) {
+            arg->value = *(longlong*)args->args[i];
+        }
+        else if (ARG_IS_INT(kind)) {
+            // let MySQL convert variable arguments
+            args->arg_type[i] = INT_RESULT;
+        }
+        else if (ARG_IS_STRING(kind) && arg->constant) {
+            size += args->lengths[i] + 1;
+        }
+        if (!arg->constant && (ARG_IS_INT(kind) || ARG_IS_STRING(kind))) {
+            plan->vars[plan->nvars++] = kind;
+        }
+    }
+
+    // NUL-terminated copies of the constant strings
+    plan->consts = size > 0 ? malloc(size) : NULL;
+    if (size > 0 && plan->consts == NULL) {
+        strcpy(message, "memory allocation error");
+        return 1;
+    }
+    p = plan->consts;
+    for (int k=0; k<=ARG_PAYLOAD; k++) {
+        plan_arg *arg = &plan->arg[k];
+        if (arg->index >= 0 && arg->constant) {
+            memcpy(p, args->args[arg->index], args->lengths[arg->index]);
+            p[args->lengths[arg->index]] = '\0';
+            arg->str = p;
+            arg->len = args->lengths[arg->index];
+            p += arg->len + 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read the variable arguments of the current row into plan. Strings are
+ * NUL-terminated copies, MySQL does not terminate them. The payload is
+ * used in place. Returns false on memory allocation error.
+ */
+bool plan_bind(call_plan *plan, UDF_ARGS *args)
+{
+    size_t offset[ARG_PAYLOAD + 1];
+
+    plan->row.len = 0;
+    for (int v=0; v<plan->nvars; v++) {
+        int kind = plan->vars[v];
+        plan_arg *arg = &plan->arg[kind];
+        const char *value = args->args[arg->index];
+
+        if (ARG_IS_INT(kind)) {
+            arg->value = value != NULL ? *(longlong*)value : plan_defaults[kind];
+            continue;
+        }
+        arg->str = value;
+        arg->len = value != NULL ? args->lengths[arg->index] : 0;
+        if (value == NULL || kind == ARG_PAYLOAD) {
+            continue;
+        }
+        offset[kind] = plan->row.len;
+        if (!strbuf_append(&plan->row, value, arg->len) || !strbuf_append(&plan->row, "", 1)) {
+            return false;
+        }
+    }
+    // the buffer may have moved while appending
+    for (int v=0; v<plan->nvars; v++) {
+        int kind = plan->vars[v];
+        if (ARG_IS_STRING(kind) && kind != ARG_PAYLOAD && plan->arg[kind].str != NULL) {
+            plan->arg[kind].str = plan->row.buf + offset[kind];
+        }
+    }
+    return true;
+}
+
+void plan_free(call_plan *plan)
+{
+    free(plan->consts);
+    free(plan->row.buf);
+}
+
+/* Payload compression settings of opts, dict points into opts */
+void compression_init(compression *c, const mqtt_options *opts)
+{
+    c->threshold = opts->compress > 0 ? opts->compress : 0;
+    c->level = opts->compressLevel >= 0 && opts->compressLevel <= 9 ? (int)opts->compressLevel : Z_DEFAULT_COMPRESSION;
+    c->dict = opts->compressDict;
+    c->dict_len = opts->compressDict != NULL ? strlen(opts->compressDict) : 0;
+}
+
+/*
+ * Compress payload into out: COMPRESS_MARKER, the uncompressed length
+ * (4 bytes big-endian) and the zlib stream.
+ * Returns false if the payload is to be sent unchanged: compression
+ * disabled, payload below threshold, not compressible or on error.
+ */
+bool payload_deflate(const compression *c, const char *payload, int payloadlen, strbuf *out)
+{
+    z_stream zs;
+    int rc;
+
+    if (c->threshold <= 0 || payloadlen < c->threshold) {
+        return false;
+    }
+    memset(&zs, 0, sizeof(zs));
+    if (Z_OK != deflateInit(&zs, c->level)) {
+        return false;
+    }
+    out->len = 0;
+    if ((c->dict != NULL && Z_OK != deflateSetDictionary(&zs, (const Bytef *)c->dict, c->dict_len))
+        || !strbuf_reserve(out, COMPRESS_HEADER_LEN + deflateBound(&zs, payloadlen))) {
+        deflateEnd(&zs);
+        return false;
+    }
+    zs.next_in = (Bytef *)payload;
+    zs.avail_in = payloadlen;
+    zs.next_out = (Bytef *)out->buf + COMPRESS_HEADER_LEN;
+    zs.avail_out = out->size - COMPRESS_HEADER_LEN;
+    rc = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END || COMPRESS_HEADER_LEN + zs.total_out >= (unsigned long)payloadlen) {
+        return false;
+    }
+    out->buf[0] = COMPRESS_MARKER;
+    out->buf[1] = (char)(payloadlen >> 24);
+    out->buf[2] = (char)(payloadlen >> 16);
+    out->buf[3] = (char)(payloadlen >> 8);
+    out->buf[4] = (char)payloadlen;
+    out->len = COMPRESS_HEADER_LEN + zs.total_out;
+    return true;
+}
+
+/*
+ * Set the payload of msg: the message payload or, if it starts with
+ * COMPRESS_MARKER followed by a zlib stream, its decompressed copy.
+ * Payloads which can't be decompressed (e.g. dictionary missing) are
+ * kept unchanged.
+ */
+void recv_inflate(recv_msg *msg, const compression *c)
+{
+    const unsigned char *p = msg->message->payload;
+    unsigned long size;
+    z_stream zs;
+    char *buf;
+    int rc;
+
+    msg->payload = msg->message->payload;
+    msg->payloadlen = msg->message->payloadlen;
+    if (msg->payloadlen < COMPRESS_HEADER_LEN + 2 || p[0] != COMPRESS_MARKER
+        // zlib header: deflate method and check bits
+        || (p[5] & 0x0f) != Z_DEFLATED || ((p[5] << 8) | p[6]) % 31 != 0) {
+        return;
+    }
+    size = ((unsigned long)p[1] << 24) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 8) | p[4];
+    if (size == 0 || size > RECEIVE_MAX_LENGTH || (buf = malloc(size)) == NULL) {
+        return;
+    }
+    memset(&zs, 0, sizeof(zs));
+    if (Z_OK != inflateInit(&zs)) {
+        free(buf);
+        return;
+    }
+    zs.next_in = (Bytef *)p + COMPRESS_HEADER_LEN;
+    zs.avail_in = msg->payloadlen - COMPRESS_HEADER_LEN;
+    zs.next_out = (Bytef *)buf;
+    zs.avail_out = size;
+    rc = inflate(&zs, Z_FINISH);
+    if (rc == Z_NEED_DICT && c != NULL && c->dict != NULL
+        && Z_OK == inflateSetDictionary(&zs, (const Bytef *)c->dict, c->dict_len)) {
+        rc = inflate(&zs, Z_FINISH);
+    }
+    inflateEnd(&zs);
+    if (rc != Z_STREAM_END || zs.total_out != size) {
+        free(buf);
+        return;
+    }
+    msg->payload = buf;
+    msg->payloadlen = (int)size;
+}
+
+/* Client handle sessions */
+atomic_ulong session_serials = 0;       // also numbers the connections of all sessions
+
+session *session_create(void)
+{
+    session *sess = calloc(1, sizeof(session));
+
+    if (sess != NULL) {
+        atomic_init(&sess->refs, 1);
+        sess->serial = atomic_fetch_add(&session_serials, 1) + 1;
+        sess->max_inflight = DEFAULT_MAX_INFLIGHT;
+        sess->last_func = "";
+        sess->alias_limit = TOPIC_ALIAS_DEFAULT_MAX;
+        pthread_mutex_init(&sess->mutex, NULL);
+        pthread_cond_init(&sess->cond, NULL);
+        pthread_mutex_init(&sess->alias_mutex, NULL);
+    }
+    return sess;
+}
+
+/* Free a list of received messages */
+void recv_free(recv_msg *msg)
+{
+    recv_msg *next;
+
+    for (; msg != NULL; msg = next) {
+        next = msg->next;
+        if (msg->payload != msg->message->payload) {
+            free(msg->payload);
+        }
+        MQTTClient_freeMessage(&msg->message);
+        MQTTClient_free(msg->topic);
+        free(msg);
+    }
+}
+
+void session_destroy(session *sess)
+{
+    subscription *sub;
+    offline_msg *om;
+
+    if (sess->client != NULL) {
+        MQTTClient_destroy(&sess->client);
+    }
+    // used by the client up to its destroy
+    free(sess->persistence);
+    recv_free(sess->recv_head);
+    while ((sub = sess->subs) != NULL) {
+        sess->subs = sub->next;
+        free(sub);
+    }
+    while ((om = sess->offline_head) != NULL) {
+        sess->offline_head = om->next;
+        free(om);
+    }
+    free(sess->connect);
+    free(sess->compress_dict);
+    free(sess->share_group);
+    free(sess->server);
+    free(sess->client_id);
+    MQTTProperties_free(&sess->props);
+    if (sess->aliases != NULL) {
+        for (size_t i=0; i<=sess->aliases_mask; i++) {
+            free(sess->aliases[i].topic);
+        }
+        free(sess->aliases);
+    }
+    pthread_mutex_destroy(&sess->alias_mutex);
+    pthread_cond_destroy(&sess->cond);
+    pthread_mutex_destroy(&sess->mutex);
+    free(sess);
+}
+
+/* Drop a reference to sess, the last one destroys it */
+void session_put(session *sess)
+{
+    if (sess != NULL && 1 == atomic_fetch_sub(&sess->refs, 1)) {
+        session_destroy(sess);
+    }
+}
+
+/*
+ * Handle registry
+ *
+ * Handles returned by mqtt_connect() are no pointers but encode the slot
+ * of the session within the registry and the generation of that slot:
+ *   bits  0..23 slot index within shard
+ *   bits 24..31 shard
+ *   bits 32..62 slot generation, incremented if the slot is released
+ * so stale, mistyped or foreign handles are detected instead of being
+ * dereferenced. Slots are allocated in slabs of REGISTRY_SLAB_SIZE and
+ * spread over REGISTRY_SHARDS independently locked shards.
+ */
+registry_shard registry[REGISTRY_SHARDS] = {
+    [0 ... REGISTRY_SHARDS-1] = {.mutex = PTHREAD_MUTEX_INITIALIZER, .free_head = -1}
+};
+atomic_uint registry_next = 0;
+
+#define HANDLE_INDEX(h)         ((int)((h) & 0xffffff))
+#define HANDLE_SHARD(h)         ((int)(((h) >> 24) & 0xff))
+#define HANDLE_GEN(h)           ((uint32_t)(((h) >> 32) & 0x7fffffff))
+#define HANDLE_MAKE(g, s, i)    (((longlong)(g) << 32) | ((longlong)(s) << 24) | (longlong)(i))
+
+/* Register sess and return its handle or 0 if the registry is full */
+longlong registry_add(session *sess)
+{
+    unsigned int start = atomic_fetch_add(&registry_next, 1);
+
+    for (int n=0; n<REGISTRY_SHARDS; n++) {
+        int shardno = (start + n) % REGISTRY_SHARDS;
+        registry_shard *shard = &registry[shardno];
+
+        pthread_mutex_lock(&shard->mutex);
+        if (shard->free_head < 0 && shard->nslabs < REGISTRY_MAX_SLABS) {
+            registry_slot *slab = malloc(REGISTRY_SLAB_SIZE * sizeof(registry_slot));
+            if (slab != NULL) {
+                int base = shard->nslabs * REGISTRY_SLAB_SIZE;
+                for (int i=0; i<REGISTRY_SLAB_SIZE; i++) {
+                    slab[i].sess = NULL;
+                    slab[i].gen = 1;
+                    slab[i].next_free = i+1 < REGISTRY_SLAB_SIZE ? base + i + 1 : -1;
+                }
+                shard->slabs[shard->nslabs++] = slab;
+                shard->free_head = base;
+            }
+        }
+        if (shard->free_head >= 0) {
+            int index = shard->free_head;
+            registry_slot *slot = &shard->slabs[index / REGISTRY_SLAB_SIZE][index % REGISTRY_SLAB_SIZE];
+            shard->free_head = slot->next_free;
+            slot->sess = sess;
+            pthread_mutex_unlock(&shard->mutex);
+            return HANDLE_MAKE(slot->gen, shardno, index);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return 0;
+}
+
+/* Returns the slot of handle if valid, shard mutex must be held */
+registry_slot *registry_slot_of(registry_shard *shard, longlong handle)
+{
+    int index = HANDLE_INDEX(handle);
+    registry_slot *slot;
+
+    if (index >= shard->nslabs * REGISTRY_SLAB_SIZE) {
+        return NULL;
+    }
+    slot = &shard->slabs[index / REGISTRY_SLAB_SIZE][index % REGISTRY_SLAB_SIZE];
+    if (slot->sess == NULL || slot->gen != HANDLE_GEN(handle)) {
+        return NULL;
+    }
+    return slot;
+}
+
+/*
+ * Returns the session of handle with an additional reference or NULL if
+ * handle is invalid. The reference must be dropped by session_put().
+ */
+session *session_get(longlong handle)
+{
+    registry_shard *shard;
+    registry_slot *slot;
+    session *sess = NULL;
+
+    if (handle <= 0 || HANDLE_SHARD(handle) >= REGISTRY_SHARDS) {
+        return NULL;
+    }
+    shard = &registry[HANDLE_SHARD(handle)];
+    pthread_mutex_lock(&shard->mutex);
+    slot = registry_slot_of(shard, handle);
+    if (slot != NULL) {
+        sess = slot->sess;
+        atomic_fetch_add(&sess->refs, 1);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    if (sess != NULL) {
+        atomic_store_explicit(&sess->last_used, time(NULL), memory_order_relaxed);
+    }
+    return sess;
+}
+
+/*
+ * Unregister handle and return its session, the caller takes over the
+ * reference held by the registry. Returns NULL if handle is invalid.
+ */
+session *registry_remove(longlong handle)
+{
+    registry_shard *shard;
+    registry_slot *slot;
+    session *sess = NULL;
+
+    if (handle <= 0 || HANDLE_SHARD(handle) >= REGISTRY_SHARDS) {
+        return NULL;
+    }
+    shard = &registry[HANDLE_SHARD(handle)];
+    pthread_mutex_lock(&shard->mutex);
+    slot = registry_slot_of(shard, handle);
+    if (slot != NULL) {
+        sess = slot->sess;
+        slot->sess = NULL;
+        slot->gen = slot->gen < 0x7fffffff ? slot->gen + 1 : 1;
+        slot->next_free = shard->free_head;
+        shard->free_head = HANDLE_INDEX(handle);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return sess;
+}
+
+/*
+ * Named connections
+ *
+ * mqtt_open() registers the handle of a connection under a name visible to
+ * all MySQL sessions, so the connection outlives the statement and the
+ * session which opened it. The read-write lock favours mqtt_publish()
+ * lookups over the rare mqtt_open()/mqtt_close() calls.
+ */
+named_entry *named[NAMED_BUCKETS];
+pthread_rwlock_t named_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Returns the link to the entry of name or to NULL, named_lock must be held */
+named_entry **named_find(const char *name, size_t len, unsigned int hash)
+{
+    named_entry **pp = &named[hash % NAMED_BUCKETS];
+
+    for (; *pp != NULL; pp = &(*pp)->next) {
+        if ((*pp)->hash == hash && (*pp)->name_len == len && 0 == memcmp((*pp)->name, name, len)) {
+            break;
+        }
+    }
+    return pp;
+}
+
+/* Returns the handle registered as name or 0 */
+longlong named_handle(const char *name, size_t len)
+{
+    named_entry *entry;
+    longlong handle = 0;
+
+    pthread_rwlock_rdlock(&named_lock);
+    entry = *named_find(name, len, named_hash(name, len));
+    if (entry != NULL) {
+        handle = entry->handle;
+    }
+    pthread_rwlock_unlock(&named_lock);
+    return handle;
+}
+
+/*
+ * Register handle as name. If another thread registered a valid handle
+ * for name meanwhile, that one is returned and the caller has to release
+ * handle. Returns 0 on memory allocation error.
+ */
+longlong named_add(const char *name, size_t len, longlong handle)
+{
+    unsigned int hash = named_hash(name, len);
+    named_entry *entry;
+    session *sess;
+
+    pthread_rwlock_wrlock(&named_lock);
+    entry = *named_find(name, len, hash);
+    if (entry != NULL) {
+        if ((sess = session_get(entry->handle)) != NULL) {
+            session_put(sess);
+            handle = entry->handle;
+        }
+        else {
+            entry->handle = handle;
+        }
+    }
+    else if ((entry = malloc(sizeof(named_entry) + len)) != NULL) {
+        entry->hash = hash;
+        entry->handle = handle;
+        entry->name_len = len;
+        memcpy(entry->name, name, len);
+        entry->next = named[hash % NAMED_BUCKETS];
+        named[hash % NAMED_BUCKETS] = entry;
+    }
+    else {
+        handle = 0;
+    }
+    pthread_rwlock_unlock(&named_lock);
+    return handle;
+}
+
+/* Unregister name and return its handle or 0 */
+longlong named_remove(const char *name, size_t len)
+{
+    named_entry **pp, *entry;
+    longlong handle = 0;
+
+    pthread_rwlock_wrlock(&named_lock);
+    pp = named_find(name, len, named_hash(name, len));
+    if ((entry = *pp) != NULL) {
+        *pp = entry->next;
+        handle = entry->handle;
+        free(entry);
+    }
+    pthread_rwlock_unlock(&named_lock);
+    return handle;
+}
+
+/* Disconnect all named connections when the library is unloaded */
+__attribute__((destructor)) void named_cleanup(void)
+{
+    named_entry *entry;
+    session *sess;
+
+    pthread_rwlock_wrlock(&named_lock);
+    for (int i=0; i<NAMED_BUCKETS; i++) {
+        while ((entry = named[i]) != NULL) {
+            named[i] = entry->next;
+            if ((sess = registry_remove(entry->handle)) != NULL) {
+                MQTTClient_disconnect(sess->client, 0);
+                session_put(sess);
+            }
+            free(entry);
+        }
+    }
+    pthread_rwlock_unlock(&named_lock);
+}
+
+/*
+ * session_get() for a handle argument which may be NULL.
+ * A string argument is the name of a connection opened by mqtt_open().
+ */
+session *session_arg(UDF_ARGS *args, int arg)
+{
+    if (args->args[arg] == NULL) {
+        return NULL;
+    }
+    if (args->arg_type[arg] == STRING_RESULT) {
+        return session_get(named_handle(args->args[arg], args->lengths[arg]));
+    }
+    return session_get(*(longlong*)args->args[arg]);
+}
+
+/* Remember the last error of the calling thread as last error of sess */
+void session_lasterror(session *sess)
+{
+    pthread_mutex_lock(&sess->mutex);
+    sess->last_func = last_func;
+    sess->last_rc = last_rc;
+    pthread_mutex_unlock(&sess->mutex);
+}
+
+/*
+ * Automatic reconnect
+ *
+ * Sessions with option reconnect whose connection was lost are put on
+ * reconnect_list and redialed by a single background thread with jittered
+ * exponential backoff, see reconnect_run(), so a broker failover doesn't
+ * trigger synchronized reconnect storms. Meanwhile mqtt_publish() buffers
+ * QoS 1/2 messages, which are replayed in order once reconnected.
+ */
+pthread_mutex_t reconnect_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t reconnect_cond = PTHREAD_COND_INITIALIZER;
+session *reconnect_list = NULL;         // each entry holds a reference
+bool reconnect_running = false;
+bool reconnect_stopping = false;
+pthread_t reconnect_thread;
+
+/* Returns a random delay between delay/2 and delay ms */
+long reconnect_jitter(long delay)
+{
+    return delay / 2 + (long)(uuid_next() % (uint64_t)(delay / 2 + 1));
+}
+
+/* Schedule the reconnect of sess unless it is already scheduled */
+void session_lost(session *sess)
+{
+    if (!sess->reconnect || atomic_load(&sess->closed) || atomic_exchange(&sess->offline, 1)) {
+        return;
+    }
+    atomic_fetch_add(&sess->refs, 1);
+    pthread_mutex_lock(&reconnect_mutex);
+    sess->delay = sess->reconnect_delay;
+    deadline(&sess->retry, reconnect_jitter(sess->delay));
+    sess->reconnect_next = reconnect_list;
+    reconnect_list = sess;
+    pthread_cond_signal(&reconnect_cond);
+    pthread_mutex_unlock(&reconnect_mutex);
+    TRACE(TRACE_INFO, "session_lost(): client %p", sess->client);
+}
+
+/*
+ * Keep msg for replay while sess is offline. Returns false if sess is
+ * connected, otherwise true and *rc: MQTTCLIENT_DISCONNECTED for QoS 0
+ * messages or if offline_max messages are buffered already.
+ */
+bool session_buffer(session *sess, const char *topic, const MQTTClient_message *msg, int *rc)
+{
+    offline_msg *om;
+    size_t topiclen;
+
+    if (!atomic_load(&sess->offline)) {
+        return false;
+    }
+    pthread_mutex_lock(&sess->mutex);
+    // the reconnect thread clears offline under mutex once the buffer is empty
+    if (!atomic_load(&sess->offline)) {
+        pthread_mutex_unlock(&sess->mutex);
+        return false;
+    }
+    *rc = MQTTCLIENT_DISCONNECTED;
+    if (msg->qos > 0 && sess->offline_count < sess->offline_max) {
+        topiclen = strlen(topic) + 1;
+        if ((om = malloc(sizeof(offline_msg) + topiclen + msg->payloadlen)) != NULL) {
+            om->next = NULL;
+            memcpy(om->topic, topic, topiclen);
+            om->payload = om->topic + topiclen;
+            memcpy(om->payload, msg->payload, msg->payloadlen);
+            om->payloadlen = msg->payloadlen;
+            om->qos = msg->qos;
+            om->retained = msg->retained;
+            if (sess->offline_tail != NULL) {
+                sess->offline_tail->next = om;
+            }
+            else {
+                sess->offline_head = om;
+            }
+            sess->offline_tail = om;
+            sess->offline_count++;
+            *rc = MQTTCLIENT_SUCCESS;
+        }
+    }
+    pthread_mutex_unlock(&sess->mutex);
+    return true;
+}
+
+/*
+ * End the connection of sess: topic aliases are only valid within the
+ * connection they were sent on, so they are dropped before a reconnect
+ * and no alias is used until session_connected().
+ */
+void session_disconnected(session *sess)
+{
+    pthread_mutex_lock(&sess->alias_mutex);
+    if (sess->aliases != NULL) {
+        for (size_t i=0; i<=sess->aliases_mask; i++) {
+            free(sess->aliases[i].topic);
+            sess->aliases[i].topic = NULL;
+        }
+    }
+    sess->alias_count = 0;
+    sess->alias_max = 0;
+    // invalidates the aliases cached by statements
+    atomic_store(&sess->alias_epoch, atomic_fetch_add(&session_serials, 1) + 1);
+    pthread_mutex_unlock(&sess->alias_mutex);
+}
+
+/* Paho callbacks for async sessions, called from the Paho client thread */
+void session_delivery_complete(void *context, MQTTClient_deliveryToken token)
+{
+    session *sess = (session *)context;
+
+    pthread_mutex_lock(&sess->mutex);
+    if (sess->inflight > 0) {
+        sess->inflight--;
+    }
+    sess->delivered++;
+    pthread_cond_broadcast(&sess->cond);
+    pthread_mutex_unlock(&sess->mutex);
+}
+
+void session_connection_lost(void *context, char *cause)
+{
+    session *sess = (session *)context;
+
+    pthread_mutex_lock(&sess->mutex);
+    sess->failed += sess->inflight;
+    sess->inflight = 0;
+    sess->losses++;
+    sess->rc = MQTTCLIENT_DISCONNECTED;
+    pthread_cond_broadcast(&sess->cond);
+    pthread_mutex_unlock(&sess->mutex);
+    session_disconnected(sess);
+    session_lost(sess);
+}
+
+/*
+ * Queue a message received by a streaming subscription for mqtt_receive().
+ * If the queue is full the message is dropped and counted: refusing it
+ * makes the Paho client deliver it again at once, in a busy loop.
+ */
+int session_message_arrived(void *context, char *topicName, int topicLen, MQTTClient_message *message)
+{
+    session *sess = (session *)context;
+    recv_msg *msg;
+    int max;
+    bool full;
+
+    stats_add(&sess->stats, STAT_RECEIVED, 1);
+    stats_add(&sess->stats, STAT_RECEIVED_BYTES, message->payloadlen);
+    pthread_mutex_lock(&sess->mutex);
+    max = sess->recv_max;
+    full = max > 0 && sess->recv_count >= max;
+    pthread_mutex_unlock(&sess->mutex);
+    if (max == 0 || full || (msg = malloc(sizeof(recv_msg))) == NULL) {
+        if (max > 0) {
+            pthread_mutex_lock(&sess->mutex);
+            sess->recv_dropped++;
+            pthread_mutex_unlock(&sess->mutex);
+            TRACE(TRACE_ERROR, "session_message_arrived(): dropped, receive queue %s", full ? "full" : "out of memory");
+        }
+        MQTTClient_freeMessage(&message);
+        MQTTClient_free(topicName);
+        return 1;
+    }
+    msg->next = NULL;
+    msg->topic = topicName;
+    msg->topiclen = topicLen > 0 ? topicLen : strlen(topicName);
+    msg->message = message;
+    // decompress on the client thread, this is the only one adding messages
+    recv_inflate(msg, &sess->compress);
+
+    pthread_mutex_lock(&sess->mutex);
+    if (sess->recv_tail != NULL) {
+        sess->recv_tail->next = msg;
+    }
+    else {
+        sess->recv_head = msg;
+    }
+    sess->recv_tail = msg;
+    sess->recv_count++;
+    sess->received++;
+    pthread_cond_broadcast(&sess->cond);
+    pthread_mutex_unlock(&sess->mutex);
+    return 1;
+}
+
+/* Size of the receive queue of sess, 0 unless streaming */
+int session_recv_max(session *sess)
+{
+    int max;
+
+    pthread_mutex_lock(&sess->mutex);
+    max = sess->recv_max;
+    pthread_mutex_unlock(&sess->mutex);
+    return max;
+}
+
+/*
+ * Take up to max messages from the receive queue of sess, waiting up to
+ * timeout ms for the first one. With linger > 0 wait up to linger ms after
+ * the first message until max messages are queued.
+ * Returns the detached list or NULL.
+ */
+recv_msg *session_receive(session *sess, int max, int linger, int timeout)
+{
+    recv_msg *head, **pp;
+    struct timespec ts;
+    int n = 0;
+
+    deadline(&ts, timeout);
+    pthread_mutex_lock(&sess->mutex);
+    while (sess->recv_count == 0) {
+        if (ETIMEDOUT == pthread_cond_timedwait(&sess->cond, &sess->mutex, &ts)) {
+            break;
+        }
+    }
+    if (linger > 0 && sess->recv_count > 0) {
+        // a full queue can't grow any further
+        int fill = max < sess->recv_max ? max : sess->recv_max;
+
+        deadline(&ts, linger);
+        while (sess->recv_count < fill) {
+            if (ETIMEDOUT == pthread_cond_timedwait(&sess->cond, &sess->mutex, &ts)) {
+                break;
+            }
+        }
+    }
+    head = sess->recv_head;
+    for (pp = &head; *pp != NULL && n < max; pp = &(*pp)->next) {
+        n++;
+    }
+    sess->recv_head = *pp;
+    if (sess->recv_head == NULL) {
+        sess->recv_tail = NULL;
+    }
+    *pp = NULL;
+    sess->recv_count -= n;
+    pthread_mutex_unlock(&sess->mutex);
+    return head;
+}
+
+/*
+ * Topic filter subscribed for topic: within a share group the shared
+ * subscription "$share/group/topic", unless topic is shared already.
+ * Returns an allocated string or NULL on memory allocation error.
+ */
+char *share_filter(const char *group, const char *topic)
+{
+    char *filter;
+
+    if (group == NULL || 0 == strncmp(topic, "$share/", 7)) {
+        return strdup(topic);
+    }
+    filter = malloc(7 + strlen(group) + 1 + strlen(topic) + 1);
+    if (filter != NULL) {
+        sprintf(filter, "$share/%s/%s", group, topic);
+    }
+    return filter;
+}
+
+/* Valid share group names are not empty and contain no '/', '+' or '#' */
+bool share_group_valid(const char *group)
+{
+    return *group != '\0' && strpbrk(group, "/+#") == NULL;
+}
+
+/*
+ * Subscribe sess to the topic filter unless it is already subscribed with
+ * qos. The subscription is kept and renewed by session_reconnect().
+ * The mutex is not held during network calls, the Paho thread needs it
+ * to deliver messages.
+ */
+int session_subscribe_filter(session *sess, const char *topic, int qos)
+{
+    subscription *sub;
+    int rc;
+
+    pthread_mutex_lock(&sess->mutex);
+    for (sub = sess->subs; sub != NULL && 0 != strcmp(sub->topic, topic); sub = sub->next);
+    rc = sub != NULL && sub->qos == qos;
+    pthread_mutex_unlock(&sess->mutex);
+    if (rc) {
+        last_func = "MQTTClient_subscribe";
+        return last_rc = MQTTCLIENT_SUCCESS;
+    }
+
+    last_func = "MQTTClient_subscribe";
+    rc = last_rc = client_subscribe(sess->client, sess->version, topic, qos);
+    if (rc != MQTTCLIENT_SUCCESS) {
+        return rc;
+    }
+    pthread_mutex_lock(&sess->mutex);
+    for (sub = sess->subs; sub != NULL && 0 != strcmp(sub->topic, topic); sub = sub->next);
+    if (sub == NULL && (sub = malloc(sizeof(subscription) + strlen(topic) + 1)) != NULL) {
+        strcpy(sub->topic, topic);
+        sub->next = sess->subs;
+        sess->subs = sub;
+    }
+    if (sub != NULL) {
+        sub->qos = qos;
+    }
+    pthread_mutex_unlock(&sess->mutex);
+    return rc;
+}
+
+/* End the subscription of sess to the topic filter */
+int session_unsubscribe_filter(session *sess, const char *topic)
+{
+    subscription **pp, *sub;
+    int rc;
+
+    last_func = "MQTTClient_unsubscribe";
+    rc = last_rc = client_unsubscribe(sess->client, sess->version, topic);
+    if (rc == MQTTCLIENT_SUCCESS) {
+        pthread_mutex_lock(&sess->mutex);
+        for (pp = &sess->subs; (sub = *pp) != NULL; pp = &sub->next) {
+            if (0 == strcmp(sub->topic, topic)) {
+                *pp = sub->next;
+                free(sub);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&sess->mutex);
+    }
+    return rc;
+}
+
+/* Subscribe sess to topic within its share group, see session_subscribe_filter() */
+int session_subscribe(session *sess, const char *topic, int qos)
+{
+    char *filter = share_filter(sess->share_group, topic);
+    int rc;
+
+    if (filter == NULL) {
+        last_func = "MQTTClient_subscribe";
+        return last_rc = MQTTCLIENT_FAILURE;
+    }
+    rc = session_subscribe_filter(sess, filter, qos);
+    free(filter);
+    return rc;
+}
+
+/* End the subscription of sess to topic within its share group */
+int session_unsubscribe(session *sess, const char *topic)
+{
+    char *filter = share_filter(sess->share_group, topic);
+    int rc;
+
+    if (filter == NULL) {
+        last_func = "MQTTClient_unsubscribe";
+        return last_rc = MQTTCLIENT_FAILURE;
+    }
+    rc = session_unsubscribe_filter(sess, filter);
+    free(filter);
+    return rc;
+}
+
+/* Renew all subscriptions of sess with a single SUBSCRIBE after a reconnect */
+int session_resubscribe(session *sess)
+{
+    subscription *sub;
+    char **topics;
+    int *qos, count = 0, rc = MQTTCLIENT_SUCCESS;
+
+    pthread_mutex_lock(&sess->mutex);
+    for (sub = sess->subs; sub != NULL; sub = sub->next) {
+        count++;
+    }
+    topics = malloc((count + 1) * sizeof(char *));
+    qos = malloc((count + 1) * sizeof(int));
+    count = 0;
+    if (topics == NULL || qos == NULL) {
+        rc = MQTTCLIENT_FAILURE;
+    }
+    else {
+        for (sub = sess->subs; sub != NULL; sub = sub->next) {
+            if ((topics[count] = strdup(sub->topic)) != NULL) {
+                qos[count++] = sub->qos;
+            }
+        }
+    }
+    pthread_mutex_unlock(&sess->mutex);
+
+    if (count > 0) {
+        last_func = "MQTTClient_subscribeMany";
+        rc = last_rc = client_subscribe_many(sess->client, sess->version, count, topics, qos);
+    }
+    for (int i=0; i<count; i++) {
+        free(topics[i]);
+    }
+    free(topics);
+    free(qos);
+    return rc;
+}
+
+/* Take the MQTT version and MQTT 5 publish settings of opts for sess */
+void session_mqtt5(session *sess, const mqtt_options *opts)
+{
+    sess->version = opts->MQTTVersion != OPTION_UNSET ? opts->MQTTVersion : MQTTVERSION_DEFAULT;
+    if (sess->version >= MQTTVERSION_5) {
+        properties_init(&sess->props, opts);
+        if (opts->topicAliasMaximum != OPTION_UNSET) {
+            sess->alias_limit = opts->topicAliasMaximum < 0 ? 0 : opts->topicAliasMaximum > 65535 ? 65535 : opts->topicAliasMaximum;
+        }
+        // Paho resends unconfirmed QoS 1/2 packets as they were, on a later connection
+        sess->alias_qos0 = (opts->cleansession != OPTION_UNSET && !opts->cleansession) || opts->persistence != NULL;
+    }
+}
+
+/* Start a new connection of sess, see session_disconnected() */
+void session_connected(session *sess, int alias_max)
+{
+    pthread_mutex_lock(&sess->alias_mutex);
+    sess->alias_max = alias_max < sess->alias_limit ? alias_max : sess->alias_limit;
+    if (sess->alias_max > 0 && sess->aliases == NULL) {
+        size_t size;
+
+        // at least half of the table stays empty
+        for (size = 2; size < 2 * (size_t)sess->alias_limit; size <<= 1);
+        sess->aliases = calloc(size, sizeof(topic_alias));
+        sess->aliases_mask = size - 1;
+    }
+    if (sess->aliases == NULL) {
+        sess->alias_max = 0;
+    }
+    pthread_mutex_unlock(&sess->alias_mutex);
+}
+
+/*
+ * Publish msg on the client of sess. MQTT 5 messages get the properties of
+ * sess and a topic alias while the connection has aliases left. Once the
+ * alias was sent along with the topic name, the topic name is omitted.
+ * Sessions kept across connections alias QoS 0 messages only.
+ * The alias mutex is held while a message with an alias is sent, so none
+ * with the alias only can overtake the one establishing it, nor be sent
+ * on a new connection after session_disconnected().
+ * cache (may be NULL) remembers the established alias of a constant topic,
+ * further messages on the same connection skip the alias table.
+ */
+int session_publish_message(session *sess, const char *topic, MQTTClient_message *msg, MQTTClient_deliveryToken *token, topic_cache *cache)
+{
+    MQTTProperties props = MQTTProperties_initializer;
+    topic_alias *establish = NULL;
+    unsigned long epoch = 0;
+    bool alias, aliased = false;
+    int rc;
+
+    if (sess->version < MQTTVERSION_5) {
+        return client_publish(sess->client, sess->version, topic, msg, token, &sess->stats);
+    }
+    if (sess->props.count > 0) {
+        props = MQTTProperties_copy(&sess->props);
+    }
+
+    // a resent packet would carry an alias of a past connection
+    alias = !sess->alias_qos0 || msg->qos == 0;
+    // session_disconnected() can't invalidate the alias while it is sent
+    if (alias && cache != NULL && cache->epoch != 0) {
+        pthread_mutex_lock(&sess->alias_mutex);
+        if (cache->epoch == atomic_load(&sess->alias_epoch)) {
+            MQTTProperty prop;
+
+            prop.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS;
+            prop.value.integer2 = (unsigned short)cache->alias;
+            MQTTProperties_add(&props, &prop);
+            msg->properties = props;
+            rc = client_publish(sess->client, sess->version, "", msg, token, &sess->stats);
+            pthread_mutex_unlock(&sess->alias_mutex);
+            MQTTProperties_free(&props);
+            memcpy(&msg->properties, &(MQTTProperties)MQTTProperties_initializer, sizeof(MQTTProperties));
+            return rc;
+        }
+        pthread_mutex_unlock(&sess->alias_mutex);
+    }
+
+    pthread_mutex_lock(&sess->alias_mutex);
+    epoch = atomic_load(&sess->alias_epoch);
+    if (alias && sess->alias_max > 0) {
+        unsigned int hash = 2166136261u;
+        topic_alias *entry;
+        size_t pos;
+
+        if (cache != NULL) {
+            hash = cache->hash;
+        }
+        else {
+            for (const char *p = topic; *p; p++) {
+                hash = (hash ^ (unsigned char)*p) * 16777619u;
+            }
+        }
+        for (pos = hash & sess->aliases_mask; (entry = &sess->aliases[pos])->topic != NULL; pos = (pos + 1) & sess->aliases_mask) {
+            if (entry->hash == hash && 0 == strcmp(entry->topic, topic)) {
+                break;
+            }
+        }
+        if (entry->topic == NULL && sess->alias_count < sess->alias_max && (entry->topic = strdup(topic)) != NULL) {
+            entry->hash = hash;
+            entry->alias = ++sess->alias_count;
+            entry->established = false;
+        }
+        if (entry->topic != NULL) {
+            MQTTProperty prop;
+
+            aliased = true;
+            prop.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS;
+            prop.value.integer2 = (unsigned short)entry->alias;
+            MQTTProperties_add(&props, &prop);
+            if (entry->established) {
+                topic = "";
+                if (cache != NULL) {
+                    cache->epoch = epoch;
+                    cache->alias = entry->alias;
+                }
+            }
+            else {
+                establish = entry;
+            }
+        }
+    }
+    if (!aliased) {
+        pthread_mutex_unlock(&sess->alias_mutex);
+    }
+
+    msg->properties = props;
+    rc = client_publish(sess->client, sess->version, topic, msg, token, &sess->stats);
+    if (establish != NULL) {
+        establish->established = rc == MQTTCLIENT_SUCCESS;
+        if (cache != NULL && establish->established) {
+            cache->epoch = epoch;
+            cache->alias = establish->alias;
+        }
+    }
+    if (aliased) {
+        pthread_mutex_unlock(&sess->alias_mutex);
+    }
+    MQTTProperties_free(&props);
+    memcpy(&msg->properties, &(MQTTProperties)MQTTProperties_initializer, sizeof(MQTTProperties));
+    return rc;
+}
+
+/*
+ * Publish a message on an async session without waiting for its completion.
+ * QoS 1/2 messages are counted as in-flight until confirmed by the broker;
+ * if max_inflight messages are pending wait up to timeout ms for a free slot.
+ * token (may be NULL) returns the delivery token of a QoS 1/2 message or -1.
+ */
+int session_publish(session *sess, const char *topic, MQTTClient_message *msg, int timeout, topic_cache *cache, MQTTClient_deliveryToken *token)
+{
+    MQTTClient_deliveryToken dt = -1;
+    int rc = MQTTCLIENT_SUCCESS;
+
+    if (token != NULL) {
+        *token = -1;
+    }
+
+    if (msg->qos > 0) {
+        struct timespec ts;
+
+        deadline(&ts, timeout);
+        pthread_mutex_lock(&sess->mutex);
+        while (rc == MQTTCLIENT_SUCCESS && sess->inflight >= sess->max_inflight) {
+            if (ETIMEDOUT == pthread_cond_timedwait(&sess->cond, &sess->mutex, &ts)) {
+                rc = MQTTCLIENT_MAX_MESSAGES_INFLIGHT;
+            }
+        }
+        if (rc == MQTTCLIENT_SUCCESS) {
+            sess->inflight++;
+        }
+        pthread_mutex_unlock(&sess->mutex);
+        if (rc != MQTTCLIENT_SUCCESS) {
+            last_func = "mqtt_publish";
+            return rc;
+        }
+    }
+
+    last_func = "MQTTClient_publishMessage";
+    rc = session_publish_message(sess, topic, msg, &dt, cache);
+    if (rc != MQTTCLIENT_SUCCESS) {
+        pthread_mutex_lock(&sess->mutex);
+        if (msg->qos > 0) {
+            sess->inflight--;
+            pthread_cond_broadcast(&sess->cond);
+        }
+        sess->failed++;
+        sess->rc = rc;
+        pthread_mutex_unlock(&sess->mutex);
+    }
+    else if (token != NULL && msg->qos > 0) {
+        *token = dt;
+    }
+    return rc;
+}
+
+/* Returns the number of tokens (-1 ignored) still pending on client */
+int batch_pending(MQTTClient client, const MQTTClient_deliveryToken *tokens, int count)
+{
+    MQTTClient_deliveryToken *pending = NULL;
+    int n = 0;
+
+    if (MQTTClient_getPendingDeliveryTokens(client, &pending) != MQTTCLIENT_SUCCESS || pending == NULL) {
+        return 0;
+    }
+    for (int i=0; i<count; i++) {
+        if (tokens[i] < 0) {
+            continue;
+        }
+        for (MQTTClient_deliveryToken *p = pending; *p != -1; p++) {
+            if (*p == tokens[i]) {
+                n++;
+                break;
+            }
+        }
+    }
+    MQTTClient_free(pending);
+    return n;
+}
+
+/*
+ * Publish the buffered messages of sess in order, each one is removed once
+ * it was handed over to the client or refused by the server. Returns false
+ * to retry after a backoff, true if the buffer is empty and sess is online
+ * again.
+ */
+bool session_replay(session *sess)
+{
+    MQTTClient_deliveryToken token;
+    offline_msg *om;
+    bool waited;
+    int rc;
+
+    for (;;) {
+        pthread_mutex_lock(&sess->mutex);
+        if ((om = sess->offline_head) == NULL) {
+            atomic_store(&sess->offline, 0);
+            pthread_mutex_unlock(&sess->mutex);
+            return true;
+        }
+        pthread_mutex_unlock(&sess->mutex);
+        if (atomic_load(&sess->closed)) {
+            return false;
+        }
+
+        MQTTClient_message pubmsg = MQTTClient_message_initializer;
+        pubmsg.payload = om->payload;
+        pubmsg.payloadlen = om->payloadlen;
+        pubmsg.qos = om->qos;
+        pubmsg.retained = om->retained;
+        waited = false;
+        if (sess->async) {
+            rc = session_publish(sess, om->topic, &pubmsg, DEFAULT_TIMEOUT, NULL, NULL);
+        }
+        else {
+            rc = session_publish_message(sess, om->topic, &pubmsg, &token, NULL);
+            if (rc == MQTTCLIENT_SUCCESS) {
+                waited = true;
+                rc = client_wait(sess->client, token, DEFAULT_TIMEOUT, &sess->stats);
+            }
+        }
+        if (rc != MQTTCLIENT_SUCCESS && (waited || rc == MQTTCLIENT_DISCONNECTED || rc == MQTTCLIENT_MAX_MESSAGES_INFLIGHT)) {
+            // lost again, timed out or no free in-flight slot: retry after backoff
+            TRACE(TRACE_INFO, "session_replay(): client %p, rc=%d", sess->client, rc);
+            return false;
+        }
+        // delivered, or refused for good by the client, e.g. an invalid topic
+        pthread_mutex_lock(&sess->mutex);
+        if ((sess->offline_head = om->next) == NULL) {
+            sess->offline_tail = NULL;
+        }
+        sess->offline_count--;
+        if (rc != MQTTCLIENT_SUCCESS) {
+            sess->failed++;
+        }
+        pthread_mutex_unlock(&sess->mutex);
+        if (rc != MQTTCLIENT_SUCCESS) {
+            TRACE(TRACE_ERROR, "session_replay(): message refused, rc=%d", rc);
+            last_func = "session_replay";
+            last_rc = rc;
+            session_lasterror(sess);
+        }
+        free(om);
+    }
+}
+
+/*
+ * Reconnect sess, renew its subscriptions and replay its buffer. Returns
+ * true if done or sess was closed, false to retry after sess->delay ms.
+ */
+bool session_redial(session *sess)
+{
+    int alias_max, rc;
+
+    if (!atomic_load(&sess->closed) && !MQTTClient_isConnected(sess->client)) {
+        session_disconnected(sess);
+        rc = client_connect(sess->client, &sess->connect->conn_opts, &alias_max, &sess->stats);
+        TRACE(TRACE_INFO, "session_redial(): client %p, rc=%d", sess->client, rc);
+        if (rc == MQTTCLIENT_SUCCESS) {
+            session_connected(sess, alias_max);
+            session_resubscribe(sess);
+            pthread_mutex_lock(&sess->mutex);
+            sess->reconnects++;
+            pthread_mutex_unlock(&sess->mutex);
+            sess->delay = sess->reconnect_delay;
+        }
+    }
+    if (atomic_load(&sess->closed)) {
+        // mqtt_disconnect() may have run while connecting
+        if (MQTTClient_isConnected(sess->client)) {
+            MQTTClient_disconnect(sess->client, 0);
+        }
+        return true;
+    }
+    if (MQTTClient_isConnected(sess->client) && session_replay(sess)) {
+        return true;
+    }
+    sess->delay = sess->delay > sess->reconnect_max_delay / 2 ? sess->reconnect_max_delay : 2 * sess->delay;
+    return false;
+}
+
+/* Background thread reconnecting the sessions on reconnect_list when due */
+void *reconnect_run(void *arg)
+{
+    struct timespec now, *next;
+    session **pp, *sess;
+
+    pthread_mutex_lock(&reconnect_mutex);
+    while (!reconnect_stopping) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        next = NULL;
+        for (pp = &reconnect_list; (sess = *pp) != NULL; pp = &sess->reconnect_next) {
+            if (atomic_load(&sess->closed) || sess->retry.tv_sec < now.tv_sec
+                || (sess->retry.tv_sec == now.tv_sec && sess->retry.tv_nsec <= now.tv_nsec)) {
+                break;
+            }
+            if (next == NULL || sess->retry.tv_sec < next->tv_sec
+                || (sess->retry.tv_sec == next->tv_sec && sess->retry.tv_nsec < next->tv_nsec)) {
+                next = &sess->retry;
+            }
+        }
+        if (sess == NULL) {
+            if (next != NULL) {
+                pthread_cond_timedwait(&reconnect_cond, &reconnect_mutex, next);
+            }
+            else {
+                pthread_cond_wait(&reconnect_cond, &reconnect_mutex);
+            }
+            continue;
+        }
+        *pp = sess->reconnect_next;
+        pthread_mutex_unlock(&reconnect_mutex);
+
+        if (session_redial(sess)) {
+            session_put(sess);
+            pthread_mutex_lock(&reconnect_mutex);
+        }
+        else {
+            pthread_mutex_lock(&reconnect_mutex);
+            deadline(&sess->retry, reconnect_jitter(sess->delay));
+            sess->reconnect_next = reconnect_list;
+            reconnect_list = sess;
+        }
+    }
+    pthread_mutex_unlock(&reconnect_mutex);
+    return NULL;
+}
+
+/* Start the reconnect thread unless it is running, returns rc */
+int reconnect_start(void)
+{
+    int rc = MQTTCLIENT_SUCCESS;
+
+    pthread_mutex_lock(&reconnect_mutex);
+    if (!reconnect_running && !reconnect_stopping) {
+        reconnect_running = 0 == pthread_create(&reconnect_thread, NULL, reconnect_run, NULL);
+    }
+    if (!reconnect_running) {
+        rc = MQTTCLIENT_FAILURE;
+    }
+    pthread_mutex_unlock(&reconnect_mutex);
+    return rc;
+}
+
+/* Mark sess as released, a pending reconnect is dropped */
+void session_close(session *sess)
+{
+    atomic_store(&sess->closed, 1);
+    pthread_mutex_lock(&reconnect_mutex);
+    pthread_cond_signal(&reconnect_cond);
+    pthread_mutex_unlock(&reconnect_mutex);
+}
+
+/* Stop the reconnect thread before the library is unloaded */
+__attribute__((destructor)) void reconnect_cleanup(void)
+{
+    session *sess;
+
+    pthread_mutex_lock(&reconnect_mutex);
+    reconnect_stopping = true;
+    pthread_cond_signal(&reconnect_cond);
+    pthread_mutex_unlock(&reconnect_mutex);
+    if (reconnect_running) {
+        pthread_join(reconnect_thread, NULL);
+        reconnect_running = false;
+    }
+    while ((sess = reconnect_list) != NULL) {
+        reconnect_list = sess->reconnect_next;
+        session_put(sess);
+    }
+}
+
+/* Connection pool for server-form calls */
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pool_entry *pool_idle = NULL;
+
+/*
+ * Build the pool key from the connection relevant arguments into conn->poolkey.
+ * Each part is prefixed by a NULL marker so NULL and '' are distinguished.
+ */
+bool pool_key(connection *conn, UDF_ARGS *args, int nargs, ...)
+{
+    va_list ap;
+    size_t len = 0;
+
+    va_start(ap, nargs);
+    for (int i=0; i<nargs; i++) {
+        int arg = va_arg(ap, int);
+        len += 1 + (arg >= 0 && args->args[arg] != NULL ? args->lengths[arg] + 1 : 0);
+    }
+    va_end(ap);
+
+    if (len > conn->poolkey_size) {
+        char *key = realloc(conn->poolkey, len);
+        if (key == NULL) {
+            return false;
+        }
+        conn->poolkey = key;
+        conn->poolkey_size = len;
+    }
+
+    char *p = conn->poolkey;
+    va_start(ap, nargs);
+    for (int i=0; i<nargs; i++) {
+        int arg = va_arg(ap, int);
+        if (arg >= 0 && args->args[arg] != NULL) {
+            *p++ = 1;
+            memcpy(p, args->args[arg], args->lengths[arg]);
+            p += args->lengths[arg];
+            *p++ = '\0';
+        }
+        else {
+            *p++ = 0;
+        }
+    }
+    va_end(ap);
+    conn->poolkey_len = len;
+
+    // FNV-1a
+    conn->poolhash = 2166136261u;
+    for (size_t i=0; i<len; i++) {
+        conn->poolhash = (conn->poolhash ^ (unsigned char)conn->poolkey[i]) * 16777619u;
+    }
+    return true;
+}
+
+void pool_free_entry(pool_entry *entry)
+{
+    MQTTClient_disconnect(entry->client, 0);
+    MQTTClient_destroy(&entry->client);
+    free(entry);
+}
+
+/*
+ * Take an idle, healthy connection matching conn->poolkey from the pool.
+ * Idle entries not used within their keepalive interval or POOL_IDLE_TIMEOUT
+ * are evicted as the broker may have dropped them already.
+ * Returns NULL if there is none.
+ */
+MQTTClient pool_acquire(connection *conn)
+{
+    pool_entry **pp, *entry, *evicted = NULL;
+    MQTTClient client = NULL;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&pool_mutex);
+    pp = &pool_idle;
+    while ((entry = *pp) != NULL) {
+        time_t idle = now - entry->last_used;
+        if (idle >= POOL_IDLE_TIMEOUT
+            || (entry->keepalive > 0 && idle >= entry->keepalive)
+            || !MQTTClient_isConnected(entry->client)) {
+            *pp = entry->next;
+            entry->next = evicted;
+            evicted = entry;
+            continue;
+        }
+        if (client == NULL
+            && entry->hash == conn->poolhash
+            && entry->key_len == conn->poolkey_len
+            && 0 == memcmp(entry->key, conn->poolkey, conn->poolkey_len)) {
+            *pp = entry->next;
+            client = entry->client;
+            free(entry);
+            continue;
+        }
+        pp = &entry->next;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    // Disconnect outside the lock, it may wait for the network
+    while ((entry = evicted) != NULL) {
+        evicted = entry->next;
+        pool_free_entry(entry);
+    }
+    return client;
+}
+
+/*
+ * Return a connected client to the pool.
+ * If the pool already holds POOL_MAX_PER_KEY idle connections for the key,
+ * the client is disconnected instead.
+ */
+void pool_release(connection *conn, MQTTClient client, int keepalive)
+{
+    pool_entry *entry = malloc(sizeof(pool_entry) + conn->poolkey_len);
+    int count = 0;
+
+    if (entry == NULL) {
+        MQTTClient_disconnect(client, 0);
+        MQTTClient_destroy(&client);
+        return;
+    }
+    entry->client = client;
+    entry->hash = conn->poolhash;
+    entry->key_len = conn->poolkey_len;
+    memcpy(entry->key, conn->poolkey, conn->poolkey_len);
+    entry->keepalive = keepalive;
+    entry->last_used = time(NULL);
+
+    pthread_mutex_lock(&pool_mutex);
+    for (pool_entry *e = pool_idle; e != NULL; e = e->next) {
+        if (e->hash == entry->hash && e->key_len == entry->key_len && 0 == memcmp(e->key, entry->key, entry->key_len)) {
+            count++;
+        }
+    }
+    if (count < POOL_MAX_PER_KEY) {
+        entry->next = pool_idle;
+        pool_idle = entry;
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (entry != NULL) {
+        pool_free_entry(entry);
+    }
+}
+
+/* Disconnect all pooled connections when the library is unloaded */
+__attribute__((destructor)) void pool_cleanup(void)
+{
+    pool_entry *entry;
+
+    pthread_mutex_lock(&pool_mutex);
+    while ((entry = pool_idle) != NULL) {
+        pool_idle = entry->next;
+        pool_free_entry(entry);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Background publisher */
+publisher queue = {.state = QUEUE_STOPPED};
+pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;   // serializes start/stop
+
+/*
+ * Bounded lock-free queue (D. Vyukov's bounded MPMC queue).
+ * Producers are the SQL threads calling mqtt_enqueue(), the consumer is
+ * the publisher thread; with "drop" overflow policy producers also
+ * consume the oldest message.
+ * Returns false if the queue is full.
+ */
+bool queue_push(queue_msg *msg)
+{
+    queue_cell *cell;
+    size_t pos = atomic_load_explicit(&queue.head, memory_order_relaxed);
+
+    for (;;) {
+        cell = &queue.cells[pos & queue.mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue.head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (dif < 0) {
+            return false;
+        }
+        else {
+            pos = atomic_load_explicit(&queue.head, memory_order_relaxed);
+        }
+    }
+    cell->msg = msg;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+/* Returns the oldest message or NULL if the queue is empty */
+queue_msg *queue_pop(void)
+{
+    queue_cell *cell;
+    queue_msg *msg;
+    size_t pos = atomic_load_explicit(&queue.tail, memory_order_relaxed);
+
+    for (;;) {
+        cell = &queue.cells[pos & queue.mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue.tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (dif < 0) {
+            return NULL;
+        }
+        else {
+            pos = atomic_load_explicit(&queue.tail, memory_order_relaxed);
+        }
+    }
+    msg = cell->msg;
+    atomic_store_explicit(&cell->seq, pos + queue.mask + 1, memory_order_release);
+    return msg;
+}
+
+/* Wake up producers blocked on a full queue after messages were taken */
+void queue_released(void)
+{
+    // pairs with the increment of queue.blocked before queue_push()
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&queue.blocked) > 0) {
+        pthread_mutex_lock(&queue.mutex);
+        pthread_cond_broadcast(&queue.space);
+        pthread_mutex_unlock(&queue.mutex);
+    }
+}
+
+/* Wake up the publisher thread if it waits for new messages */
+void queue_wakeup(void)
+{
+    if (atomic_load(&queue.sleeping)) {
+        pthread_mutex_lock(&queue.mutex);
+        pthread_cond_signal(&queue.cond);
+        pthread_mutex_unlock(&queue.mutex);
+    }
+}
+
+/* (Re)connect the publisher session, returns client_connect() rc */
+int queue_connect(void)
+{
+    int alias_max, rc;
+
+    session_disconnected(queue.sess);
+    rc = client_connect(queue.sess->client, &queue.conn.conn_opts, &alias_max, &queue.sess->stats);
+    if (rc == MQTTCLIENT_SUCCESS) {
+        session_connected(queue.sess, alias_max);
+        pthread_mutex_lock(&queue.sess->mutex);
+        queue.sess->rc = MQTTCLIENT_SUCCESS;
+        pthread_mutex_unlock(&queue.sess->mutex);
+    }
+    return rc;
+}
+
+/*
+ * Wait on queue.cond until ts or new messages are enqueued.
+ * Returns ETIMEDOUT if ts was reached.
+ */
+int queue_sleep(const struct timespec *ts)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&queue.mutex);
+    atomic_store(&queue.sleeping, 1);
+    if (atomic_load(&queue.head) == atomic_load(&queue.tail) && QUEUE_RUNNING == atomic_load(&queue.state)) {
+        rc = pthread_cond_timedwait(&queue.cond, &queue.mutex, ts);
+    }
+    atomic_store(&queue.sleeping, 0);
+    pthread_mutex_unlock(&queue.mutex);
+    return rc;
+}
+
+/*
+ * Take up to queue.batch_max messages into queue.batch. After the first
+ * message wait up to queue.linger ms for further ones.
+ * Returns the number of messages taken.
+ */
+int queue_collect(void)
+{
+    struct timespec ts;
+    queue_msg *msg;
+    int n = 0;
+
+    while (n < queue.batch_max) {
+        msg = queue_pop();
+        if (msg != NULL) {
+            if (n == 0) {
+                deadline(&ts, queue.linger);
+            }
+            queue.batch[n++] = msg;
+            queue_released();
+            continue;
+        }
+        if (n == 0 || queue.linger <= 0 || QUEUE_RUNNING != atomic_load(&queue.state)
+            || ETIMEDOUT == queue_sleep(&ts)) {
+            break;
+        }
+    }
+    return n;
+}
+
+/*
+ * Last value wins: of the messages within queue.batch flagged to be
+ * coalesced only the last one per topic is kept, using an open addressing
+ * hash table of batch indexes. Returns the remaining number of messages.
+ */
+int queue_coalesce(int n)
+{
+    int kept = 0;
+
+    memset(queue.slots, -1, (queue.slots_mask + 1) * sizeof(int));
+    for (int i=0; i<n; i++) {
+        queue_msg *msg = queue.batch[i];
+        size_t pos = msg->hash & queue.slots_mask;
+
+        if (!msg->coalesce) {
+            continue;
+        }
+        for (; queue.slots[pos] >= 0; pos = (pos + 1) & queue.slots_mask) {
+            queue_msg *prev = queue.batch[queue.slots[pos]];
+            if (prev->hash == msg->hash && 0 == strcmp(prev->topic, msg->topic)) {
+                queue.batch[queue.slots[pos]] = NULL;
+                free(prev);
+                break;
+            }
+        }
+        queue.slots[pos] = i;
+    }
+    for (int i=0; i<n; i++) {
+        if (queue.batch[i] != NULL) {
+            queue.batch[kept++] = queue.batch[i];
+        }
+    }
+    atomic_fetch_add(&queue.coalesced, n - kept);
+    return kept;
+}
+
+/* Wait up to timeout ms until the publisher has no unconfirmed messages */
+bool queue_wait_inflight(int timeout)
+{
+    struct timespec ts;
+    bool done;
+
+    deadline(&ts, timeout);
+    pthread_mutex_lock(&queue.sess->mutex);
+    while (queue.sess->inflight > 0) {
+        if (ETIMEDOUT == pthread_cond_timedwait(&queue.sess->cond, &queue.sess->mutex, &ts)) {
+            break;
+        }
+    }
+    done = queue.sess->inflight == 0;
+    pthread_mutex_unlock(&queue.sess->mutex);
+    return done;
+}
+
+/*
+ * Publish the n messages of queue.batch in order with a single completion
+ * wait at the end. If the connection is lost meanwhile the whole batch is
+ * published again after reconnect: per-topic order is kept at the cost of
+ * possible duplicates. Otherwise a failed message doesn't stop the others.
+ * Returns the number of messages published and confirmed.
+ */
+int queue_publish_batch(int n)
+{
+    MQTTClient_message pubmsg = MQTTClient_message_initializer;
+    unsigned long losses;
+    int rejected, awaited;
+    bool lost;
+
+    for (;;) {
+        if (!MQTTClient_isConnected(queue.sess->client) && MQTTCLIENT_SUCCESS != queue_connect()) {
+            // broker not reachable: keep the messages unless we are stopping
+            if (QUEUE_RUNNING != atomic_load(&queue.state)) {
+                return 0;
+            }
+            usleep(QUEUE_RECONNECT_WAIT * 1000L);
+            continue;
+        }
+        pthread_mutex_lock(&queue.sess->mutex);
+        losses = queue.sess->losses;
+        pthread_mutex_unlock(&queue.sess->mutex);
+
+        rejected = awaited = 0;
+        for (int i=0; i<n; i++) {
+            pubmsg.payload = queue.batch[i]->payload;
+            pubmsg.payloadlen = queue.batch[i]->payloadlen;
+            if (payload_deflate(&queue.sess->compress, pubmsg.payload, pubmsg.payloadlen, &queue.packed)) {
+                // the client copies the payload, queue.packed can be reused for the next one
+                pubmsg.payload = queue.packed.buf;
+                pubmsg.payloadlen = queue.packed.len;
+            }
+            pubmsg.qos = queue.batch[i]->qos;
+            pubmsg.retained = queue.batch[i]->retained;
+            if (MQTTCLIENT_SUCCESS != session_publish(queue.sess, queue.batch[i]->topic, &pubmsg, DEFAULT_TIMEOUT, NULL, &queue.tokens[i])) {
+                rejected++;
+            }
+            else if (queue.tokens[i] >= 0) {
+                awaited++;
+            }
+        }
+        queue_wait_inflight(DEFAULT_TIMEOUT);
+
+        pthread_mutex_lock(&queue.sess->mutex);
+        lost = losses != queue.sess->losses;
+        pthread_mutex_unlock(&queue.sess->mutex);
+        // retry only if the connection was lost while publishing
+        if (!lost) {
+            return n - rejected - batch_pending(queue.sess->client, queue.tokens, n);
+        }
+        if (QUEUE_RUNNING != atomic_load(&queue.state)) {
+            // confirmations of the lost connection are unknown
+            return n - rejected - awaited;
+        }
+    }
+}
+
+void *queue_run(void *arg)
+{
+    struct timespec ts;
+    int n;
+
+    for (;;) {
+        n = queue_collect();
+        if (n > 1 && queue.slots != NULL) {
+            n = queue_coalesce(n);
+        }
+        if (n == 0) {
+            if (QUEUE_RUNNING != atomic_load(&queue.state)) {
+                break;
+            }
+            deadline(&ts, QUEUE_IDLE_WAIT);
+            queue_sleep(&ts);
+            continue;
+        }
+        int published = queue_publish_batch(n);
+        atomic_fetch_add(&queue.published, published);
+        atomic_fetch_add(&queue.failed, n - published);
+        atomic_fetch_add(&queue.batches, 1);
+        for (int i=0; i<n; i++) {
+            free(queue.batch[i]);
+        }
+    }
+    return NULL;
+}
+
+/* Release all publisher resources, queue_mutex must be held */
+void queue_free(void)
+{
+    queue_msg *msg;
+
+    if (queue.cells != NULL) {
+        while ((msg = queue_pop()) != NULL) {
+            free(msg);
+        }
+        free(queue.cells);
+        queue.cells = NULL;
+    }
+    free(queue.batch);
+    queue.batch = NULL;
+    free(queue.tokens);
+    queue.tokens = NULL;
+    free(queue.slots);
+    queue.slots = NULL;
+    free(queue.packed.buf);
+    memset(&queue.packed, 0, sizeof(strbuf));
+    if (queue.sess != NULL) {
+        if (MQTTClient_isConnected(queue.sess->client)) {
+            MQTTClient_disconnect(queue.sess->client, DEFAULT_TIMEOUT);
+        }
+        // mqtt_connections() may still hold a reference
+        session_put(queue.sess);
+        queue.sess = NULL;
+    }
+    free_options(&queue.options);
+    free(queue.username);
+    free(queue.password);
+    queue.username = queue.password = NULL;
+    pthread_cond_destroy(&queue.cond);
+    pthread_cond_destroy(&queue.space);
+    pthread_mutex_destroy(&queue.mutex);
+}
+
+/*
+ * Start the background publisher connected to address.
+ * Returns MQTTCLIENT_SUCCESS or error code.
+ */
+int queue_start(const char *address, const char *username, const char *password, const char *options, unsigned long options_len)
+{
+    size_t size;
+    int rc;
+
+    pthread_mutex_lock(&queue_mutex);
+    if (QUEUE_STOPPED != atomic_load(&queue.state)) {
+        pthread_mutex_unlock(&queue_mutex);
+        return MQTTCLIENT_FAILURE;
+    }
+
+    pthread_mutex_init(&queue.mutex, NULL);
+    pthread_cond_init(&queue.cond, NULL);
+    pthread_cond_init(&queue.space, NULL);
+    parse_options(&queue.options, options, options_len);
+    queue.username = username != NULL ? strdup(username) : NULL;
+    queue.password = password != NULL ? strdup(password) : NULL;
+
+    // capacity rounded up to power of 2
+    for (size = 2; size < (queue.options.queueSize > 0 ? (size_t)queue.options.queueSize : QUEUE_DEFAULT_SIZE); size <<= 1);
+    queue.mask = size - 1;
+    queue.overflow = QUEUE_OVERFLOW_BLOCK;
+    if (queue.options.queueOverflow != NULL) {
+        if (0 == strcmp(queue.options.queueOverflow, "drop")) {
+            queue.overflow = QUEUE_OVERFLOW_DROP;
+        }
+        else if (0 == strcmp(queue.options.queueOverflow, "error")) {
+            queue.overflow = QUEUE_OVERFLOW_ERROR;
+        }
+    }
+    queue.batch_max = queue.options.queueBatch > 0 ? queue.options.queueBatch : QUEUE_DEFAULT_BATCH;
+    queue.linger = queue.options.queueLinger > 0 ? queue.options.queueLinger : 0;
+    queue.cells = malloc(size * sizeof(queue_cell));
+    queue.batch = malloc(queue.batch_max * sizeof(queue_msg *));
+    queue.tokens = malloc(queue.batch_max * sizeof(MQTTClient_deliveryToken));
+    queue.slots = NULL;
+    if (queue.options.coalesceWindow > 0) {
+        size_t slots;
+
+        // messages are held back for the window, at least half of the hash table stays empty
+        if (queue.linger < queue.options.coalesceWindow) {
+            queue.linger = queue.options.coalesceWindow;
+        }
+        for (slots = 2; slots < 2 * (size_t)queue.batch_max; slots <<= 1);
+        queue.slots_mask = slots - 1;
+        queue.slots = malloc(slots * sizeof(int));
+    }
+    queue.sess = session_create();
+    if (queue.cells == NULL || queue.batch == NULL || queue.tokens == NULL || queue.sess == NULL
+        || (queue.options.coalesceWindow > 0 && queue.slots == NULL)) {
+        queue_free();
+        pthread_mutex_unlock(&queue_mutex);
+        return MQTTCLIENT_FAILURE;
+    }
+    for (size_t i=0; i<size; i++) {
+        atomic_init(&queue.cells[i].seq, i);
+    }
+    atomic_store(&queue.head, 0);
+    atomic_store(&queue.tail, 0);
+    atomic_store(&queue.enqueued, 0);
+    atomic_store(&queue.published, 0);
+    atomic_store(&queue.dropped, 0);
+    atomic_store(&queue.failed, 0);
+    atomic_store(&queue.batches, 0);
+    atomic_store(&queue.coalesced, 0);
+
+    queue.sess->async = true;
+    if (queue.options.maxInflightMessages > 0) {
+        queue.sess->max_inflight = queue.options.maxInflightMessages;
+    }
+    compression_init(&queue.sess->compress, &queue.options);
+    session_mqtt5(queue.sess, &queue.options);
+    last_func = "MQTTClient_create";
+    rc = last_rc = client_create(&queue.sess->client, address, &queue.options, queue.sess);
+    queue.sess->server = strdup(address);
+    queue.sess->created = time(NULL);
+    atomic_store(&queue.sess->last_used, queue.sess->created);
+    if (rc != MQTTCLIENT_SUCCESS) {
+        queue.sess->client = NULL;
+        queue_free();
+        pthread_mutex_unlock(&queue_mutex);
+        return rc;
+    }
+    create_conn(&queue.conn, queue.username, queue.password, &queue.options);
+    last_func = "MQTTClient_setCallbacks";
+    rc = last_rc = MQTTClient_setCallbacks(queue.sess->client, queue.sess, session_connection_lost, session_message_arrived, session_delivery_complete);
+    if (rc == MQTTCLIENT_SUCCESS) {
+        last_func = "MQTTClient_connect";
+        rc = last_rc = queue_connect();
+    }
+    if (rc == MQTTCLIENT_SUCCESS) {
+        atomic_store(&queue.state, QUEUE_RUNNING);
+        if (0 != pthread_create(&queue.thread, NULL, queue_run, NULL)) {
+            atomic_store(&queue.state, QUEUE_STOPPED);
+            last_func = "pthread_create";
+            rc = last_rc = MQTTCLIENT_FAILURE;
+        }
+    }
+    if (rc != MQTTCLIENT_SUCCESS) {
+        queue_free();
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    return rc;
+}
+
+/*
+ * Stop the background publisher after all queued messages are published.
+ * Returns MQTTCLIENT_SUCCESS or MQTTCLIENT_FAILURE if not running.
+ */
+int queue_stop(void)
+{
+    pthread_mutex_lock(&queue_mutex);
+    if (QUEUE_RUNNING != atomic_load(&queue.state)) {
+        pthread_mutex_unlock(&queue_mutex);
+        return MQTTCLIENT_FAILURE;
+    }
+    atomic_store(&queue.state, QUEUE_STOPPING);
+    // wake producers blocked on a full queue and wait for queue_leave() of all
+    pthread_mutex_lock(&queue.mutex);
+    pthread_cond_broadcast(&queue.space);
+    while (atomic_load(&queue.producers) > 0) {
+        pthread_cond_wait(&queue.space, &queue.mutex);
+    }
+    pthread_cond_signal(&queue.cond);
+    pthread_mutex_unlock(&queue.mutex);
+    pthread_join(queue.thread, NULL);
+    queue_free();
+    atomic_store(&queue.state, QUEUE_STOPPED);
+    pthread_mutex_unlock(&queue_mutex);
+    return MQTTCLIENT_SUCCESS;
+}
+
+/* Stop the publisher thread before the library is unloaded */
+__attribute__((destructor)) void queue_cleanup(void)
+{
+    queue_stop();
+}
+
+/* Leave mqtt_enqueue(), the last producer wakes up a pending queue_stop() */
+void queue_leave(void)
+{
+    if (atomic_fetch_sub(&queue.producers, 1) == 1 && QUEUE_RUNNING != atomic_load(&queue.state)) {
+        pthread_mutex_lock(&queue.mutex);
+        pthread_cond_broadcast(&queue.space);
+        pthread_mutex_unlock(&queue.mutex);
+    }
+}
+
+/*
+ * Add a message to the background publisher queue applying the overflow
+ * policy if the queue is full.
+ */
+int queue_enqueue(const char *topic, unsigned long topiclen, const char *payload, unsigned long payloadlen, int qos, int retained, int coalesce)
+{
+    queue_msg *msg;
+    int rc = MQTTCLIENT_SUCCESS;
+
+    atomic_fetch_add(&queue.producers, 1);
+    if (QUEUE_RUNNING != atomic_load(&queue.state)) {
+        queue_leave();
+        return MQTTCLIENT_DISCONNECTED;
+    }
+
+    msg = malloc(sizeof(queue_msg) + topiclen + 1 + payloadlen);
+    if (msg == NULL) {
+        queue_leave();
+        return MQTTCLIENT_FAILURE;
+    }
+    memcpy(msg->topic, topic, topiclen);
+    msg->topic[topiclen] = '\0';
+    msg->payload = msg->topic + topiclen + 1;
+    memcpy(msg->payload, payload, payloadlen);
+    msg->payloadlen = payloadlen;
+    msg->qos = qos;
+    msg->retained = retained;
+    msg->coalesce = coalesce || retained;
+    // FNV-1a, computed here to keep it off the publisher thread
+    msg->hash = 2166136261u;
+    for (unsigned long i=0; i<topiclen; i++) {
+        msg->hash = (msg->hash ^ (unsigned char)topic[i]) * 16777619u;
+    }
+
+    if (!queue_push(msg)) {
+        struct timespec ts;
+
+        switch (queue.overflow) {
+            case QUEUE_OVERFLOW_DROP:
+                // make room by discarding the oldest messages
+                do {
+                    queue_msg *oldest = queue_pop();
+                    if (oldest != NULL) {
+                        free(oldest);
+                        atomic_fetch_add(&queue.dropped, 1);
+                    }
+                } while (!queue_push(msg));
+                break;
+            case QUEUE_OVERFLOW_BLOCK:
+                // wait for queue_released() by the publisher thread
+                deadline(&ts, DEFAULT_TIMEOUT);
+                atomic_fetch_add(&queue.blocked, 1);
+                pthread_mutex_lock(&queue.mutex);
+                while (!queue_push(msg)) {
+                    if (QUEUE_RUNNING != atomic_load(&queue.state)) {
+                        rc = MQTTCLIENT_DISCONNECTED;
+                        break;
+                    }
+                    if (ETIMEDOUT == pthread_cond_timedwait(&queue.space, &queue.mutex, &ts)) {
+                        rc = queue_push(msg) ? MQTTCLIENT_SUCCESS : MQTTCLIENT_MAX_MESSAGES_INFLIGHT;
+                        break;
+                    }
+                }
+                pthread_mutex_unlock(&queue.mutex);
+                atomic_fetch_sub(&queue.blocked, 1);
+                break;
+            default:
+                rc = MQTTCLIENT_MAX_MESSAGES_INFLIGHT;
+                break;
+        }
+    }
+    if (rc == MQTTCLIENT_SUCCESS) {
+        atomic_fetch_add(&queue.enqueued, 1);
+        queue_wakeup();
+    }
+    else {
+        free(msg);
+        atomic_fetch_add(&queue.dropped, 1);
+    }
+    queue_leave();
+    return rc;
+}
+
+/* Library functions */
+
+/**
+ * mqtt_info
+ *
+ * Returns udf library info as JSON string
+ * mqtt_info()
+ *
+ */
+bool mqtt_info_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (args->arg_count != 0) {
+        parmerror("mqtt_info()", args);
+        strcpy(message, "No arguments allowed (udf: mqtt_info)");
+        return 1;
+    }
+    initid->ptr = malloc(MAX_RET_STRLEN+1);
+    if (initid->ptr == NULL) {
+        strcpy(message, "memory allocation error");
+        return 1;
+    }
+    initid->max_length = MAX_RET_STRLEN;
+
+    return 0;
+}
+
+void mqtt_info_deinit(UDF_INIT *initid)
+{
+    if (initid->ptr != NULL) {
+        free(initid->ptr);
+    }
+}
+
+char* mqtt_info(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error)
+{
+    MQTTClient_nameValue *mqttClientVersion;
+    char libinfo[MAX_RET_STRLEN] = {0};
+    char *res = (char *)initid->ptr;
+
+    TRACE(TRACE_DEBUG, "mqtt_info()");
+
+    *is_null = 0;
+    *error = 0;
+
+    if (res == NULL) {
+        strcpy(result, "memory allocation error");
+        *length = strlen(result);
+        *error = 1;
+        return result;
+    }
+
+    mqttClientVersion = MQTTClient_getVersionInfo();
+    while (mqttClientVersion != NULL &&
+           mqttClientVersion->name != NULL &&
+           mqttClientVersion->value != NULL &&
+           strlen(libinfo) < MAX_RET_STRLEN-1) {
+        if (*libinfo) {
+            strcat(libinfo, ",");
+        }
+        if( (strlen(libinfo) + strlen(mqttClientVersion->name) + strlen(mqttClientVersion->value) + 5) < MAX_RET_STRLEN-1) {
+            char *value = malloc(strlen(mqttClientVersion->value));
+            if (value != NULL) {
+                strcpy(value, mqttClientVersion->value);
+                sprintf(libinfo+strlen(libinfo), "\"%s\":\"%s\"", mqttClientVersion->name, strcrpl(value, '"', '\''));
+                free(value);
+            }
+            mqttClientVersion++;
+        }
+    }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-truncation"
+    snprintf(res, MAX_RET_STRLEN, "{\"Name\": \"%s\", \"Version\": \"%s\", \"Build\": \"%s\", \"Library\": {%s}}", LIBNAME, LIBVERSION, LIBBUILD, libinfo);
+#pragma GCC diagnostic pop
+
+    *length = strlen(res);
+    TRACE(TRACE_DEBUG, "mqtt_info(): %s", res);
+    return res;
+}
+
+/**
+ * mqtt_lasterror
+ *
+ * Returns last error as JSON string
+ * mqtt_lasterror({handle})
+ *
+ */
+bool mqtt_lasterror_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if ( args->arg_count > 1
+        // handle or name
+        || (args->arg_count == 1 && args->arg_type[0]!=INT_RESULT && args->arg_type[0]!=STRING_RESULT) ) {
+        parmerror("mqtt_lasterror()", args);
+        strcpy(message, "function argument(s) error");
+        return 1;
+    }
+    initid->ptr = malloc(MAX_RET_STRLEN+1);
+    if (initid->ptr == NULL) {
+        strcpy(message, "memory allocation error");
+        return 1;
+    }
+
+    return 0;
+}
+
+void mqtt_lasterror_deinit(UDF_INIT *initid)
+{
+    if (initid->ptr != NULL) {
+        free(initid->ptr);
+    }
+}
+
+char* mqtt_lasterror(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error)
+{
+    char *res = (char *)initid->ptr;
+
+    TRACE(TRACE_DEBUG, "mqtt_lasterror()");
+
+    *is_null = 0;
+    *error = 0;
+    if (res == NULL) {
+        strcpy(result, "memory allocation error");
+        *length = strlen(result);
+        *error = 1;
+        return result;
+    }
+    if (args->arg_count == 1) {
+        session *sess = session_arg(args, 0);
+        const char *func = "mqtt_lasterror";
+        int rc = MQTTCLIENT_NULL_PARAMETER;
+
+        if (sess != NULL) {
+            pthread_mutex_lock(&sess->mutex);
+            func = sess->last_func;
+            rc = sess->last_rc;
+            pthread_mutex_unlock(&sess->mutex);
+            session_put(sess);
+        }
+        snprintf(res, MAX_RET_STRLEN, "{\"func\":\"%s\",\"rc\":%d, \"desc\": \"%s\"}", func, rc, MQTTClient_strerror(rc));
+    }
+    else {
+        snprintf(res, MAX_RET_STRLEN, "{\"func\":\"%s\",\"rc\":%d, \"desc\": \"%s\"}", last_func, last_rc, MQTTClient_strerror(last_rc));
+    }
+    *length = strlen(res);
+    TRACE(TRACE_DEBUG, "mqtt_lasterror(): %s", res);
+    return res;
+}
+
+
+/* Append histogram h as JSON object to sb */
+bool hist_json(strbuf *sb, histogram *h)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    static const char *names[] = {"p50", "p90", "p99", "p999"};
+    unsigned long counts[HIST_BUCKETS], total = 0, sum = 0, max = atomic_load(&h->max);
+    unsigned int idx = 0;
+    char buf[64];
+    bool ok;
+
+    // snapshot, the buckets are updated concurrently
+    for (int i=0; i<HIST_BUCKETS; i++) {
+        total += counts[i] = atomic_load(&h->buckets[i]);
+    }
+    ok = strbuf_append(sb, buf, snprintf(buf, sizeof(buf), "{\"count\":%lu,\"mean\":%lu", total,
+                                         total ? atomic_load(&h->sum) / atomic_load(&h->count) : 0));
+    for (int q=0; q<4 && ok; q++) {
+        unsigned long rank = (unsigned long)(quantiles[q] * total + 0.999999);
+        uint64_t value;
+
+        for (; idx < HIST_BUCKETS - 1 && sum + counts[idx] < rank; idx++) {
+            sum += counts[idx];
+        }
+        value = total ? hist_value(idx) : 0;
+        ok = strbuf_append(sb, buf, snprintf(buf, sizeof(buf), ",\"%s\":%lu", names[q], (unsigned long)(value < max ? value : max)));
+    }
+    return ok && strbuf_append(sb, buf, snprintf(buf, sizeof(buf), ",\"max\":%lu}", max));
+}
+
+/* Write st as JSON object into sb, returns false on memory allocation error */
+bool stats_json(strbuf *sb, client_stats *st)
+{
+    static const char *latencies[] = {"connect", "publish", "wait"};
+    char buf[256];
+    bool ok, first = true;
+
+    sb->len = 0;
+    ok = strbuf_append(sb, buf, snprintf(buf, sizeof(buf),
+                       "{\"published\":%lu,\"publishedBytes\":%lu,\"received\":%lu,\"receivedBytes\":%lu,\"errors\":%lu,\"errorsByRc\":{",
+                       atomic_load(&st->counters[STAT_PUBLISHED]), atomic_load(&st->counters[STAT_PUBLISHED_BYTES]),
+                       atomic_load(&st->counters[STAT_RECEIVED]), atomic_load(&st->counters[STAT_RECEIVED_BYTES]),
+                       atomic_load(&st->counters[STAT_ERRORS])));
+    for (int i=1; i<=STATS_RC_MAX && ok; i++) {
+        // errors[0] (other rc) last
+        unsigned long n = atomic_load(&st->errors[i % STATS_RC_MAX]);
+        if (n) {
+            ok = i < STATS_RC_MAX
+                ? strbuf_append(sb, buf, snprintf(buf, sizeof(buf), "%s\"%d\":%lu", first ? "" : ",", -i, n))
+                : strbuf_append(sb, buf, snprintf(buf, sizeof(buf), "%s\"other\":%lu", first ? "" : ",", n));
+            first = false;
+        }
+    }
+    ok = ok && strbuf_append(sb, "},\"latency\":{", 13);
+    for (int t=0; t<HIST_TYPES && ok; t++) {
+        ok = strbuf_append(sb, buf, snprintf(buf, sizeof(buf), "%s\"%s\":", t ? "," : "", latencies[t]))
+            && hist_json(sb, &st->latency[t]);
+    }
+    return ok && strbuf_append(sb, "}}", 2);
+}
+
+/**
+ * mqtt_stats
+ *
+ * Returns statistics as JSON string
+ * mqtt_stats({handle})
+ */
+bool mqtt_stats_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if ( args->arg_count > 1
+        // handle or name
+        || (args->arg_count == 1 && args->arg_type[0]!=INT_RESULT && args->arg_type[0]!=STRING_RESULT) ) {
+        parmerror("mqtt_stats()", args);
+        strcpy(message, "function argument(s) error");
+        return 1;
+    }
+    initid->ptr = calloc(1, sizeof(strbuf));
+    if (initid->ptr == NULL) {
+        strcpy(message, "memory allocation error");
+        return 1;
+    }
+    initid->max_length = MAX_RET_STRLEN;
+    initid->maybe_null = 1;
+    return 0;
+}
+
+void mqtt_stats_deinit(UDF_INIT *initid)
+{
+    if (initid->ptr != NULL) {
+        free(((strbuf *)initid->ptr)->buf);
+        free(initid->ptr);
+    }
+}
+
+char* mqtt_stats(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error)
+{
+    strbuf *sb = (strbuf *)initid->ptr;
+    session *sess = NULL;
+    bool ok;
+
+    *is_null = 0;
+    *error = 0;
+    if (args->arg_count == 1) {
+        sess = session_arg(args, 0);
+        if (sess == NULL) {
+            *is_null = 1;
+            *error = 1;
+            return NULL;
+        }
+    }
+    ok = stats_json(sb, sess != NULL ? &sess->stats : &stats_global);
+    if (sess != NULL) {
+        session_put(sess);
+    }
+    if (!ok) {
+        *is_null = 1;
+        *error = 1;
+        return NULL;
+    }
+    *length = sb->len;
+    return sb->buf;
+}
+
+
+/* Order live sessions by handle */
+int live_compare(const void *a, const void *b)
+{
+    longlong ha = ((const live_session *)a)->handle;
+    longlong hb = ((const live_session *)b)->handle;
+    return ha < hb ? -1 : ha > hb;
+}
+
+/* Drop the references of live_collect() */
+void live_release(live_session *live, int count)
+{
+    for (int i=0; i<count; i++) {
+        session_put(live[i].sess);
+    }
+    free(live);
+}
+
+/*
+ * Collect all registered sessions with an additional reference ordered by
+ * handle into *live. Returns the count or -1 on memory allocation error.
+ */
+int live_collect(live_session **live)
+{
+    live_session *list = NULL;
+    int count = 0, size = 0;
+
+    for (int shardno=0; shardno<REGISTRY_SHARDS; shardno++) {
+        registry_shard *shard = &registry[shardno];
+
+        pthread_mutex_lock(&shard->mutex);
+        for (int index=0; index < shard->nslabs * REGISTRY_SLAB_SIZE; index++) {
+            registry_slot *slot = &shard->slabs[index / REGISTRY_SLAB_SIZE][index % REGISTRY_SLAB_SIZE];
+
+            if (slot->sess == NULL) {
+                continue;
+            }
+            if (count == size) {
+                live_session *grown = realloc(list, (size ? size * 2 : 64) * sizeof(live_session));
+                if (grown == NULL) {
+                    pthread_mutex_unlock(&shard->mutex);
+                    live_release(list, count);
+                    return -1;
+                }
+                list = grown;
+                size = size ? size * 2 : 64;
+            }
+            list[count].handle = HANDLE_MAKE(slot->gen, shardno, index);
+            list[count].sess = slot->sess;
+            list[count].named = NULL;
+            atomic_fetch_add(&slot->sess->refs, 1);
+            count++;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    if (count > 1) {
+        qsort(list, count, sizeof(live_session), live_compare);
+    }
+    *live = list;
+    return count;
+}
+
+/* Append sess as JSON object of mqtt_connections() to sb, handle 0 is written as null */
+bool session_json(strbuf *sb, const char *type, longlong handle, const named_entry *named, session *sess)
+{
+    const char *func;
+    int rc, inflight, recv_count, buffered, subs = 0;
+    unsigned long reconnects, recv_dropped;
+    bool connected;
+    char buf[512];
+
+    pthread_mutex_lock(&sess->mutex);
+    func = sess->last_func;
+    rc = sess->last_rc;
+    inflight = sess->inflight;
+    recv_count = sess->recv_count;
+    recv_dropped = sess->recv_dropped;
+    buffered = sess->offline_count;
+    reconnects = sess->reconnects;
+    for (subscription *sub = sess->subs; sub != NULL; sub = sub->next) {
+        subs++;
+    }
+    pthread_mutex_unlock(&sess->mutex);
+    connected = sess->client != NULL && MQTTClient_isConnected(sess->client);
+
+    return strbuf_append(sb, buf, handle
+                         ? snprintf(buf, sizeof(buf), "{\"type\":\"%s\",\"handle\":%lld,\"name\":", type, handle)
+                         : snprintf(buf, sizeof(buf), "{\"type\":\"%s\",\"handle\":null,\"name\":", type))
+        && (named != NULL ? strbuf_append_json(sb, named->name, named->name_len) : strbuf_append(sb, "null", 4))
+        && strbuf_append(sb, ",\"server\":", 10)
+        && strbuf_append_json_str(sb, sess->server)
+        && strbuf_append(sb, ",\"clientId\":", 12)
+        && strbuf_append_json_str(sb, sess->client_id)
+        && strbuf_append(sb, buf, snprintf(buf, sizeof(buf),
+                         ",\"state\":\"%s\",\"async\":%s,\"inflight\":%d,\"receiveQueue\":%d,\"dropped\":%lu,\"subscriptions\":%d"
+                         ",\"buffered\":%d,\"reconnects\":%lu"
+                         ",\"bytesOut\":%lu,\"bytesIn\":%lu,\"published\":%lu,\"received\":%lu,\"errors\":%lu"
+                         ",\"lastFunc\":\"%s\",\"lastRc\":%d,\"created\":%lld,\"lastUsed\":%lld}",
+                         connected ? "connected" : atomic_load(&sess->offline) ? "reconnecting" : "disconnected",
+                         sess->async ? "true" : "false", inflight, recv_count, recv_dropped, subs, buffered, reconnects,
+                         atomic_load(&sess->stats.counters[STAT_PUBLISHED_BYTES]), atomic_load(&sess->stats.counters[STAT_RECEIVED_BYTES]),
+                         atomic_load(&sess->stats.counters[STAT_PUBLISHED]), atomic_load(&sess->stats.counters[STAT_RECEIVED]),
+                         atomic_load(&sess->stats.counters[STAT_ERRORS]),
+                         func, rc, (long long)sess->created, (long long)atomic_load(&sess->last_used)));
+}
+
+/* Append the idle pooled connections as JSON objects of mqtt_connections() to sb */
+bool pool_json(strbuf *sb, bool first)
+{
+    char buf[128];
+    bool ok = true;
+
+    pthread_mutex_lock(&pool_mutex);
+    for (pool_entry *entry = pool_idle; entry != NULL && ok; entry = entry->next) {
+        // the key starts with the server argument, see pool_key()
+        ok = strbuf_append(sb, buf, snprintf(buf, sizeof(buf), "%s{\"type\":\"pool\",\"server\":", first ? "" : ","))
+            && (entry->key_len > 1 && entry->key[0] ? strbuf_append_json_str(sb, entry->key + 1) : strbuf_append(sb, "null", 4))
+            && strbuf_append(sb, buf, snprintf(buf, sizeof(buf), ",\"state\":\"%s\",\"lastUsed\":%lld}",
+                                               MQTTClient_isConnected(entry->client) ? "connected" : "disconnected",
+                                               (long long)entry->last_used));
+        first = false;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return ok;
+}
+
+/**
+ * mqtt_connections
+ *
+ * Returns all live connections as JSON array
+ * mqtt_connections()
+ */
+bool mqtt_connections_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (args->arg_count != 0) {
+        parmerror("mqtt_connections()", args);
+        strcpy(message, "function argument(s) error");
+        return 1;
+    }
+    initid->ptr = calloc(1, sizeof(strbuf));
+    if (initid->ptr == NULL) {
+        strcpy(message, "memory allocation error");
+        return 1;
+    }
+    initid->max_length = RECEIVE_MAX_LENGTH;
+    initid->maybe_null = 1;
+    return 0;
+}
+
+void mqtt_connections_deinit(UDF_INIT *initid)
+{
+    if (initid->ptr != NULL) {
+        free(((strbuf *)initid->ptr)->buf);
+        free(initid->ptr);
+    }
+}
+
+char* mqtt_connections(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error)
+{
+    strbuf *sb = (strbuf *)initid->ptr;
+    live_session *live = NULL;
+    session *qsess = NULL;
+    int count;
+    bool ok, first = true;
+
+    TRACE(TRACE_DEBUG, "mqtt_connections()");
+
+    *is_null = 0;
+    *error = 0;
+    sb->len = 0;
+    count = live_collect(&live);
+    ok = count >= 0 && strbuf_append(sb, "[", 1);
+    if (ok && count > 0) {
+        pthread_rwlock_rdlock(&named_lock);
+        for (int i=0; i<NAMED_BUCKETS; i++) {
+            for (named_entry *entry = named[i]; entry != NULL; entry = entry->next) {
+                live_session key = {.handle = entry->handle};
+                live_session *found = bsearch(&key, live, count, sizeof(live_session), live_compare);
+                if (found != NULL) {
+                    found->named = entry;
+                }
+            }
+        }
+        for (int i=0; i<count && ok; i++) {
+            ok = (first || strbuf_append(sb, ",", 1))
+                && session_json(sb, "handle", live[i].handle, live[i].named, live[i].sess);
+            first = false;
+        }
+        pthread_rwlock_unlock(&named_lock);
+    }
+    if (count >= 0) {
+        live_release(live, count);
+    }
+
+    // the background publisher session is not registered
+    pthread_mutex_lock(&queue_mutex);
+    if (QUEUE_RUNNING == atomic_load(&queue.state) && queue.sess != NULL) {
+        qsess = queue.sess;
+        atomic_fetch_add(&qsess->refs, 1);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    if (qsess != NULL) {
+        ok = ok && (first || strbuf_append(sb, ",", 1)) && session_json(sb, "queue", 0, NULL, qsess);
+        first = false;
+        session_put(qsess);
+    }
+
+    ok = ok && pool_json(sb, first) && strbuf_append(sb, "]", 1);
+    if (!ok) {
+        TRACE(TRACE_ERROR, "mqtt_connections(): memory allocation error");
+        *is_null = 1;
+        *error = 1;
+        return NULL;
+    }
+    TRACE(TRACE_DEBUG, "mqtt_connections(): %d handles", count);
+    *length = sb->len;
+    return sb->buf;
+}
+
+
+/**
+ * mqtt_trace
+ *
+ * Returns the trace level and sets a new one
+ * mqtt_trace({level})
+ */
+bool mqtt_trace_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if ( args->arg_count > 1
+        // level number or name
+        || (args->arg_count == 1 && args->arg_type[0]!=INT_RESULT && args->arg_type[0]!=STRING_RESULT) ) {
+        parmerror("mqtt_trace()", args);
+        strcpy(message, "function argument(s) error");
+        return 1;
+    }
+    initid->maybe_null = 1;
+    return 0;
+}
+
+void mqtt_trace_deinit(UDF_INIT *initid)
+{
+}
+
+ulonglong mqtt_trace(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+{
+    static const char *names[] = {"off", "error", "info", "debug"};
+    int level = -1;
+
+    *is_null = 0;
+    *error = 0;
+    if (args->arg_count == 0 || args->args[0] == NULL) {
+        return atomic_load(&trace_level);
+    }
+    if (args->arg_type[0] == INT_RESULT) {
+        longlong value = *(longlong *)args->args[0];
+        level = value >= TRACE_OFF && value <= TRACE_DEBUG ? (int)value : -1;
+    }
+    else {
+        for (int i=TRACE_OFF; i<=TRACE_DEBUG; i++) {
+            if (args->lengths[0] == strlen(names[i]) && 0 == strncasecmp(args->args[0], names[i], args->lengths[0])) {
+                level = i;
+            }
+        }
+    }
+    if (level < 0) {
+        *is_null = 1;
+        return 0;
+    }
+    return atomic_exchange(&trace_level, level);
+}
+
+
+/* Order trace records by time */
+int trace_compare(const void *a, const void *b)
+{
+    uint64_t ta = ((const trace_record *)a)->time;
+    uint64_t tb = ((const trace_record *)b)->time;
+    return ta < tb ? -1 : ta > tb;
+}
+
+/*
+ * Copy the complete records newer than since of all rings ordered by time
+ * into *recs. Returns the count or -1 on memory allocation error.
+ */
+int trace_collect(trace_record **recs, uint64_t since)
+{
+    trace_record *list;
+    int nrings = 0, count = 0;
+
+    for (trace_ring *ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next) {
+        nrings++;
+    }
+    *recs = NULL;
+    if (nrings == 0) {
+        return 0;
+    }
+    if ((list = malloc(nrings * TRACE_RING_SIZE * sizeof(trace_record))) == NULL) {
+        return -1;
+    }
+    // rings added meanwhile are at the head, the first nrings ones are visited
+    for (trace_ring *ring = atomic_load(&trace_rings); ring != NULL && count + TRACE_RING_SIZE <= nrings * TRACE_RING_SIZE; ring = ring->next) {
+        for (int i=0; i<TRACE_RING_SIZE; i++) {
+            trace_record *rec = &ring->records[i], *copy = &list[count];
+            unsigned long seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+
+            if (seq == 0 || (seq & 1)) {
+                continue;
+            }
+            copy->time = rec->time;
+            copy->tid = rec->tid;
+            copy->level = rec->level;
+            memcpy(copy->msg, rec->msg, TRACE_MSG_LEN);
+            atomic_thread_fence(memory_order_acquire);
+            if (seq != atomic_load_explicit(&rec->seq, memory_order_relaxed) || copy->time <= since) {
+                // overwritten by its thread while copied or already dumped
+                continue;
+            }
+            copy->msg[TRACE_MSG_LEN - 1] = '\0';
+            count++;
+        }
+    }
+    if (count > 1) {
+        qsort(list, count, sizeof(trace_record), trace_compare);
+    }
+    *recs = list;
+    return count;
+}
+
+/**
+ * mqtt_trace_dump
+ *
+ * Returns the recorded trace as JSON array
+ * mqtt_trace_dump({clear})
+ */
+bool mqtt_trace_dump_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (args->arg_count > 1 || (args->arg_count == 1 && args->arg_type[0] != INT_RESULT)) {
+        parmerror("mqtt_trace_dump()", args);
+        strcpy(message, "function argument(s) error");
+        return 1;
+    }
+    initid->ptr = calloc(1, sizeof(strbuf));
+    if (initid->ptr == NULL) {
+        strcpy(message, "memory allocation error");
+        return 1;
+    }
+    initid->max_length = RECEIVE_MAX_LENGTH;
+    initid->maybe_null = 1;
+    return 0;
+}
+
+void mqtt_trace_dump_deinit(UDF_INIT *initid)
+{
+    if (initid->ptr != NULL) {
+        free(((strbuf *)initid->ptr)->buf);
+        free(initid->ptr);
+    }
+}
+
+char* mqtt_trace_dump(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error)
+{
+    static const char *names[] = {"off", "error", "info", "debug"};
+    strbuf *sb = (strbuf *)initid->ptr;
+    trace_record *recs;
+    int count;
+    bool ok;
+    char buf[128];
+
+    *is_null = 0;
+    *error = 0;
+    sb->len = 0;
+    count = trace_collect(&recs, atomic_load(&trace_cleared));
+    ok = count >= 0 && strbuf_append(sb, "[", 1);
+    for (int i=0; i<count && ok; i++) {
+        ok = strbuf_append(sb, buf, snprintf(buf, sizeof(buf), "%s{\"time\":%llu,\"thread\":%d,\"level\":\"%s\",\"msg\":",
+                                             i ? "," : "", (unsigned long long)recs[i].time, recs[i].tid,
+                                             names[recs[i].level >= TRACE_OFF && recs[i].level <= TRACE_DEBUG ? recs[i].level : TRACE_OFF]))
+            && strbuf_append_json(sb, recs[i].msg, strlen(recs[i].msg))
+            && strbuf_append(sb, "}", 1);
+    }
+    ok = ok && strbuf_append(sb, "]", 1);
+    if (ok && count > 0 && args->arg_count == 1 && args->args[0] != NULL && *(longlong *)args->args[0] != 0) {
+        // records written during the dump but older than the last one returned may be skipped
+        atomic_store(&trace_cleared, recs[count - 1].time);
+    }
+    free(recs);
+    if (!ok) {
+        *is_null = 1;
+        *error = 1;
+        return NULL;
+    }
+    *length = sb->len;
+    return sb->buf;
+}
+
+
+/*
+ * Create, connect and register a new session for mqtt_connect() and
+ * mqtt_open(). Returns the handle or 0 with the error in last_rc.
+ */
+longlong session_connect(connection *conn, UDF_ARGS *args, const char *address, const char *username, const char *password)
+{
+    mqtt_options rowopts;
+    const mqtt_options *opts;
+    session *sess;
+    longlong handle;
+    int alias_max, rc;
+
+    sess = session_create();
+    if (sess == NULL) {
+        last_func = "session_connect";
+        last_rc = MQTTCLIENT_FAILURE;
+        return 0;
+    }
+
+    TRACE(TRACE_INFO, "session_connect(): MQTTClient_create \"%s\"", address);
+    opts = row_options(conn, args, &rowopts);
+    if (opts->shareGroup != NULL) {
+        // an invalid group would silently turn into a plain (duplicating) subscription
+        sess->share_group = share_group_valid(opts->shareGroup) ? strdup(opts->shareGroup) : NULL;
+        if (sess->share_group == NULL) {
+            last_func = "session_connect";
+            last_rc = MQTTCLIENT_BAD_STRUCTURE;
+            free_options(&rowopts);
+            session_put(sess);
+            return 0;
+        }
+    }
+    last_func = "MQTTClient_create";
+    rc = last_rc = client_create(&sess->client, address, opts, sess);
+    sess->server = strdup(address);
+    sess->created = time(NULL);
+    atomic_store(&sess->last_used, sess->created);
+    if (rc != MQTTCLIENT_SUCCESS) {
+        TRACE(TRACE_INFO, "session_connect() rc=%d", rc);
+        sess->client = NULL;
+        free_options(&rowopts);
+        session_put(sess);
+        return 0;
+    }
+
+    create_conn(conn, username, password, opts);
+    session_mqtt5(sess, opts);
+    if (opts->async > 0) {
+        sess->async = true;
+        if (opts->maxInflightMessages > 0) {
+            sess->max_inflight = opts->maxInflightMessages;
+        }
+    }
+    if (opts->receiveQueue > 0) {
+        sess->recv_max = opts->receiveQueue;
+    }
+    if (opts->maxPayload > 0) {
+        sess->max_payload = opts->maxPayload;
+    }
+    compression_init(&sess->compress, opts);
+    if (sess->compress.dict != NULL) {
+        // options are released below
+        sess->compress_dict = strdup(sess->compress.dict);
+        sess->compress.dict = sess->compress_dict;
+        sess->compress.dict_len = sess->compress_dict != NULL ? sess->compress.dict_len : 0;
+    }
+    if (sess->async || sess->recv_max > 0) {
+        last_func = "MQTTClient_setCallbacks";
+        rc = last_rc = MQTTClient_setCallbacks(sess->client, sess, session_connection_lost, session_message_arrived, session_delivery_complete);
+    }
+    if (rc == MQTTCLIENT_SUCCESS && opts->reconnect > 0) {
+        sess->reconnect = true;
+        sess->reconnect_delay = opts->reconnectDelay > 0 ? opts->reconnectDelay : RECONNECT_DEFAULT_DELAY;
+        sess->reconnect_max_delay = opts->reconnectMaxDelay != OPTION_UNSET ? opts->reconnectMaxDelay : RECONNECT_DEFAULT_MAX_DELAY;
+        if (sess->reconnect_max_delay < sess->reconnect_delay) {
+            sess->reconnect_max_delay = sess->reconnect_delay;
+        }
+        sess->offline_max = opts->offlineBuffer != OPTION_UNSET ? (opts->offlineBuffer > 0 ? opts->offlineBuffer : 0) : OFFLINE_DEFAULT_BUFFER;
+        last_func = "session_connect";
+        sess->connect = connect_keep(&conn->conn_opts);
+        rc = last_rc = sess->connect != NULL ? reconnect_start() : MQTTCLIENT_FAILURE;
+    }
+
+    TRACE(TRACE_DEBUG, "session_connect(): client %p", sess->client);
+    if (rc == MQTTCLIENT_SUCCESS) {
+        last_func = "MQTTClient_connect";
+        rc = last_rc = client_connect(sess->client, &conn->conn_opts, &alias_max, &sess->stats);
+    }
+    free_options(&rowopts);
+    if (rc != MQTTCLIENT_SUCCESS) {
+        TRACE(TRACE_INFO, "session_connect() rc=%d", rc);
+        session_put(sess);
+        return 0;
+    }
+    session_connected(sess, alias_max);
+    session_lasterror(sess);
+    handle = registry_add(sess);
+    if (handle == 0) {
+        last_func = "registry_add";
+        last_rc = MQTTCLIENT_FAILURE;
+        MQTTClient_disconnect(sess->client, 0);
+        session_put(sess);
+    }
+    return handle;
+}
+
+/*
+ * Reconnect the client of sess if the connection was lost and renew its
+ * subscriptions, returns rc
+ */
+int session_reconnect(connection *conn, UDF_ARGS *args, session *sess, const char *username, const char *password)
+{
+    mqtt_options rowopts;
+    int alias_max, rc = last_rc = MQTTCLIENT_SUCCESS;
+
+    last_func = "session_reconnect";
+    if (sess->reconnect) {
+        // reconnected in the background, meanwhile messages are buffered
+        if (!MQTTClient_isConnected(sess->client)) {
+            session_lost(sess);
+        }
+    }
+    else if (!MQTTClient_isConnected(sess->client)) {
+        TRACE(TRACE_DEBUG, "session_reconnect(): client %p", sess->client);
+        create_conn(conn, username, password, row_options(conn, args, &rowopts));
+        session_disconnected(sess);
+        last_func = "MQTTClient_connect";
+        rc = last_rc = client_connect(sess->client, &conn->conn_opts, &alias_max, &sess->stats);
+        free_options(&rowopts);
+        if (rc == MQTTCLIENT_SUCCESS) {
+            session_connected(sess, alias_max);
+            rc = session_resubscribe(sess);
+        }
+    }
+    session_lasterror(sess);
+    return rc;
+}
+
+
+/**
+ * mqtt_connect
+ *
+ * Connect to a mqtt server and returns a handle.
+ * mqtt_connect(server {,username} {,password {,options}}})
+ *      returns connect handle or 0 on error
+ */
+bool mqtt_connect_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    initid->ptr = NULL;
+    if (   // server
+        (args->arg_count == 1 && args->arg_type[0]==STRING_RESULT && args->args[0]!=NULL)
+        || // server, username
+        (args->arg_count == 2 && args->arg_type[0]==STRING_RESULT && args->args[0]!=NULL
+                              && args->arg_type[1]==STRING_RESULT)
+        || // server, username, password
+        (args->arg_count == 3 && args->arg_type[0]==STRING_RESULT && args->args[0]!=NULL
+                              && args->arg_type[1]==STRING_RESULT
+                              && args->arg_type[2]==STRING_RESULT)
+        || // server, username, password, options
+        (args->arg_count == 4 && args->arg_type[0]==STRING_RESULT && args->args[0]!=NULL
+                              && args->arg_type[1]==STRING_RESULT
+                              && args->arg_type[2]==STRING_RESULT
+                              && args->arg_type[3]==STRING_RESULT)
+       ) {
+        connection *conn = malloc(sizeof(connection));
+        if (conn == NULL) {
+            parmerror("mqtt_connect()", args);
+            strcpy(message, "memory allocation error");
+            return 1;
+        }
+        conn->poolkey = NULL;
+        conn->poolkey_size = conn->poolkey_len = 0;
+        conn->connected = NULL;
+        initid->ptr = (char *)conn;
+        return init_options(initid, args, args->arg_count >= 4 ? 3 : -1, message);
+    }
+    else {
+        parmerror("mqtt_connect()", args);
+        strcpy(message, "function argument(s) error");
+        return 1;
+    }
+}
+
+void mqtt_connect_deinit(UDF_INIT *initid)
+{
+    connection *conn = (connection *)initid->ptr;
+    connect_entry *entry;
+
+    if (conn != NULL) {
+        // The handles belong to the caller, only forget about them
+        while ((entry = conn->connected) != NULL) {
+            conn->connected = entry->next;
+            free(entry);
+        }
+        free_options(&conn->options);
+        free(conn->poolkey);
+        free(conn);
+    }
+}
+
+/*
+ * Find the handle a previous row of the statement returned for identical
+ * arguments, see pool_key(). Returns NULL if there is none.
+ */
+connect_entry *connect_lookup(connection *conn)
+{
+    for (connect_entry *entry = conn->connected; entry != NULL; entry = entry->next) {
+        if (entry->hash == conn->poolhash
+            && entry->key_len == conn->poolkey_len
+            && 0 == memcmp(entry->key, conn->poolkey, conn->poolkey_len)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Remember handle for the arguments in conn->poolkey */
+void connect_remember(connection *conn, connect_entry *entry, longlong handle)
+{
+    if (entry == NULL) {
+        entry = malloc(sizeof(connect_entry) + conn->poolkey_len);
+        if (entry == NULL) {
+            return;
+        }
+        entry->hash = conn->poolhash;
+        entry->key_len = conn->poolkey_len;
+        memcpy(entry->key, conn->poolkey, conn->poolkey_len);
+        entry->next = conn->connected;
+        conn->connected = entry;
+    }
+    entry->handle = handle;
+}
+
+ulonglong mqtt_connect(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+{
+    connection *conn = (connection *)initid->ptr;
+
+
+    *is_null = 0;
+    *error = 0;
+
+    char *address  = "";
+    char *username = "";
+    char *password = "";
+    session *sess;
+    longlong handle;
+    connect_entry *entry = NULL;
+    bool keyed;
+    int rc;
+
+    // Do not assume that the string is null-terminated
+    // see https://dev.mysql.com/doc/refman/5.7/en/udf-arguments.html
+    if (args->arg_count >= 1 && args->args[0]!=NULL) {
+        address   = (char *)args->args[0];
+        address[args->lengths[0]]  = '\0';
+    }
+    if (args->arg_count >= 2 && args->args[1]!=NULL) {
+        username  = (char *)args->args[1];
+        username[args->lengths[1]] = '\0';
+    }
+    if (args->arg_count >= 3 && args->args[2]!=NULL) {
+        password  = (char *)args->args[2];
+        password[args->lengths[2]] = '\0';
+    }
+
+    // Identical arguments of a previous row: return the same handle
+    keyed = pool_key(conn, args, 4, 0,
+                     args->arg_count >= 2 ? 1 : -1,
+                     args->arg_count >= 3 ? 2 : -1,
+                     conn->options_arg);
+    if (keyed && (entry = connect_lookup(conn)) != NULL
+        && (sess = session_get(entry->handle)) != NULL) {
+        rc = session_reconnect(conn, args, sess, username, password);
+        session_put(sess);
+        TRACE(TRACE_INFO, "mqtt_connect(): reuse handle %lld, rc=%d", entry->handle, rc);
+        if (rc != MQTTCLIENT_SUCCESS) {
+            *is_null = 1;
+            *error = 1;
+            return rc;
+        }
+        return entry->handle;
+    }
+
+    handle = session_connect(conn, args, address, username, password);
+    if (handle == 0) {
+        *is_null = 1;
+        *error = 1;
+        return last_rc;
+    }
+    if (keyed) {
+        // entry is set if the handle of a previous row was already disconnected
+        connect_remember(conn, entry, handle);
+    }
+    return handle;
+}
+
+
+
+
+
+/**
+ * mqtt_disconnect
+ *
+ * Disconnect from a mqtt server.
+ * mqtt_disconnect(handle(, timeout))
+ *  returns 0 if successful
+ */
+bool mqtt_disconnect_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if ( args->arg_count == 1
+        // handle
+         && args->arg_type[0]==INT_RESULT
+         ) {
+        return 0;
+    }
+    else {
+        parmerror("mqtt_disconnect()", args);
+        strcpy(message, "function argument(s) error");
+        return 1;
+    }
+}
+
+void mqtt_disconnect_deinit(UDF_INIT *initid)
+{
+}
+
+ulonglong mqtt_disconnect(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+{
+    session *sess = session_arg(args, 0);
+
+    TRACE(TRACE_DEBUG, "mqtt_disconnect()");
+    last_func = "MQTTClient_disconnect";
+    if (sess == NULL) {
+        *error = 1;
+        return last_rc = MQTTCLIENT_NULL_PARAMETER;
+    }
+    if (sess->reconnect) {
+        session_close(sess);
+    }
+    int rc = last_rc = MQTTClient_disconnect(sess->client, DEFAULT_TIMEOUT);
+    if (rc != MQTTCLIENT_SUCCESS && sess->reconnect) {
+        // a reconnecting handle is released even if its connection is lost
+        rc = last_rc = MQTTCLIENT_SUCCESS;
+    }
+    if (rc == MQTTCLIENT_SUCCESS) {
+        // drop the reference of the registry, the session is destroyed
+        // as soon as no other thread uses it anymore
+        session_put(registry_remove(*(longlong*)args->args[0]));
+    }
+    else {
+        session_lasterror(sess);
+        *error = 1;
+    }
+    session_put(sess);
+    TRACE(TRACE_INFO, "mqtt_disconnect() rc=%d", rc);
+    return rc;
+}
+
+
+/**
+ * mqtt_open
+ *
+ * Open a named connection shared by all sessions and returns its handle.
+ * mqtt_open(name, server {,username} {,password {,options}}})
+ *      returns connect handle or 0 on error
+ */
+bool mqtt_open_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    initid->ptr = NULL;
+    if ( args->arg_count >= 2 && args->arg_count <= 5
+        // name
          && args->arg_type[0]==STRING_RESULT
-         && args->args[0]!=NULL
-        // username
+        // server
          && args->arg_type[1]==STRING_RESULT
+        // username
+         && (args->arg_count < 3 || args->arg_type[2]==STRING_RESULT)
         // password
-         && args->arg_type[2]==STRING_RESULT
+         && (args->arg_count < 4 || args->arg_type[3]==STRING_RESULT)
+        // options
+         && (args->arg_count < 5 || args->arg_type[4]==STRING_RESULT)
+       ) {
+        connection *conn = malloc(sizeof(connection));
+        if (conn == NULL) {
+            parmerror("mqtt_open()", args);
+            strcpy(message, "memory allocation error");
+            return 1;
+        }
+        conn->poolkey = NULL;
+        conn->connected = NULL;
+        initid->ptr = (char *)conn;
+        return init_options(initid, args, args->arg_count >= 5 ? 4 : -1, message);
+    }
+    else {
+        parmerror("mqtt_open()", args);
+        strcpy(message, "function argument(s) error");
+        return 1;
+    }
+}
+
+void mqtt_open_deinit(UDF_INIT *initid)
+{
+    if (initid->ptr != NULL) {
+        free_options(&((connection *)initid->ptr)->options);
+        free(initid->ptr);
+    }
+}
+
+ulonglong mqtt_open(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+{
+    connection *conn = (connection *)initid->ptr;
+    char *username = "";
+    char *password = "";
+    longlong handle, named;
+    session *sess;
+    int rc;
+
+
+    *is_null = 0;
+    *error = 0;
+
+    if (args->args[0]==NULL || args->args[1]==NULL) {
+        last_func = "mqtt_open";
+        last_rc = MQTTCLIENT_NULL_PARAMETER;
+        *is_null = 1;
+        *error = 1;
+        return 0;
+    }
+    // Do not assume that the string is null-terminated
+    // see https://dev.mysql.com/doc/refman/5.7/en/udf-arguments.html
+    args->args[1][args->lengths[1]] = '\0';
+    if (args->arg_count >= 3 && args->args[2]!=NULL) {
+        username  = (char *)args->args[2];
+        username[args->lengths[2]] = '\0';
+    }
+    if (args->arg_count >= 4 && args->args[3]!=NULL) {
+        password  = (char *)args->args[3];
+        password[args->lengths[3]] = '\0';
+    }
+
+    // Already open: reuse the connection, reconnect if it was lost
+    handle = named_handle(args->args[0], args->lengths[0]);
+    if ((sess = session_get(handle)) != NULL) {
+        rc = session_reconnect(conn, args, sess, username, password);
+        session_put(sess);
+        TRACE(TRACE_INFO, "mqtt_open(): reuse handle %lld, rc=%d", handle, rc);
+        if (rc != MQTTCLIENT_SUCCESS) {
+            *is_null = 1;
+            *error = 1;
+            return rc;
+        }
+        return handle;
+    }
+
+    handle = session_connect(conn, args, args->args[1], username, password);
+    if (handle == 0) {
+        *is_null = 1;
+        *error = 1;
+        return last_rc;
+    }
+    named = named_add(args->args[0], args->lengths[0], handle);
+    if (named != handle) {
+        // opened concurrently by another session or out of memory
+        if ((sess = registry_remove(handle)) != NULL) {
+            MQTTClient_disconnect(sess->client, 0);
+            session_put(sess);
+        }
+        if (named == 0) {
+            last_func = "mqtt_open";
+            last_rc = MQTTCLIENT_FAILURE;
+            *is_null = 1;
+            *error = 1;
+        }
+    }
+    TRACE(TRACE_INFO, "mqtt_open(): handle %lld", named);
+    return named;
+}
+
+
+/**
+ * mqtt_close
+ *
+ * Close a named connection opened by mqtt_open().
+ * mqtt_close(name)
+ *  returns 0 if successful
+ */
+bool mqtt_close_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if ( args->arg_count == 1
+        // name
+         && args->arg_type[0]==STRING_RESULT
+         ) {
+        return 0;
+    }
+    else {
+        parmerror("mqtt_close()", args);
+        strcpy(message, "function argument(s) error");
+        return 1;
+    }
+}
+
+void mqtt_close_deinit(UDF_INIT *initid)
+{
+}
+
+ulonglong mqtt_close(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+{
+    session *sess = NULL;
+
+    TRACE(TRACE_DEBUG, "mqtt_close()");
+    last_func = "MQTTClient_disconnect";
+    if (args->args[0] != NULL) {
+        sess = registry_remove(named_remove(args->args[0], args->lengths[0]));
+    }
+    if (sess == NULL) {
+        *error = 1;
+        return last_rc = MQTTCLIENT_NULL_PARAMETER;
+    }
+    // Other sessions may still publish using it, session_put() destroys
+    // the client after the last one
+    int rc = last_rc = MQTTClient_disconnect(sess->client, DEFAULT_TIMEOUT);
+    session_put(sess);
+    TRACE(TRACE_INFO, "mqtt_close() rc=%d", rc);
+    return rc;
+}
+
+
+/**
+ * mqtt_async_status
+ *
+ * Returns delivery status of an async client handle as JSON string.
+ * mqtt_async_status(handle {,timeout})
+ */
+bool mqtt_async_status_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (   // handle
+        (args->arg_count == 1 && args->arg_type[0]==INT_RESULT)
+        || // handle, timeout
+        (args->arg_count == 2 && args->arg_type[0]==INT_RESULT
+                              && args->arg_type[1]==INT_RESULT)
+       ) {
+        initid->ptr = malloc(MAX_RET_STRLEN+1);
+        if (initid->ptr == NULL) {
+            strcpy(message, "memory allocation error");
+            return 1;
+        }
+        initid->max_length = MAX_RET_STRLEN;
+        initid->maybe_null = 1;
+        return 0;
+    }
+    else {
+        parmerror("mqtt_async_status()", args);
+        strcpy(message, "function argument(s) error");
+        return 1;
+    }
+}
+
+void mqtt_async_status_deinit(UDF_INIT *initid)
+{
+    if (initid->ptr != NULL) {
+        free(initid->ptr);
+    }
+}
+
+char* mqtt_async_status(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error)
+{
+    session *sess = session_arg(args, 0);
+    char *res = (char *)initid->ptr;
+
+    TRACE(TRACE_DEBUG, "mqtt_async_status()");
+
+    *is_null = 0;
+    *error = 0;
+    if (sess == NULL) {
+        *is_null = 1;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&sess->mutex);
+    // optional wait until all in-flight messages are confirmed
+    if (args->arg_count >= 2 && args->args[1]!=NULL && sess->inflight > 0) {
+        struct timespec ts;
+
+        deadline(&ts, (long)*((longlong*)args->args[1]));
+        while (sess->inflight > 0) {
+            if (ETIMEDOUT == pthread_cond_timedwait(&sess->cond, &sess->mutex, &ts)) {
+                break;
+            }
+        }
+    }
+    snprintf(res, MAX_RET_STRLEN, "{\"async\":%s,\"inflight\":%d,\"delivered\":%lu,\"failed\":%lu,\"rc\":%d,\"desc\":\"%s\"}",
+             sess->async ? "true" : "false", sess->inflight, sess->delivered, sess->failed, sess->rc, MQTTClient_strerror(sess->rc));
+    pthread_mutex_unlock(&sess->mutex);
+    session_put(sess);
+
+    *length = strlen(res);
+    TRACE(TRACE_DEBUG, "mqtt_async_status(): %s", res);
+    return res;
+}
+
+
+/**
+ * mqtt_publish
+ *
+ * Publish a mqtt payload and returns its status.
+ *
+ * Possible calls
+ * mqtt_publish(server, [username], [password], topic, [payload] {,[qos] {,[retained] {,[timeout] {,[options]}}}})
+ * mqtt_publish(client, topic, [payload] {,[qos] {,[retained] {,[timeout] {,[options]}}}})
+ */
+/*
+ * Check a topic name once for a constant topic argument: 1..65535 bytes of
+ * well-formed UTF-8 without NUL, surrogates and wildcards (MQTT 4.7, 1.5.3)
+ */
+bool topic_valid(const char *topic, unsigned long len)
+{
+    const unsigned char *p = (const unsigned char *)topic, *end = p + len;
+
+    if (len == 0 || len > 65535) {
+        return false;
+    }
+    while (p < end) {
+        unsigned int c;
+        size_t n = utf8_char(p, end, &c);
+
+        if (n == 0) {
+            return false;
+        }
+        p += n;
+        if (c == 0 || c == '+' || c == '#') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Compress the payload of the current row with c. A constant payload is
+ * compressed only once for the same key: the session serial for the handle
+ * form, 1 for the server form with constant options, 0 disables caching.
+ */
+void publish_deflate(connection *conn, const compression *c, unsigned long key, const char **payload, int *payloadlen)
+{
+    bool cached = conn->plan.arg[ARG_PAYLOAD].constant && key != 0;
+
+    if (!cached || key != conn->packed_key) {
+        conn->packed_deflated = payload_deflate(c, *payload, *payloadlen, &conn->packed);
+        conn->packed_key = cached ? key : 0;
+    }
+    if (conn->packed_deflated) {
+        *payload = conn->packed.buf;
+        *payloadlen = conn->packed.len;
+    }
+}
+
+const call_form publish_forms[] = {
+    // mqtt_publish(server, [username], [password], topic, [payload] {,[qos] {,[retained] {,[timeout] {,[options]}}}})
+    {5, 9, {ARG_SERVER, ARG_USERNAME, ARG_PASSWORD, ARG_TOPIC, ARG_PAYLOAD, ARG_QOS, ARG_RETAINED, ARG_TIMEOUT, ARG_OPTIONS}},
+    // mqtt_publish(client, topic, [payload] {,[qos] {,[retained] {,[timeout] {,[options]}}}})
+    {3, 7, {ARG_HANDLE, ARG_TOPIC, ARG_PAYLOAD, ARG_QOS, ARG_RETAINED, ARG_TIMEOUT, ARG_OPTIONS}},
+};
+
+bool mqtt_publish_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    connection *conn;
+    int options;
+
+    TRACE(TRACE_DEBUG, "mqtt_publish_init()");
+    initid->ptr = calloc(1, sizeof(connection));
+    if (initid->ptr == NULL) {
+        parmerror("mqtt_publish()", args);
+        strcpy(message, "memory allocation error");
+        return 1;
+    }
+    conn = (connection *)initid->ptr;
+    init_options(initid, args, -1, message);
+    last_func = "mqtt_publish_init";
+    conn->rc = last_rc = MQTTCLIENT_DISCONNECTED;
+
+    if (plan_compile(&conn->plan, publish_forms, 2, args, message)) {
+        parmerror("mqtt_publish()", args);
+        free(initid->ptr);
+        initid->ptr = NULL;
+        return 1;
+    }
+    if (conn->plan.arg[ARG_TOPIC].str != NULL) {
+        // constant topic: checked and hashed for the topic alias once
+        const char *topic = conn->plan.arg[ARG_TOPIC].str;
+        if (!topic_valid(topic, conn->plan.arg[ARG_TOPIC].len)) {
+            parmerror("mqtt_publish()", args);
+            strcpy(message, "invalid topic");
+            plan_free(&conn->plan);
+            free(initid->ptr);
+            initid->ptr = NULL;
+            return 1;
+        }
+        conn->topic.hash = 2166136261u;
+        for (const char *p = topic; *p; p++) {
+            conn->topic.hash = (conn->topic.hash ^ (unsigned char)*p) * 16777619u;
+        }
+    }
+    if ((options = conn->plan.arg[ARG_OPTIONS].index) >= 0) {
+        char *consts = conn->plan.consts;
+        if (init_options(initid, args, options, message)) {
+            // conn is released by init_options()
+            free(consts);
+            return 1;
+        }
+    }
+    return 0;
+}
+void mqtt_publish_deinit(UDF_INIT *initid)
+{
+    TRACE(TRACE_DEBUG, "mqtt_publish_deinit");
+    if (initid->ptr != NULL) {
+        free_options(&((connection *)initid->ptr)->options);
+        free(((connection *)initid->ptr)->poolkey);
+        free(((connection *)initid->ptr)->packed.buf);
+        plan_free(&((connection *)initid->ptr)->plan);
+        free(initid->ptr);
+    }
+}
+ulonglong mqtt_publish(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+{
+    connection *conn = (connection *)initid->ptr;
+    call_plan *plan = &conn->plan;
+    const char *address, *username, *password, *topic, *payload;
+    int qos, retained, timeout, keepalive = DEFAULT_KEEPALIVEINTERVAL, version = MQTTVERSION_DEFAULT, payloadlength;
+    bool pooled = false;
+    mqtt_options rowopts;
+    const mqtt_options *opts;
+    compression comp;
+    MQTTProperties props = MQTTProperties_initializer;
+    session *sess = NULL;
+
+
+    TRACE(TRACE_DEBUG, "mqtt_publish(): %s form", plan->server_form ? "server" : "handle");
+
+    *is_null = 0;
+    *error = 0;
+
+    if (!plan_bind(plan, args)) {
+        last_func = "mqtt_publish";
+        conn->rc = last_rc = MQTTCLIENT_FAILURE;
+        *error = 1;
+        return conn->rc;
+    }
+    qos         = (int)plan->arg[ARG_QOS].value;
+    retained    = (int)plan->arg[ARG_RETAINED].value;
+    timeout     = (int)plan->arg[ARG_TIMEOUT].value;
+    topic       = plan->arg[ARG_TOPIC].str;
+    payload     = plan->arg[ARG_PAYLOAD].str != NULL ? plan->arg[ARG_PAYLOAD].str : "";
+    payloadlength = (int)plan->arg[ARG_PAYLOAD].len;
+    address     = plan->arg[ARG_SERVER].str;
+    username    = plan->arg[ARG_USERNAME].str;
+    password    = plan->arg[ARG_PASSWORD].str;
+
+    if (!plan->server_form) {
+        sess        = session_arg(args, plan->arg[ARG_HANDLE].index);
+        conn->client= sess!=NULL ? sess->client : NULL;
+        last_func = "mqtt_publish";
+        conn->rc = last_rc = conn->client == NULL ? MQTTCLIENT_DISCONNECTED
+                           : topic == NULL ? MQTTCLIENT_NULL_PARAMETER : MQTTCLIENT_SUCCESS;
+        if (sess != NULL) {
+            publish_deflate(conn, &sess->compress, sess->serial, &payload, &payloadlength);
+        }
+    }
+    else if (address == NULL || topic == NULL) {
+        conn->client = NULL;
+        last_func = "mqtt_publish";
+        conn->rc = last_rc = MQTTCLIENT_NULL_PARAMETER;
+    }
+    else {
+        opts = row_options(conn, args, &rowopts);
+        keepalive = opts->keepAliveInterval != OPTION_UNSET ? opts->keepAliveInterval : DEFAULT_KEEPALIVEINTERVAL;
+        compression_init(&comp, opts);
+        publish_deflate(conn, &comp, opts == &conn->options ? 1 : 0, &payload, &payloadlength);
+        if (opts->MQTTVersion >= MQTTVERSION_5) {
+            version = MQTTVERSION_5;
+            properties_init(&props, opts);
+        }
+        conn->client = NULL;
+        pooled = opts->pool != 0 && pool_key(conn, args, 4, plan->arg[ARG_SERVER].index, plan->arg[ARG_USERNAME].index,
+                                             plan->arg[ARG_PASSWORD].index, conn->options_arg);
+        if (pooled && (conn->client = pool_acquire(conn)) != NULL) {
+            last_func = "mqtt_publish";
+            conn->rc = last_rc = MQTTCLIENT_SUCCESS;
+            TRACE(TRACE_DEBUG, "mqtt_publish(): pooled client %p", conn->client);
+        }
+        else {
+            last_func = "MQTTClient_create";
+            conn->rc = last_rc = client_create(&conn->client, address, opts, NULL);
+            if (conn->rc == MQTTCLIENT_SUCCESS) {
+                TRACE(TRACE_DEBUG, "mqtt_publish(): username=\"%s\"", username != NULL ? username : "");
+                create_conn(conn, username, password, opts);
+
+                last_func = "MQTTClient_connect";
+                conn->rc = last_rc = client_connect(conn->client, &conn->conn_opts, NULL, NULL);
+                TRACE(TRACE_DEBUG, "mqtt_publish 'client %p, rc=%d", conn->client, conn->rc);
+            }
+            else {
+                conn->client = NULL;
+            }
+        }
+        free_options(&rowopts);
+    }
+
+    TRACE(TRACE_DEBUG, "mqtt_publish(): rc=%d", conn->rc);
+    if (conn->rc == MQTTCLIENT_SUCCESS) {
+        MQTTClient_message pubmsg = MQTTClient_message_initializer;
+        MQTTClient_deliveryToken token;
+        TRACE(TRACE_DEBUG, "mqtt_publish() topic=\"%s\", payload %lu bytes", topic, (unsigned long)payloadlength);
+        pubmsg.payload = (void *)payload;
+        pubmsg.payloadlen = payloadlength;
+        pubmsg.qos = qos;
+        pubmsg.retained = retained;
+        pubmsg.properties = props;
+        topic_cache *cache = plan->arg[ARG_TOPIC].constant ? &conn->topic : NULL;
+        if (sess != NULL && session_buffer(sess, topic, &pubmsg, &conn->rc)) {
+            last_func = "mqtt_publish";
+            last_rc = conn->rc;
+        }
+        else if (sess != NULL && sess->async) {
+            conn->rc = last_rc = session_publish(sess, topic, &pubmsg, timeout, cache, NULL);
+        }
+        else {
+            last_func = "MQTTClient_publishMessage";
+            conn->rc = last_rc = sess != NULL ? session_publish_message(sess, topic, &pubmsg, &token, cache)
+                                              : client_publish(conn->client, version, topic, &pubmsg, &token, NULL);
+            if (conn->rc == MQTTCLIENT_SUCCESS) {
+                last_func = "MQTTClient_waitForCompletion";
+                conn->rc = last_rc = client_wait(conn->client, token, timeout, sess != NULL ? &sess->stats : NULL);
+            }
+        }
+        if (conn->rc != MQTTCLIENT_SUCCESS && sess != NULL && sess->reconnect && !MQTTClient_isConnected(sess->client)) {
+            // connection lost: keep the message until reconnected
+            session_lost(sess);
+            if (session_buffer(sess, topic, &pubmsg, &conn->rc)) {
+                last_func = "mqtt_publish";
+                last_rc = conn->rc;
+            }
+        }
+    }
+    else {
+        *error = 1;
+    }
+
+    if (plan->server_form && conn->client != NULL) {
+        if (conn->rc == MQTTCLIENT_SUCCESS && pooled) {
+            TRACE(TRACE_DEBUG, "mqtt_publish() release to pool - client=%p", conn->client);
+            pool_release(conn, conn->client, keepalive);
+            conn->client = NULL;
+        }
+        else {
+            TRACE(TRACE_DEBUG, "mqtt_publish() disconnnect - client=%p, rc=%d", conn->client, conn->rc);
+            MQTTClient_disconnect(conn->client, timeout);
+            MQTTClient_destroy(&conn->client);
+        }
+    }
+    MQTTProperties_free(&props);
+    if (conn->rc != MQTTCLIENT_SUCCESS) {
+        *error = 1;
+    }
+    if (sess != NULL) {
+        session_lasterror(sess);
+        session_put(sess);
+    }
+
+    return conn->rc;
+}
+
+
+
+
+/**
+ * mqtt_publish_batch
+ *
+ * Aggregate function collecting all messages of a group and publishing
+ * them at once with a single completion wait at the end.
+ * mqtt_publish_batch(client, topic, [payload] {,[qos] {,[retained] {,[timeout]}}})
+ */
+bool mqtt_publish_batch_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if ( args->arg_count>=3 && args->arg_count<=6
+        // client or name
+         && (args->arg_type[0]==INT_RESULT || args->arg_type[0]==STRING_RESULT)
         // topic
-         && args->arg_type[3]==STRING_RESULT
-         && args->args[3]!=NULL
+         && args->arg_type[1]==STRING_RESULT
         // payload
-         && args->arg_type[4]==STRING_RESULT
+         && args->arg_type[2]==STRING_RESULT
         // qos
-         && ((args->args[5]==NULL) || (args->arg_type[5]==INT_RESULT && ((int)*((longlong*)args->args[5])>=0 && (int)*((longlong*)args->args[5])<=2)))
+         && (args->arg_count<4 || args->args[3]==NULL || (args->arg_type[3]==INT_RESULT && ((int)*((longlong*)args->args[3])>=0 && (int)*((longlong*)args->args[3])<=2)))
         // retained
-         && ((args->args[6]==NULL) || (args->arg_type[6]==INT_RESULT && ((int)*((longlong*)args->args[6])>=0 && (int)*((longlong*)args->args[6])<=1)))
+         && (args->arg_count<5 || args->args[4]==NULL || (args->arg_type[4]==INT_RESULT && ((int)*((longlong*)args->args[4])>=0 && (int)*((longlong*)args->args[4])<=1)))
+        // timeout
+         && (args->arg_count<6 || args->args[5]==NULL || (args->arg_type[5]==INT_RESULT && ((int)*((longlong*)args->args[5])>=0)))
         ) {
-        conn->mqtt_publish_format = 3;
-#ifdef DEBUG
-        closelog ();
-#endif
+        initid->ptr = calloc(1, sizeof(batch));
+        if (initid->ptr == NULL) {
+            strcpy(message, "memory allocation error");
+            return 1;
+        }
+        initid->max_length = 255;
+        return 0;
+    }
+    parmerror("mqtt_publish_batch()", args);
+    strcpy(message, "function argument(s) error");
+    return 1;
+}
+
+void mqtt_publish_batch_deinit(UDF_INIT *initid)
+{
+    batch *b = (batch *)initid->ptr;
+
+    if (b != NULL) {
+        session_put(b->sess);
+        free(b->arena);
+        free(b->msgs);
+        free(b->packed.buf);
+        free(b);
+    }
+}
+
+void mqtt_publish_batch_clear(UDF_INIT *initid, char *is_null, char *error)
+{
+    batch *b = (batch *)initid->ptr;
+
+    session_put(b->sess);
+    b->sess = NULL;
+    b->handle = 0;
+    b->arena_len = 0;
+    b->count = 0;
+    b->rejected = 0;
+    b->timeout = DEFAULT_TIMEOUT;
+}
+
+void mqtt_publish_batch_add(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+{
+    batch *b = (batch *)initid->ptr;
+    longlong handle = args->args[0]==NULL ? 0
+                    : args->arg_type[0]==STRING_RESULT ? named_handle(args->args[0], args->lengths[0])
+                    : *(longlong*)args->args[0];
+    unsigned long topiclen = args->args[1]!=NULL ? args->lengths[1] : 0;
+    unsigned long payloadlen = args->args[2]!=NULL ? args->lengths[2] : 0;
+    const char *payload = args->args[2];
+
+    if (b->handle == 0 && handle != 0) {
+        // keep a reference to the session of the first row until the group is published
+        b->sess = session_get(handle);
+        b->handle = handle;
+    }
+    if (b->sess == NULL || handle != b->handle || args->args[1] == NULL) {
+        b->rejected++;
+        return;
+    }
+    if (args->arg_count >= 6 && args->args[5]!=NULL) {
+        b->timeout = (int)*((longlong*)args->args[5]);
+    }
+    if (payload_deflate(&b->sess->compress, payload, payloadlen, &b->packed)) {
+        payload = b->packed.buf;
+        payloadlen = b->packed.len;
+    }
+
+    // grow arena and message list geometrically
+    if (b->arena_len + topiclen + 1 + payloadlen > b->arena_size) {
+        size_t size = b->arena_size ? b->arena_size : 4096;
+        while (size < b->arena_len + topiclen + 1 + payloadlen) {
+            size *= 2;
+        }
+        char *arena = realloc(b->arena, size);
+        if (arena == NULL) {
+            b->rejected++;
+            return;
+        }
+        b->arena = arena;
+        b->arena_size = size;
+    }
+    if (b->count >= b->size) {
+        int size = b->size ? b->size * 2 : 256;
+        batch_msg *msgs = realloc(b->msgs, size * sizeof(batch_msg));
+        if (msgs == NULL) {
+            b->rejected++;
+            return;
+        }
+        b->msgs = msgs;
+        b->size = size;
+    }
+
+    batch_msg *msg = &b->msgs[b->count++];
+    msg->topic = b->arena_len;
+    memcpy(b->arena + b->arena_len, args->args[1], topiclen);
+    b->arena_len += topiclen;
+    b->arena[b->arena_len++] = '\0';
+    msg->payload = b->arena_len;
+    msg->payloadlen = payloadlen;
+    if (payloadlen) {
+        memcpy(b->arena + b->arena_len, payload, payloadlen);
+        b->arena_len += payloadlen;
+    }
+    msg->qos = args->arg_count >= 4 && args->args[3]!=NULL ? (int)*((longlong*)args->args[3]) : DEFAULT_QOS;
+    msg->retained = args->arg_count >= 5 && args->args[4]!=NULL ? (int)*((longlong*)args->args[4]) : DEFAULT_RETAINED;
+}
+
+/*
+ * Publish all collected messages on a synchronous handle.
+ * Messages are sent back-to-back; completions are only waited for if the
+ * client reports too many messages in-flight and once at the end.
+ */
+int batch_flush(batch *b, int *sent, int *failed)
+{
+    MQTTClient_deliveryToken *tokens = malloc(b->count * sizeof(MQTTClient_deliveryToken));
+    int oldest = 0, rc = MQTTCLIENT_SUCCESS;
+
+    if (tokens == NULL) {
+        *failed += b->count;
+        return MQTTCLIENT_FAILURE;
+    }
+    for (int i=0; i<b->count; i++) {
+        MQTTClient_message pubmsg = MQTTClient_message_initializer;
+        int prc;
+
+        pubmsg.payload = b->arena + b->msgs[i].payload;
+        pubmsg.payloadlen = b->msgs[i].payloadlen;
+        pubmsg.qos = b->msgs[i].qos;
+        pubmsg.retained = b->msgs[i].retained;
+        last_func = "MQTTClient_publishMessage";
+        while (MQTTCLIENT_MAX_MESSAGES_INFLIGHT == (prc = session_publish_message(b->sess, b->arena + b->msgs[i].topic, &pubmsg, &tokens[i], NULL))
+               && oldest < i) {
+            // wait for the oldest outstanding message to free a slot
+            if (b->msgs[oldest].qos > 0 && tokens[oldest] >= 0) {
+                last_func = "MQTTClient_waitForCompletion";
+                int wrc = client_wait(b->sess->client, tokens[oldest], b->timeout, &b->sess->stats);
+                if (wrc == MQTTCLIENT_SUCCESS) {
+                    (*sent)++;
+                }
+                else {
+                    (*failed)++;
+                    rc = wrc;
+                }
+                tokens[oldest] = -1;
+            }
+            oldest++;
+        }
+        if (prc != MQTTCLIENT_SUCCESS) {
+            (*failed)++;
+            rc = prc;
+            tokens[i] = -1;
+        }
+        else if (b->msgs[i].qos == 0) {
+            (*sent)++;
+            tokens[i] = -1;
+        }
+    }
+    // final completion wait
+    for (; oldest<b->count; oldest++) {
+        if (tokens[oldest] >= 0) {
+            last_func = "MQTTClient_waitForCompletion";
+            int wrc = client_wait(b->sess->client, tokens[oldest], b->timeout, &b->sess->stats);
+            if (wrc == MQTTCLIENT_SUCCESS) {
+                (*sent)++;
+            }
+            else {
+                (*failed)++;
+                rc = wrc;
+            }
+        }
+    }
+    free(tokens);
+    return rc;
+}
+
+/*
+ * Publish all collected messages on an async handle and wait up to the
+ * timeout for their confirmation. Only the tokens of this batch are
+ * counted, other publishers on the handle don't affect the result.
+ * Messages no longer pending are confirmed unless the connection was lost
+ * meanwhile, then they count as failed as they may have been dropped.
+ */
+int batch_flush_async(batch *b, int *sent, int *failed, int *pending)
+{
+    session *sess = b->sess;
+    MQTTClient_deliveryToken *tokens = malloc(b->count * sizeof(MQTTClient_deliveryToken));
+    unsigned long losses, delivered;
+    struct timespec ts;
+    int rejected = 0, awaited = 0, n = 0, rc = MQTTCLIENT_SUCCESS;
+    bool lost;
+
+    if (tokens == NULL) {
+        *failed += b->count;
+        return MQTTCLIENT_FAILURE;
+    }
+    pthread_mutex_lock(&sess->mutex);
+    losses = sess->losses;
+    pthread_mutex_unlock(&sess->mutex);
+
+    for (int i=0; i<b->count; i++) {
+        MQTTClient_message pubmsg = MQTTClient_message_initializer;
+        int prc;
+
+        pubmsg.payload = b->arena + b->msgs[i].payload;
+        pubmsg.payloadlen = b->msgs[i].payloadlen;
+        pubmsg.qos = b->msgs[i].qos;
+        pubmsg.retained = b->msgs[i].retained;
+        prc = session_publish(sess, b->arena + b->msgs[i].topic, &pubmsg, b->timeout, NULL, &tokens[i]);
+        if (prc != MQTTCLIENT_SUCCESS) {
+            rejected++;
+            rc = prc;
+        }
+        else if (tokens[i] >= 0) {
+            awaited++;
+        }
+    }
+
+    deadline(&ts, b->timeout);
+    for (;;) {
+        pthread_mutex_lock(&sess->mutex);
+        delivered = sess->delivered;
+        pthread_mutex_unlock(&sess->mutex);
+        // the client is not called with the session mutex held
+        if (awaited == 0 || (n = batch_pending(sess->client, tokens, b->count)) == 0) {
+            break;
+        }
+        pthread_mutex_lock(&sess->mutex);
+        int wrc = 0;
+        while (wrc == 0 && delivered == sess->delivered && losses == sess->losses) {
+            wrc = pthread_cond_timedwait(&sess->cond, &sess->mutex, &ts);
+        }
+        lost = losses != sess->losses;
+        pthread_mutex_unlock(&sess->mutex);
+        if (wrc == ETIMEDOUT || lost) {
+            n = batch_pending(sess->client, tokens, b->count);
+            break;
+        }
+    }
+    pthread_mutex_lock(&sess->mutex);
+    lost = losses != sess->losses;
+    pthread_mutex_unlock(&sess->mutex);
+    free(tokens);
+
+    *pending = n;
+    *failed += rejected + (lost ? awaited - n : 0);
+    *sent += b->count - rejected - awaited + (lost ? 0 : awaited - n);
+    if (lost && awaited > n) {
+        rc = MQTTCLIENT_DISCONNECTED;
+    }
+    return rc;
+}
+
+char* mqtt_publish_batch(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error)
+{
+    batch *b = (batch *)initid->ptr;
+    int sent = 0, failed = b->rejected, pending = 0, rc = MQTTCLIENT_SUCCESS;
+
+    TRACE(TRACE_DEBUG, "mqtt_publish_batch(): %d messages", b->count);
+
+    *is_null = 0;
+    *error = 0;
+
+    if (b->rejected) {
+        rc = MQTTCLIENT_NULL_PARAMETER;
+    }
+    if (b->count > 0) {
+        int frc = b->sess->async ? batch_flush_async(b, &sent, &failed, &pending) : batch_flush(b, &sent, &failed);
+        if (frc != MQTTCLIENT_SUCCESS) {
+            rc = frc;
+        }
+    }
+    last_func = "mqtt_publish_batch";
+    last_rc = rc;
+    if (b->sess != NULL) {
+        session_lasterror(b->sess);
+    }
+
+    // fits into the 255 bytes result buffer provided by MySQL
+    snprintf(result, 255, "{\"sent\":%d,\"failed\":%d,\"pending\":%d,\"rc\":%d}", sent, failed, pending, rc);
+    *length = strlen(result);
+    TRACE(TRACE_DEBUG, "mqtt_publish_batch(): %s", result);
+    return result;
+}
+
+
+
+
+/**
+ * mqtt_queue_start
+ *
+ * Start the background publisher used by mqtt_enqueue().
+ * mqtt_queue_start(server {,[username]} {,[password] {,[options]}}})
+ *      returns 0 if successful
+ */
+bool mqtt_queue_start_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (args->arg_count >= 1 && args->arg_count <= 4
+        // server
+        && args->arg_type[0]==STRING_RESULT && args->args[0]!=NULL
+        // username
+        && (args->arg_count < 2 || args->arg_type[1]==STRING_RESULT)
+        // password
+        && (args->arg_count < 3 || args->arg_type[2]==STRING_RESULT)
+        // options
+        && (args->arg_count < 4 || args->arg_type[3]==STRING_RESULT)
+       ) {
         return 0;
     }
-    //~ 4: mqtt_publish(server, [username], [password], topic, [payload], [qos], [retained], [timeout])
-    else if ( args->arg_count==8
-        // server
-         && args->arg_type[0]==STRING_RESULT
-         && args->args[0]!=NULL
-        // username
-         && args->arg_type[1]==STRING_RESULT
-        // password
-         && args->arg_type[2]==STRING_RESULT
+    parmerror("mqtt_queue_start()", args);
+    strcpy(message, "function argument(s) error");
+    return 1;
+}
+
+void mqtt_queue_start_deinit(UDF_INIT *initid)
+{
+}
+
+ulonglong mqtt_queue_start(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+{
+    char *address  = (char *)args->args[0];
+    char *username = NULL;
+    char *password = NULL;
+    int rc;
+
+    TRACE(TRACE_DEBUG, "mqtt_queue_start()");
+    *is_null = 0;
+    *error = 0;
+
+    // Do not assume that the string is null-terminated
+    // see https://dev.mysql.com/doc/refman/5.7/en/udf-arguments.html
+    address[args->lengths[0]] = '\0';
+    if (args->arg_count >= 2 && args->args[1]!=NULL) {
+        username  = (char *)args->args[1];
+        username[args->lengths[1]] = '\0';
+    }
+    if (args->arg_count >= 3 && args->args[2]!=NULL) {
+        password  = (char *)args->args[2];
+        password[args->lengths[2]] = '\0';
+    }
+    rc = queue_start(address, username, password,
+                     args->arg_count >= 4 ? args->args[3] : NULL,
+                     args->arg_count >= 4 && args->args[3]!=NULL ? args->lengths[3] : 0);
+    if (rc != MQTTCLIENT_SUCCESS) {
+        *error = 1;
+    }
+    TRACE(TRACE_INFO, "mqtt_queue_start() rc=%d", rc);
+    return rc;
+}
+
+/**
+ * mqtt_queue_stop
+ *
+ * Stop the background publisher after all queued messages are published.
+ * mqtt_queue_stop()
+ *      returns 0 if successful
+ */
+bool mqtt_queue_stop_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (args->arg_count != 0) {
+        parmerror("mqtt_queue_stop()", args);
+        strcpy(message, "No arguments allowed (udf: mqtt_queue_stop)");
+        return 1;
+    }
+    return 0;
+}
+
+void mqtt_queue_stop_deinit(UDF_INIT *initid)
+{
+}
+
+ulonglong mqtt_queue_stop(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+{
+    int rc;
+
+    *is_null = 0;
+    *error = 0;
+    last_func = "mqtt_queue_stop";
+    rc = last_rc = queue_stop();
+    if (rc != MQTTCLIENT_SUCCESS) {
+        *error = 1;
+    }
+    return rc;
+}
+
+/**
+ * mqtt_enqueue
+ *
+ * Queue a message for the background publisher and return immediately.
+ * mqtt_enqueue(topic, [payload] {,[qos] {,[retained]}})
+ *      returns 0 if successful
+ */
+bool mqtt_enqueue_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if ( args->arg_count>=2 && args->arg_count<=5
         // topic
-         && args->arg_type[3]==STRING_RESULT
-         && args->args[3]!=NULL
-        // payload
-         && args->arg_type[4]==STRING_RESULT
-        // qos
-         && ((args->args[5]==NULL) || (args->arg_type[5]==INT_RESULT && ((int)*((longlong*)args->args[5])>=0 && (int)*((longlong*)args->args[5])<=2)))
-        // retained
-         && ((args->args[6]==NULL) || (args->arg_type[6]==INT_RESULT && ((int)*((longlong*)args->args[6])>=0 && (int)*((longlong*)args->args[6])<=1)))
-        // timeout
-         && ((args->args[7]==NULL) || (args->arg_type[7]==INT_RESULT && ((int)*((longlong*)args->args[7])>=0)))
-        ) {
-        conn->mqtt_publish_format = 4;
-#ifdef DEBUG
-        closelog ();
-#endif
-        return 0;
-    }
-    //~ 5: mqtt_publish(server, [username], [password], topic, [payload], [qos], [retained], [timeout], [options])
-    else if ( args->arg_count==9
-        // server
          && args->arg_type[0]==STRING_RESULT
-         && args->args[0]!=NULL
-        // username
-         && args->arg_type[1]==STRING_RESULT
-        // password
-         && args->arg_type[2]==STRING_RESULT
-        // topic
-         && args->arg_type[3]==STRING_RESULT
-         && args->args[3]!=NULL
         // payload
-         && args->arg_type[4]==STRING_RESULT
+         && args->arg_type[1]==STRING_RESULT
         // qos
-         && ((args->args[5]==NULL) || (args->arg_type[5]==INT_RESULT && ((int)*((longlong*)args->args[5])>=0 && (int)*((longlong*)args->args[5])<=2)))
+         && (args->arg_count<3 || args->args[2]==NULL || (args->arg_type[2]==INT_RESULT && ((int)*((longlong*)args->args[2])>=0 && (int)*((longlong*)args->args[2])<=2)))
         // retained
-         && ((args->args[6]==NULL) || (args->arg_type[6]==INT_RESULT && ((int)*((longlong*)args->args[6])>=0 && (int)*((longlong*)args->args[6])<=1)))
-        // timeout
-         && ((args->args[7]==NULL) || (args->arg_type[7]==INT_RESULT && ((int)*((longlong*)args->args[7])>=0)))
-         // options
-         && args->arg_type[8]==STRING_RESULT
+         && (args->arg_count<4 || args->args[3]==NULL || (args->arg_type[3]==INT_RESULT && ((int)*((longlong*)args->args[3])>=0 && (int)*((longlong*)args->args[3])<=1)))
+        // coalesce
+         && (args->arg_count<5 || args->args[4]==NULL || args->arg_type[4]==INT_RESULT)
         ) {
-        conn->mqtt_publish_format = 5;
-#ifdef DEBUG
-        closelog ();
-#endif
         return 0;
     }
-    //~ 6: mqtt_publish(client, topic, [payload])
-    else if ( args->arg_count==3
-        // client
-         && args->arg_type[0]==INT_RESULT
-        // topic
-         && args->arg_type[1]==STRING_RESULT
-         && args->args[1]!=NULL
-        // payload
-         && args->arg_type[2]==STRING_RESULT
-        ) {
-        conn->mqtt_publish_format = 6;
-#ifdef DEBUG
-        closelog ();
-#endif
-        return 0;
+    parmerror("mqtt_enqueue()", args);
+    strcpy(message, "function argument(s) error");
+    return 1;
+}
+
+void mqtt_enqueue_deinit(UDF_INIT *initid)
+{
+}
+
+ulonglong mqtt_enqueue(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+{
+    int qos      = args->arg_count >= 3 && args->args[2]!=NULL ? (int)*((longlong*)args->args[2]) : DEFAULT_QOS;
+    int retained = args->arg_count >= 4 && args->args[3]!=NULL ? (int)*((longlong*)args->args[3]) : DEFAULT_RETAINED;
+    int coalesce = args->arg_count >= 5 && args->args[4]!=NULL && *((longlong*)args->args[4]) != 0;
+    int rc;
+
+    *is_null = 0;
+    *error = 0;
+    if (args->args[0] == NULL) {
+        *error = 1;
+        return MQTTCLIENT_NULL_PARAMETER;
     }
-    //~ 7: mqtt_publish(client, topic, [payload], [qos])
-    else if ( args->arg_count==4
-        // client
-         && args->arg_type[0]==INT_RESULT
-        // topic
-         && args->arg_type[1]==STRING_RESULT
-         && args->args[1]!=NULL
-        // payload
-         && args->arg_type[2]==STRING_RESULT
-        // qos
-         && ((args->args[3]==NULL) || (args->arg_type[3]==INT_RESULT && ((int)*((longlong*)args->args[3])>=0 && (int)*((longlong*)args->args[3])<=2)))
-        ) {
-        conn->mqtt_publish_format = 7;
-#ifdef DEBUG
-        closelog ();
-#endif
-        return 0;
+    rc = queue_enqueue(args->args[0], args->lengths[0],
+                       args->args[1]!=NULL ? args->args[1] : "", args->args[1]!=NULL ? args->lengths[1] : 0,
+                       qos, retained, coalesce);
+    if (rc != MQTTCLIENT_SUCCESS) {
+        last_func = "mqtt_enqueue";
+        last_rc = rc;
+        *error = 1;
     }
-    //~ 8: mqtt_publish(client, topic, [payload], [qos], [retained])
-    else if ( args->arg_count==5
-        // client
-         && args->arg_type[0]==INT_RESULT
-        // topic
-         && args->arg_type[1]==STRING_RESULT
-         && args->args[1]!=NULL
-        // payload
-         && args->arg_type[2]==STRING_RESULT
-        // qos
-         && ((args->args[3]==NULL) || (args->arg_type[3]==INT_RESULT && ((int)*((longlong*)args->args[3])>=0 && (int)*((longlong*)args->args[3])<=2)))
-        // retained
-         && ((args->args[4]==NULL) || (args->arg_type[4]==INT_RESULT && ((int)*((longlong*)args->args[4])>=0 && (int)*((longlong*)args->args[4])<=1)))
-        ) {
-        conn->mqtt_publish_format = 8;
-#ifdef DEBUG
-        closelog ();
-#endif
-        return 0;
+    return rc;
+}
+
+/**
+ * mqtt_queue_status
+ *
+ * Returns background publisher status as JSON string
+ * mqtt_queue_status()
+ */
+bool mqtt_queue_status_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (args->arg_count != 0) {
+        parmerror("mqtt_queue_status()", args);
+        strcpy(message, "No arguments allowed (udf: mqtt_queue_status)");
+        return 1;
     }
-    //~ 9: mqtt_publish(client, topic, [payload], [qos], [retained], [timeout])
-    else if ( args->arg_count==6
-        // client
-         && args->arg_type[0]==INT_RESULT
-        // topic
-         && args->arg_type[1]==STRING_RESULT
-         && args->args[1]!=NULL
-        // payload
-         && args->arg_type[2]==STRING_RESULT
-        // qos
-         && ((args->args[3]==NULL) || (args->arg_type[3]==INT_RESULT && ((int)*((longlong*)args->args[3])>=0 && (int)*((longlong*)args->args[3])<=2)))
-        // retained
-         && ((args->args[4]==NULL) || (args->arg_type[4]==INT_RESULT && ((int)*((longlong*)args->args[4])>=0 && (int)*((longlong*)args->args[4])<=1)))
-        // timeout
-         && ((args->args[5]==NULL) || (args->arg_type[5]==INT_RESULT && ((int)*((longlong*)args->args[5])>=0)))
-        ) {
-        conn->mqtt_publish_format = 9;
-#ifdef DEBUG
-        closelog ();
-#endif
-        return 0;
+    initid->ptr = malloc(MAX_RET_STRLEN+1);
+    if (initid->ptr == NULL) {
+        strcpy(message, "memory allocation error");
+        return 1;
     }
-    //~ 10: mqtt_publish(client, topic, [payload], [qos], [retained], [timeout], [options])
-    else if ( args->arg_count==7
-        // client
-         && args->arg_type[0]==INT_RESULT
-        // topic
-         && args->arg_type[1]==STRING_RESULT
-         && args->args[1]!=NULL
-        // payload
-         && args->arg_type[2]==STRING_RESULT
-        // qos
-         && ((args->args[3]==NULL) || (args->arg_type[3]==INT_RESULT && ((int)*((longlong*)args->args[3])>=0 && (int)*((longlong*)args->args[3])<=2)))
-        // retained
-         && ((args->args[4]==NULL) || (args->arg_type[4]==INT_RESULT && ((int)*((longlong*)args->args[4])>=0 && (int)*((longlong*)args->args[4])<=1)))
+    initid->max_length = MAX_RET_STRLEN;
+    return 0;
+}
+
+void mqtt_queue_status_deinit(UDF_INIT *initid)
+{
+    if (initid->ptr != NULL) {
+        free(initid->ptr);
+    }
+}
+
+char* mqtt_queue_status(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error)
+{
+    static const char *states[] = {"stopped", "running", "stopping"};
+    char *res = (char *)initid->ptr;
+    size_t tail = atomic_load(&queue.tail);
+    size_t head = atomic_load(&queue.head);
+
+    *is_null = 0;
+    *error = 0;
+    snprintf(res, MAX_RET_STRLEN, "{\"state\":\"%s\",\"size\":%zu,\"capacity\":%zu,\"enqueued\":%lu,\"published\":%lu,\"dropped\":%lu,\"failed\":%lu,\"batches\":%lu,\"coalesced\":%lu}",
+             states[atomic_load(&queue.state)], head - tail, queue.cells != NULL ? queue.mask + 1 : 0,
+             atomic_load(&queue.enqueued), atomic_load(&queue.published), atomic_load(&queue.dropped), atomic_load(&queue.failed),
+             atomic_load(&queue.batches), atomic_load(&queue.coalesced));
+    *length = strlen(res);
+    return res;
+}
+
+
+
+
+/**
+ * mqtt_subscribe
+ *
+ * Subsribe to a mqtt topic and returns the payload if any.
+ * Possible calls
+ * mqtt_subscribe(server, [username], [password], topic, [payload] {,[qos] {,[retained] {,[timeout] {,[options]}}}})
+ * mqtt_subscribe(client, topic, [payload] {,[qos] {,[retained] {,[timeout] {,[options]}}}})
+ *
+ * [qos] currently unused
+ */
+const call_form subscribe_forms[] = {
+    // mqtt_subscribe(server, [username], [password], topic {,[qos] {,[timeout] {,[options]}}})
+    {4, 7, {ARG_SERVER, ARG_USERNAME, ARG_PASSWORD, ARG_TOPIC, ARG_QOS, ARG_TIMEOUT, ARG_OPTIONS}},
+    // mqtt_subscribe(client, topic {,[qos] {,[timeout] {,[options]}}})
+    {2, 5, {ARG_HANDLE, ARG_TOPIC, ARG_QOS, ARG_TIMEOUT, ARG_OPTIONS}},
+};
+
+bool mqtt_subscribe_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    connection *conn;
+    int options;
+
+    initid->ptr = calloc(1, sizeof(connection));
+    if (initid->ptr == NULL) {
+        parmerror("mqtt_subscribe()", args);
+        strcpy(message, "memory allocation error");
+        return 1;
+    }
+    conn = (connection *)initid->ptr;
+    init_options(initid, args, -1, message);
+    initid->max_length = RECEIVE_MAX_LENGTH;
+    initid->maybe_null = 1;
+    last_func = "mqtt_subscribe_init";
+    conn->rc = last_rc = MQTTCLIENT_DISCONNECTED;
+
+    if (plan_compile(&conn->plan, subscribe_forms, 2, args, message)) {
+        parmerror("mqtt_subscribe()", args);
+        free(initid->ptr);
+        initid->ptr = NULL;
+        return 1;
+    }
+    if ((options = conn->plan.arg[ARG_OPTIONS].index) >= 0) {
+        char *consts = conn->plan.consts;
+        if (init_options(initid, args, options, message)) {
+            // conn is released by init_options()
+            free(consts);
+            return 1;
+        }
+    }
+    return 0;
+}
+void mqtt_subscribe_deinit(UDF_INIT *initid)
+{
+    if (initid->ptr != NULL) {
+        recv_free(((connection *)initid->ptr)->held);
+        free_options(&((connection *)initid->ptr)->options);
+        plan_free(&((connection *)initid->ptr)->plan);
+        free(initid->ptr);
+    }
+}
+
+/*
+ * Hand the payload of msg to MySQL without copying it: msg is kept in
+ * conn->held until the next row or deinit. Payloads larger than
+ * max_payload (default RECEIVE_MAX_LENGTH) are refused and NULL is
+ * returned. The message was acknowledged already, so it is lost even with
+ * QoS 1/2: it is counted as dropped on sess and the error set.
+ */
+char *subscribe_result(connection *conn, session *sess, recv_msg *msg, long max_payload, char *result, unsigned long *length)
+{
+    if (max_payload <= 0) {
+        max_payload = RECEIVE_MAX_LENGTH;
+    }
+    if (msg->payloadlen > max_payload) {
+        TRACE(TRACE_ERROR, "mqtt_subscribe(): dropped, payload of %d bytes exceeds maxPayload", msg->payloadlen);
+        if (sess != NULL) {
+            pthread_mutex_lock(&sess->mutex);
+            sess->recv_dropped++;
+            pthread_mutex_unlock(&sess->mutex);
+        }
+        last_func = "mqtt_subscribe";
+        last_rc = MQTTCLIENT_FAILURE;
+        recv_free(msg);
+        return NULL;
+    }
+    conn->held = msg;
+    *length = msg->payloadlen;
+    return msg->payloadlen > 0 ? msg->payload : result;
+}
+char* mqtt_subscribe(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error)
+{
+    connection *conn = (connection *)initid->ptr;
+    call_plan *plan = &conn->plan;
+    const char *address, *username, *password, *topic;
+    char *rtopic;
+    int timeout, qos, rtopiclen = 0;
+    mqtt_options rowopts;
+    const mqtt_options *opts;
+    session *sess = NULL;
+    bool streaming = false;
+    long max_payload = 0;
+    compression rowcomp;
+    const compression *comp = NULL;
+    char *res = NULL;
+
+
+    *is_null = 0;
+    *error = 0;
+
+    // release the payload returned for the previous row
+    recv_free(conn->held);
+    conn->held = NULL;
+
+    if (!plan_bind(plan, args)) {
+        last_func = "mqtt_subscribe";
+        last_rc = MQTTCLIENT_FAILURE;
+        *is_null = 1;
+        *error = 1;
+        return NULL;
+    }
+    qos         = (int)plan->arg[ARG_QOS].value;
+    timeout     = (int)plan->arg[ARG_TIMEOUT].value;
+    topic       = plan->arg[ARG_TOPIC].str;
+    address     = plan->arg[ARG_SERVER].str;
+    username    = plan->arg[ARG_USERNAME].str;
+    password    = plan->arg[ARG_PASSWORD].str;
+
+    if (!plan->server_form) {
+        sess        = session_arg(args, plan->arg[ARG_HANDLE].index);
+        conn->client= sess!=NULL ? sess->client : NULL;
+        last_func = "mqtt_subscribe";
+        conn->rc = last_rc = conn->client == NULL ? MQTTCLIENT_DISCONNECTED
+                           : topic == NULL ? MQTTCLIENT_NULL_PARAMETER : MQTTCLIENT_SUCCESS;
+        max_payload = sess != NULL ? sess->max_payload : 0;
+        comp = sess != NULL ? &sess->compress : NULL;
+        if (conn->rc == MQTTCLIENT_SUCCESS && session_recv_max(sess) > 0) {
+            // messages are queued by the callbacks of the persistent subscriptions
+            streaming = true;
+        }
+        else if (conn->rc == MQTTCLIENT_SUCCESS && sess->async) {
+            // messages are delivered to the callbacks, MQTTClient_receive() can't be used
+            conn->rc = last_rc = MQTTCLIENT_FAILURE;
+        }
+    }
+    else if (address == NULL || topic == NULL) {
+        conn->client = NULL;
+        last_func = "mqtt_subscribe";
+        conn->rc = last_rc = MQTTCLIENT_NULL_PARAMETER;
+    }
+    else {
+        opts = row_options(conn, args, &rowopts);
+        max_payload = opts->maxPayload;
+        // the dictionary points into the options released at the end
+        compression_init(&rowcomp, opts);
+        comp = &rowcomp;
+
+        last_func = "MQTTClient_create";
+        conn->rc = last_rc = client_create(&conn->client, address, opts, NULL);
+        if (conn->rc == MQTTCLIENT_SUCCESS) {
+            TRACE(TRACE_DEBUG, "mqtt_subscribe(): username=\"%s\"", username != NULL ? username : "");
+            create_conn(conn, username, password, opts);
+
+            last_func = "MQTTClient_connect";
+            conn->rc = last_rc = client_connect(conn->client, &conn->conn_opts, NULL, NULL);
+            TRACE(TRACE_DEBUG, "mqtt_subscribe(): client=%p, rc=%d", conn->client, conn->rc);
+        }
+        else {
+            conn->client = NULL;
+        }
+    }
+
+    if (conn->rc == MQTTCLIENT_SUCCESS && streaming) {
+        recv_msg *msg = NULL;
+
+        if (MQTTCLIENT_SUCCESS == session_subscribe(sess, topic, qos)) {
+            last_func = "mqtt_subscribe";
+            last_rc = MQTTCLIENT_SUCCESS;
+            msg = session_receive(sess, 1, 0, timeout);
+        }
+        if (msg != NULL) {
+            res = subscribe_result(conn, sess, msg, max_payload, result, length);
+        }
+    }
+    else if (conn->rc == MQTTCLIENT_SUCCESS) {
+        MQTTClient_message *submsg = NULL;
+        int rc;
+
+        TRACE(TRACE_DEBUG, "mqtt_subscribe '%s'", topic);
+        last_func = "MQTTClient_subscribe";
+        if (sess != NULL && sess->share_group != NULL) {
+            char *filter = share_filter(sess->share_group, topic);
+            rc = last_rc = filter != NULL ? client_subscribe(conn->client, sess->version, filter, qos) : MQTTCLIENT_FAILURE;
+            free(filter);
+        }
+        else {
+            rc = last_rc = client_subscribe(conn->client, sess != NULL ? sess->version : conn->conn_opts.MQTTVersion, topic, qos);
+        }
+        if (rc == MQTTCLIENT_SUCCESS) {
+            TRACE(TRACE_DEBUG, "mqtt_subscribe MQTTClient_receive() returned %sdata, rc=%d", submsg != NULL ? "":"no ", rc);
+            last_func = "MQTTClient_receive";
+            rc = last_rc = MQTTClient_receive(conn->client, &rtopic, &rtopiclen, &submsg, timeout);
+            TRACE(TRACE_DEBUG, "mqtt_subscribe MQTTClient_receive() returned %sdata, rc=%d", submsg != NULL ? "":"no ", rc);
+            if ((rc == MQTTCLIENT_SUCCESS) && (submsg != NULL)) {
+                recv_msg *msg = malloc(sizeof(recv_msg));
+
+                stats_add(sess != NULL ? &sess->stats : NULL, STAT_RECEIVED, 1);
+                stats_add(sess != NULL ? &sess->stats : NULL, STAT_RECEIVED_BYTES, submsg->payloadlen);
+                TRACE(TRACE_DEBUG, "mqtt_subscribe payload returned bytes %d", submsg->payloadlen);
+                if (msg != NULL) {
+                    msg->next = NULL;
+                    msg->topic = rtopic;
+                    msg->topiclen = rtopiclen;
+                    msg->message = submsg;
+                    recv_inflate(msg, comp);
+                    res = subscribe_result(conn, sess, msg, max_payload, result, length);
+                }
+                else {
+                    MQTTClient_freeMessage(&submsg);
+                    MQTTClient_free(rtopic);
+                }
+            }
+        }
+    }
+
+    if (plan->server_form && conn->client != NULL) {
+        TRACE(TRACE_DEBUG, "mqtt_subscribe() disconnnect - client=%p, rc=%d", conn->client, conn->rc);
+        MQTTClient_disconnect(conn->client, timeout);
+        MQTTClient_destroy(&conn->client);
+    }
+    if (res == NULL) {
+        *is_null = 1;
+        *error = 1;
+    }
+    if (comp == &rowcomp) {
+        free_options(&rowopts);
+    }
+    if (sess != NULL) {
+        session_lasterror(sess);
+        session_put(sess);
+    }
+
+
+    return res;
+}
+
+
+/* Write msgs into sb as JSON array, returns false on memory allocation error */
+bool recv_json(strbuf *sb, recv_msg *msgs)
+{
+    char buf[64];
+    bool ok;
+
+    sb->len = 0;
+    ok = strbuf_append(sb, "[", 1);
+    for (recv_msg *msg = msgs; msg != NULL && ok; msg = msg->next) {
+        ok = (msg == msgs || strbuf_append(sb, ",", 1))
+            && strbuf_append(sb, "{\"topic\":", 9)
+            && strbuf_append_json(sb, msg->topic, msg->topiclen)
+            && strbuf_append(sb, ",\"payload\":", 11)
+            && strbuf_append_json(sb, msg->payload, msg->payloadlen)
+            && strbuf_append(sb, buf, snprintf(buf, sizeof(buf), ",\"qos\":%d,\"retained\":%d}", msg->message->qos, msg->message->retained));
+    }
+    return ok && strbuf_append(sb, "]", 1);
+}
+
+
+/**
+ * mqtt_receive
+ *
+ * Returns messages received by the streaming subscriptions of a handle.
+ * mqtt_receive(client {,[max_messages] {,[timeout]}})
+ */
+bool mqtt_receive_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if ( args->arg_count >= 1 && args->arg_count <= 3
+        // client or name
+         && (args->arg_type[0]==INT_RESULT || args->arg_type[0]==STRING_RESULT)
+        // max_messages
+         && (args->arg_count < 2 || args->arg_type[1]==INT_RESULT || args->args[1]==NULL)
         // timeout
-         && ((args->args[5]==NULL) || (args->arg_type[5]==INT_RESULT && ((int)*((longlong*)args->args[5])>=0)))
-        // options
-         && (args->arg_type[6]==STRING_RESULT)
+         && (args->arg_count < 3 || args->arg_type[2]==INT_RESULT || args->args[2]==NULL)
         ) {
-        conn->mqtt_publish_format = 10;
-#ifdef DEBUG
-        closelog ();
-#endif
+        initid->ptr = calloc(1, sizeof(strbuf));
+        if (initid->ptr == NULL) {
+            strcpy(message, "memory allocation error");
+            return 1;
+        }
+        initid->max_length = RECEIVE_MAX_LENGTH;
+        initid->maybe_null = 1;
         return 0;
     }
-    parmerror("mqtt_publish()", args);
-    strcpy(message, "function argument(s) error");
-#ifdef DEBUG
-    closelog ();
-#endif
-    return 1;
+    else {
+        parmerror("mqtt_receive()", args);
+        strcpy(message, "function argument(s) error");
+        return 1;
+    }
 }
-void mqtt_publish_deinit(UDF_INIT *initid)
+
+void mqtt_receive_deinit(UDF_INIT *initid)
 {
-#ifdef DEBUG
-    setlogmask (LOG_UPTO (LOG_NOTICE));
-    openlog (LIBNAME, LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-#endif
-#ifdef DEBUG
-    syslog (LOG_NOTICE, "mqtt_publish_deinit");
-#endif
     if (initid->ptr != NULL) {
+        free(((strbuf *)initid->ptr)->buf);
         free(initid->ptr);
     }
-#ifdef DEBUG
-    closelog ();
-#endif
 }
-ulonglong mqtt_publish(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
-{
-    connection *conn = (connection *)initid->ptr;
-    char *address, *username, *password, *topic, *payload, *options = "";
-    int qos, retained, timeout, payloadlength = 0;
 
-#ifdef DEBUG
-    setlogmask (LOG_UPTO (LOG_NOTICE));
-    openlog (LIBNAME, LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-#endif
+char* mqtt_receive(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error)
+{
+    strbuf *sb = (strbuf *)initid->ptr;
+    session *sess = session_arg(args, 0);
+    int max = RECEIVE_DEFAULT_MAX;
+    int timeout = DEFAULT_TIMEOUT;
+    recv_msg *msgs;
+    bool ok;
 
-#ifdef DEBUG
-    syslog (LOG_NOTICE, "mqtt_publish(): mqtt_publish_format %d", conn->mqtt_publish_format);
-#endif
 
     *is_null = 0;
     *error = 0;
 
-    qos         = DEFAULT_QOS;
-    retained    = DEFAULT_RETAINED;
-    timeout     = DEFAULT_TIMEOUT;
-
-    switch (conn->mqtt_publish_format) {
-        //~ 10: mqtt_publish(client, topic, [payload], [qos], [retained], [timeout], [options])
-        case 10:
-            options     = args->args[6]!=NULL ? (char *)args->args[6] : "";
-        //~ 9: mqtt_publish(client, topic, [payload], [qos], [retained], [timeout])
-        case 9:
-            timeout     = args->args[5]!=NULL ? (int)*((longlong*)args->args[5]) : DEFAULT_TIMEOUT;
-        //~ 8: mqtt_publish(client, topic, [payload], [qos], [retained])
-        case 8:
-            retained    = args->args[4]!=NULL ? (int)*((longlong*)args->args[4]) : DEFAULT_RETAINED;
-        //~ 7: mqtt_publish(client, topic, [payload], [qos])
-        case 7:
-            qos         = args->args[3]!=NULL ? (int)*((longlong*)args->args[3]) : DEFAULT_QOS;
-        //~ 6: mqtt_publish(client, topic, [payload])
-        case 6:
-            payload     = args->args[2]!=NULL ? (char *)args->args[2] : "";
-            payloadlength=args->args[2]!=NULL ? args->lengths[2] : 0;
-            topic       = (char *)args->args[1];
-            conn->client= (MQTTClient)*(longlong*)args->args[0];
-            break;
-        //~ 5: mqtt_publish(server, [username], [password], topic, [payload], [qos], [retained], [timeout], [options])
-        case 5:
-            options     = args->args[8]!=NULL ? (char *)args->args[8] : "";
-        //~ 4: mqtt_publish(server, [username], [password], topic, [payload], [qos], [retained], [timeout])
-        case 4:
-            timeout     = args->args[7]!=NULL ? (int)*((longlong*)args->args[7]) : DEFAULT_TIMEOUT;
-        //~ 3: mqtt_publish(server, [username], [password], topic, [payload], [qos], [retained])
-        case 3:
-            retained    = args->args[6]!=NULL ? (int)*((longlong*)args->args[6]) : DEFAULT_RETAINED;
-        //~ 2: mqtt_publish(server, [username], [password], topic, [payload], [qos])
-        case 2:
-            qos         = args->args[5]!=NULL ? (int)*((longlong*)args->args[5]) : DEFAULT_QOS;
-        //~ 1: mqtt_publish(server, [username], [password], topic, [payload])
-        case 1:
-            payload     = args->args[4]!=NULL ? (char *)args->args[4] : "";
-            payloadlength=args->args[4]!=NULL ? args->lengths[4] : 0;
-            topic       = (char *)args->args[3];
-            password    = (char *)args->args[2];
-            username    = (char *)args->args[1];
-            address      = (char *)args->args[0];
-            break;
-        default:
-            break;
+    if (args->arg_count >= 2 && args->args[1]!=NULL && *((longlong*)args->args[1]) > 0) {
+        max = (int)*((longlong*)args->args[1]);
     }
-#ifdef DEBUG
-    syslog (LOG_NOTICE, "mqtt_publish(): preset done");
-#endif
-
-    // Do not assume that the string is null-terminated
-    // see https://dev.mysql.com/doc/refman/5.7/en/udf-arguments.html
-    switch (conn->mqtt_publish_format) {
-        case 10:
-            if (args->args[6]!=NULL) options[args->lengths[6]]  = '\0';
-        case 9:
-        case 8:
-        case 7:
-        case 6:
-            if (args->args[1]!=NULL) topic[args->lengths[1]]    = '\0';
-            if (args->args[2]!=NULL) payload[args->lengths[2]]  = '\0';
-            strcpy(last_func, "mqtt_publish");
-            conn->rc = last_rc = (conn->client!=NULL) ? MQTTCLIENT_SUCCESS : MQTTCLIENT_DISCONNECTED;
-            break;
-        case 5:
-            if (args->args[8]!=NULL) options[args->lengths[8]]  = '\0';
-        case 4:
-        case 3:
-        case 2:
-        case 1:
-            if (args->args[0]!=NULL) address[args->lengths[0]]  = '\0';
-            if (args->args[1]!=NULL) username[args->lengths[1]] = '\0';
-            if (args->args[2]!=NULL) password[args->lengths[2]] = '\0';
-            if (args->args[3]!=NULL) topic[args->lengths[3]]    = '\0';
-            if (args->args[4]!=NULL) payload[args->lengths[4]]  = '\0';
-
-            strcpy(last_func, "MQTTClient_create");
-            conn->rc = last_rc = MQTTClient_create(&conn->client, address, GetUUID(), MQTTCLIENT_PERSISTENCE_NONE, NULL);
-            if (conn->rc == MQTTCLIENT_SUCCESS) {
-#ifdef DEBUG
-                syslog (LOG_NOTICE, "mqtt_publish(): username=\"%s\", password=\"%s\", options='%s'", username, password, options);
-#endif
-                create_conn(conn, username, password, options);
-
-                strcpy(last_func, "MQTTClient_connect");
-                conn->rc = last_rc = MQTTClient_connect(conn->client, &conn->conn_opts);
-#ifdef DEBUG
-                syslog (LOG_NOTICE, "mqtt_publish 'client %p, rc=%d", conn->client, conn->rc);
-#endif
-            }
-            break;
+    if (args->arg_count >= 3 && args->args[2]!=NULL && *((longlong*)args->args[2]) >= 0) {
+        timeout = (int)*((longlong*)args->args[2]);
     }
 
-#ifdef DEBUG
-        syslog (LOG_NOTICE, "mqtt_publish(): rc=%d", conn->rc);
-#endif
-    if (conn->rc == MQTTCLIENT_SUCCESS) {
-        MQTTClient_message pubmsg = MQTTClient_message_initializer;
-        MQTTClient_deliveryToken token;
-#ifdef DEBUG
-        syslog (LOG_NOTICE, "mqtt_publish() topic=\"%s\", payload=%s", topic, payload);
-#endif
-        pubmsg.payload = payload;
-        pubmsg.payloadlen = payloadlength;
-        pubmsg.qos = qos;
-        pubmsg.retained = retained;
-        strcpy(last_func, "MQTTClient_publishMessage");
-        conn->rc = last_rc = MQTTClient_publishMessage(conn->client, topic, &pubmsg, &token);
-        if (conn->rc == MQTTCLIENT_SUCCESS) {
-            strcpy(last_func, "MQTTClient_waitForCompletion");
-            conn->rc = last_rc = MQTTClient_waitForCompletion(conn->client, token, timeout);
+    last_func = "mqtt_receive";
+    if (sess == NULL || session_recv_max(sess) == 0) {
+        last_rc = sess == NULL ? MQTTCLIENT_NULL_PARAMETER : MQTTCLIENT_FAILURE;
+        if (sess != NULL) {
+            session_lasterror(sess);
+            session_put(sess);
         }
-    }
-    else {
+        *is_null = 1;
         *error = 1;
+        return NULL;
     }
 
-    if (conn->rc == MQTTCLIENT_SUCCESS) {
-        switch (conn->mqtt_publish_format) {
-            case 1:
-            case 2:
-            case 3:
-            case 4:
-#ifdef DEBUG
-                syslog (LOG_NOTICE, "mqtt_publish() disconnnect - client=%p, rc=%d", conn->client, conn->rc);
-#endif
-                MQTTClient_disconnect(conn->client, timeout);
-                MQTTClient_destroy(&conn->client);
-                break;
-        }
-    }
-    else {
+    msgs = session_receive(sess, max, 0, timeout);
+    ok = recv_json(sb, msgs);
+    recv_free(msgs);
+
+    last_rc = ok ? MQTTCLIENT_SUCCESS : MQTTCLIENT_FAILURE;
+    session_lasterror(sess);
+    session_put(sess);
+    TRACE(TRACE_DEBUG, "mqtt_receive(): %lu bytes, rc=%d", (unsigned long)sb->len, last_rc);
+    if (!ok) {
+        *is_null = 1;
         *error = 1;
+        return NULL;
     }
-
-#ifdef DEBUG
-    closelog ();
-#endif
-    return conn->rc;
+    *length = sb->len;
+    return sb->buf;
 }
 
 
-
-
 /**
- * mqtt_subscribe
- *
- * Subsribe to a mqtt topic and returns the payload if any.
- * Possible calls
- * mqtt_subscribe(server, [username], [password], topic, [payload] {,[qos] {,[retained] {,[timeout] {,[options]}}}})
- * mqtt_subscribe(client, topic, [payload] {,[qos] {,[retained] {,[timeout] {,[options]}}}})
+ * mqtt_unsubscribe
  *
- * [qos] currently unused
+ * Ends a streaming subscription made by mqtt_subscribe().
+ * mqtt_unsubscribe(client, topic)
  */
-bool mqtt_subscribe_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+bool mqtt_unsubscribe_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
 {
-    initid->ptr = malloc(sizeof(connection));
-    if (initid->ptr == NULL) {
-        parmerror("mqtt_subscribe()", args);
-        strcpy(message, "memory allocation error");
-        return 1;
-    }
-    connection *conn = (connection *)initid->ptr;
-    conn->client = NULL;
-    strcpy(last_func, "mqtt_subscribe_init");
-    conn->rc = last_rc = MQTTCLIENT_DISCONNECTED;
-
-    conn->mqtt_publish_format = 0;
-    //~ 1: mqtt_subscribe(server, [username], [password], topic)
-    if ( args->arg_count==4
-        // server
-         && args->arg_type[0]==STRING_RESULT
-         && args->args[0]!=NULL
-        // username
-         && args->arg_type[1]==STRING_RESULT
-        // password
-         && args->arg_type[2]==STRING_RESULT
-        // topic
-         && args->arg_type[3]==STRING_RESULT
-         && args->args[3]!=NULL
-        ) {
-        conn->mqtt_subscribe_format = 1;
-        return 0;
-    }
-    //~ 2: mqtt_subscribe(server, [username], [password], topic, [qos])
-    else if ( args->arg_count==5
-        // server
-         && args->arg_type[0]==STRING_RESULT
-         && args->args[0]!=NULL
-        // username
-         && args->arg_type[1]==STRING_RESULT
-        // password
-         && args->arg_type[2]==STRING_RESULT
-        // topic
-         && args->arg_type[3]==STRING_RESULT
-         && args->args[3]!=NULL
-        // qos
-         && ((args->args[4]==NULL) || (args->arg_type[4]==INT_RESULT && ((int)*((longlong*)args->args[4])>=0 && (int)*((longlong*)args->args[4])<=2)))
-        ) {
-        conn->mqtt_subscribe_format = 2;
-        return 0;
-    }
-    //~ 3: mqtt_subscribe(server, [username], [password], topic, [qos], [timeout])
-    else if ( args->arg_count==6
-        // server
-         && args->arg_type[0]==STRING_RESULT
-         && args->args[0]!=NULL
-        // username
-         && args->arg_type[1]==STRING_RESULT
-        // password
-         && args->arg_type[2]==STRING_RESULT
+    if ( args->arg_count == 2
+        // client or name
+         && (args->arg_type[0]==INT_RESULT || args->arg_type[0]==STRING_RESULT)
         // topic
-         && args->arg_type[3]==STRING_RESULT
-         && args->args[3]!=NULL
-        // qos
-         && ((args->args[4]==NULL) || (args->arg_type[4]==INT_RESULT && ((int)*((longlong*)args->args[4])>=0 && (int)*((longlong*)args->args[4])<=2)))
-        // timeout
-         && ((args->args[5]==NULL) || (args->arg_type[5]==INT_RESULT && ((int)*((longlong*)args->args[5])>=0)))
-        ) {
-        conn->mqtt_subscribe_format = 3;
-        return 0;
-    }
-    //~ 4: mqtt_subscribe(server, [username], [password], topic, [qos], [timeout], [options])
-    else if ( args->arg_count==7
-        // server
-         && args->arg_type[0]==STRING_RESULT
-         && args->args[0]!=NULL
-        // username
          && args->arg_type[1]==STRING_RESULT
-        // password
-         && args->arg_type[2]==STRING_RESULT
-        // topic
-         && args->arg_type[3]==STRING_RESULT
-         && args->args[3]!=NULL
-        // qos
-         && ((args->args[4]==NULL) || (args->arg_type[4]==INT_RESULT && ((int)*((longlong*)args->args[4])>=0 && (int)*((longlong*)args->args[4])<=2)))
-        // timeout
-         && ((args->args[5]==NULL) || (args->arg_type[5]==INT_RESULT && ((int)*((longlong*)args->args[5])>=0)))
-        // options
-         && args->arg_type[6]==STRING_RESULT
-        ) {
-        conn->mqtt_subscribe_format = 4;
+         ) {
         return 0;
     }
-    //~ 5: mqtt_subscribe(client, topic)
-    else if ( args->arg_count==2
-        // client
-         && args->arg_type[0]==INT_RESULT
-        // topic
-         && args->arg_type[1]==STRING_RESULT
-         && args->args[1]!=NULL
-        ) {
-        conn->mqtt_subscribe_format = 5;
-        return 0;
+    else {
+        parmerror("mqtt_unsubscribe()", args);
+        strcpy(message, "function argument(s) error");
+        return 1;
     }
-    //~ 6: mqtt_subscribe(client, topic, [qos])
-    else if ( args->arg_count==3
-        // client
-         && args->arg_type[0]==INT_RESULT
-        // topic
-         && args->arg_type[1]==STRING_RESULT
-         && args->args[1]!=NULL
-        // qos
-         && ((args->args[2]==NULL) || (args->arg_type[2]==INT_RESULT && ((int)*((longlong*)args->args[2])>=0 && (int)*((longlong*)args->args[2])<=2)))
-        ) {
-        conn->mqtt_subscribe_format = 6;
-        return 0;
+}
+
+void mqtt_unsubscribe_deinit(UDF_INIT *initid)
+{
+}
+
+ulonglong mqtt_unsubscribe(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+{
+    session *sess = session_arg(args, 0);
+    int rc;
+
+    if (sess == NULL || args->args[1] == NULL) {
+        last_func = "MQTTClient_unsubscribe";
+        session_put(sess);
+        *error = 1;
+        return last_rc = MQTTCLIENT_NULL_PARAMETER;
     }
-    //~ 7: mqtt_subscribe(client, topic, [qos], [timeout])
-    else if ( args->arg_count==4
-        // client
-         && args->arg_type[0]==INT_RESULT
-        // topic
-         && args->arg_type[1]==STRING_RESULT
-         && args->args[1]!=NULL
-        // qos
-         && ((args->args[2]==NULL) || (args->arg_type[2]==INT_RESULT && ((int)*((longlong*)args->args[2])>=0 && (int)*((longlong*)args->args[2])<=2)))
-        // timeout
-         && ((args->args[3]==NULL) || (args->arg_type[3]==INT_RESULT && ((int)*((longlong*)args->args[3])>=0)))
-        ) {
-        conn->mqtt_subscribe_format = 7;
-        return 0;
+    // Do not assume that the string is null-terminated
+    args->args[1][args->lengths[1]] = '\0';
+    rc = session_unsubscribe(sess, args->args[1]);
+    if (rc != MQTTCLIENT_SUCCESS) {
+        *error = 1;
     }
-    //~ 8: mqtt_subscribe(client, topic, [qos], [timeout], [options])
-    else if ( args->arg_count==5
-        // client
-         && args->arg_type[0]==INT_RESULT
-        // topic
+    session_lasterror(sess);
+    session_put(sess);
+    return rc;
+}
+
+
+/**
+ * mqtt_consume
+ *
+ * Subscribes to a set of topic filters and returns the received messages
+ * in batches for multi-row INSERTs.
+ * mqtt_consume(client, [topics] {,[max_messages] {,[max_latency] {,[timeout]}}})
+ */
+bool mqtt_consume_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if ( args->arg_count >= 2 && args->arg_count <= 5
+        // client or name
+         && (args->arg_type[0]==INT_RESULT || args->arg_type[0]==STRING_RESULT)
+        // topics
          && args->arg_type[1]==STRING_RESULT
-         && args->args[1]!=NULL
-        // qos
-         && ((args->args[2]==NULL) || (args->arg_type[2]==INT_RESULT && ((int)*((longlong*)args->args[2])>=0 && (int)*((longlong*)args->args[2])<=2)))
+        // max_messages
+         && (args->arg_count < 3 || args->arg_type[2]==INT_RESULT || args->args[2]==NULL)
+        // max_latency
+         && (args->arg_count < 4 || args->arg_type[3]==INT_RESULT || args->args[3]==NULL)
         // timeout
-         && ((args->args[3]==NULL) || (args->arg_type[3]==INT_RESULT && ((int)*((longlong*)args->args[3])>=0)))
-        // topic
-         && args->arg_type[4]==STRING_RESULT
+         && (args->arg_count < 5 || args->arg_type[4]==INT_RESULT || args->args[4]==NULL)
         ) {
-        conn->mqtt_subscribe_format = 8;
+        initid->ptr = calloc(1, sizeof(strbuf));
+        if (initid->ptr == NULL) {
+            strcpy(message, "memory allocation error");
+            return 1;
+        }
+        initid->max_length = RECEIVE_MAX_LENGTH;
+        initid->maybe_null = 1;
         return 0;
     }
     else {
-        parmerror("mqtt_subscribe()", args);
+        parmerror("mqtt_consume()", args);
         strcpy(message, "function argument(s) error");
         return 1;
     }
 }
-void mqtt_subscribe_deinit(UDF_INIT *initid)
+
+void mqtt_consume_deinit(UDF_INIT *initid)
 {
     if (initid->ptr != NULL) {
+        free(((strbuf *)initid->ptr)->buf);
         free(initid->ptr);
     }
 }
-char* mqtt_subscribe(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error)
+
+/*
+ * Subscribe sess to topics, a JSON array of topic filters or a single
+ * topic filter. Already existing subscriptions are not renewed.
+ */
+int consume_subscribe(session *sess, const char *topics, unsigned long length)
 {
-    connection *conn = (connection *)initid->ptr;
-    char *address, *username, *password, *topic, *options = "";
-    int timeout, qos, topiclengths = 0;
+    json_value *value;
+    char *topic;
+    int rc = MQTTCLIENT_SUCCESS;
+
+    if (length > 0 && topics[0] != '[') {
+        if ((topic = strndup(topics, length)) == NULL) {
+            return MQTTCLIENT_FAILURE;
+        }
+        rc = session_subscribe(sess, topic, CONSUME_QOS);
+        free(topic);
+        return rc;
+    }
+    value = json_parse((json_char*)topics, length);
+    if (value == NULL || value->type != json_array) {
+        if (value != NULL) {
+            json_value_free(value);
+        }
+        last_func = "mqtt_consume";
+        return last_rc = MQTTCLIENT_BAD_UTF8_STRING;
+    }
+    for (int i=0; i<value->u.array.length && rc == MQTTCLIENT_SUCCESS; i++) {
+        if (value->u.array.values[i]->type == json_string) {
+            rc = session_subscribe(sess, value->u.array.values[i]->u.string.ptr, CONSUME_QOS);
+        }
+    }
+    json_value_free(value);
+    return rc;
+}
+
+char* mqtt_consume(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error)
+{
+    strbuf *sb = (strbuf *)initid->ptr;
+    session *sess = session_arg(args, 0);
+    int max = RECEIVE_DEFAULT_MAX;
+    int latency = CONSUME_DEFAULT_LATENCY;
+    int timeout = DEFAULT_TIMEOUT;
+    recv_msg *msgs;
+    int rc;
 
-#ifdef DEBUG
-    setlogmask (LOG_UPTO (LOG_NOTICE));
-    openlog (LIBNAME, LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-#endif
 
     *is_null = 0;
     *error = 0;
 
-    qos         = DEFAULT_QOS;
-    timeout     = DEFAULT_TIMEOUT;
-
-    switch (conn->mqtt_subscribe_format) {
-        //~ 8: mqtt_subscribe(client, topic, [qos], [timeout], [options])
-        case 8:
-            options     = args->args[4]!=NULL ? (char *)args->args[4] : "";
-        //~ 7: mqtt_subscribe(client, topic, [qos], [timeout])
-        case 7:
-            timeout     = args->args[3]!=NULL ? (int)*((longlong*)args->args[3]) : DEFAULT_TIMEOUT;
-        //~ 6: mqtt_subscribe(client, topic, [qos])
-        case 6:
-            qos         = args->args[2]!=NULL ? (int)*((longlong*)args->args[2]) : DEFAULT_QOS;
-        //~ 5: mqtt_subscribe(client, topic)
-        case 5:
-            topic       = (char *)args->args[1];
-            topiclengths= args->args[1]!=NULL ? args->lengths[1] : 0;
-            conn->client= (MQTTClient)*(longlong*)args->args[0];
-            break;
-        //~ 4: mqtt_subscribe(server, [username], [password], topic, [qos], [timeout], [options])
-        case 4:
-            options     = args->args[6]!=NULL ? (char *)args->args[6] : "";
-        //~ 3: mqtt_subscribe(server, [username], [password], topic, [qos], [timeout])
-        case 3:
-            timeout     = args->args[5]!=NULL ? (int)*((longlong*)args->args[5]) : DEFAULT_TIMEOUT;
-        //~ 2: mqtt_subscribe(server, [username], [password], topic [qos])
-        case 2:
-            qos         = args->args[4]!=NULL ? (int)*((longlong*)args->args[4]) : DEFAULT_QOS;
-        //~ 1: mqtt_subscribe(server, [username], [password], topic)
-        case 1:
-            topic       = (char *)args->args[3];
-            topiclengths= args->args[3]!=NULL ? args->lengths[3] : 0;
-            password    = (char *)args->args[2];
-            username    = (char *)args->args[1];
-            address      = (char *)args->args[0];
-            break;
-        default:
-            break;
+    if (args->arg_count >= 3 && args->args[2]!=NULL && *((longlong*)args->args[2]) > 0) {
+        max = (int)*((longlong*)args->args[2]);
     }
-
-    // Do not assume that the string is null-terminated
-    // see https://dev.mysql.com/doc/refman/5.7/en/udf-arguments.html
-    switch (conn->mqtt_subscribe_format) {
-        case 8:
-            if (args->args[4]!=NULL) options[args->lengths[4]]  = '\0';
-        case 7:
-        case 6:
-        case 5:
-            if (args->args[1]!=NULL) topic[args->lengths[1]]    = '\0';
-            strcpy(last_func, "mqtt_subscribe");
-            conn->rc = last_rc = (conn->client!=NULL) ? MQTTCLIENT_SUCCESS : MQTTCLIENT_DISCONNECTED;
-            break;
-        case 4:
-            if (args->args[6]!=NULL) options[args->lengths[6]]  = '\0';
-        case 3:
-        case 2:
-        case 1:
-            if (args->args[0]!=NULL) address[args->lengths[0]]  = '\0';
-            if (args->args[1]!=NULL) username[args->lengths[1]] = '\0';
-            if (args->args[2]!=NULL) password[args->lengths[2]] = '\0';
-            if (args->args[3]!=NULL) topic[args->lengths[3]]    = '\0';
-
-            strcpy(last_func, "MQTTClient_create");
-            conn->rc = last_rc = MQTTClient_create(&conn->client, address, GetUUID(), MQTTCLIENT_PERSISTENCE_NONE, NULL);
-            if (conn->rc == MQTTCLIENT_SUCCESS) {
-#ifdef DEBUG
-                syslog (LOG_NOTICE, "mqtt_subscribe(): username=\"%s\", password=\"%s\", options='%s'", username, password, options);
-#endif
-                create_conn(conn, username, password, options);
-
-                strcpy(last_func, "MQTTClient_connect");
-                conn->rc = last_rc = MQTTClient_connect(conn->client, &conn->conn_opts);
-#ifdef DEBUG
-                syslog (LOG_NOTICE, "mqtt_subscribe(): client=%p, rc=%d", conn->client, conn->rc);
-#endif
-            }
-            break;
+    if (args->arg_count >= 4 && args->args[3]!=NULL && *((longlong*)args->args[3]) >= 0) {
+        latency = (int)*((longlong*)args->args[3]);
     }
-
-    if (conn->rc == MQTTCLIENT_SUCCESS) {
-        MQTTClient_message *submsg = NULL;
-        int rc;
-
-#ifdef DEBUG
-        syslog (LOG_NOTICE, "mqtt_subscribe '%s'", topic);
-#endif
-        strcpy(last_func, "MQTTClient_subscribe");
-        rc = last_rc = MQTTClient_subscribe(conn->client, topic, qos);
-        if (rc == MQTTCLIENT_SUCCESS) {
-#ifdef DEBUG
-            syslog (LOG_NOTICE, "mqtt_subscribe MQTTClient_receive() returned %sdata, rc=%d", submsg != NULL ? "":"no ", rc);
-#endif
-            strcpy(last_func, "MQTTClient_receive");
-            rc = last_rc = MQTTClient_receive(conn->client, &topic, &topiclengths, &submsg, timeout);
-#ifdef DEBUG
-            syslog (LOG_NOTICE, "mqtt_subscribe MQTTClient_receive() returned %sdata, rc=%d", submsg != NULL ? "":"no ", rc);
-#endif
-            if ((rc == MQTTCLIENT_SUCCESS) && (submsg != NULL)) {
-#ifdef DEBUG
-                syslog (LOG_NOTICE, "mqtt_subscribe payload returned bytes %d", submsg->payloadlen);
-#endif
-                memcpy(result, submsg->payload, submsg->payloadlen);
-                *length = submsg->payloadlen;
-                MQTTClient_freeMessage(&submsg);
-            }
-            else {
-                *result = '\0';
-                *is_null = 1;
-                *error = 1;
-
-            }
-        }
-        else {
-            *result = '\0';
-            *is_null = 1;
-            *error = 1;
-        }
+    if (args->arg_count >= 5 && args->args[4]!=NULL && *((longlong*)args->args[4]) >= 0) {
+        timeout = (int)*((longlong*)args->args[4]);
     }
 
-    if (conn->rc == MQTTCLIENT_SUCCESS) {
-        switch (conn->mqtt_subscribe_format) {
-            case 1:
-            case 2:
-            case 3:
-    #ifdef DEBUG
-                syslog (LOG_NOTICE, "mqtt_subscribe() disconnnect - client=%p, rc=%d", conn->client, conn->rc);
-    #endif
-                MQTTClient_disconnect(conn->client, timeout);
-                MQTTClient_destroy(&conn->client);
-                break;
-        }
+    last_func = "mqtt_consume";
+    last_rc = sess == NULL ? MQTTCLIENT_NULL_PARAMETER : MQTTCLIENT_FAILURE;
+    rc = sess != NULL && session_recv_max(sess) > 0 ? MQTTCLIENT_SUCCESS : last_rc;
+    if (rc == MQTTCLIENT_SUCCESS && args->args[1] != NULL) {
+        rc = consume_subscribe(sess, args->args[1], args->lengths[1]);
     }
-    else {
-        *result = '\0';
+    if (rc == MQTTCLIENT_SUCCESS) {
+        msgs = session_receive(sess, max, latency, timeout);
+        last_func = "mqtt_consume";
+        rc = last_rc = recv_json(sb, msgs) ? MQTTCLIENT_SUCCESS : MQTTCLIENT_FAILURE;
+        recv_free(msgs);
+    }
+    if (sess != NULL) {
+        session_lasterror(sess);
+        session_put(sess);
+    }
+    TRACE(TRACE_DEBUG, "mqtt_consume(): %lu bytes, rc=%d", (unsigned long)sb->len, rc);
+    if (rc != MQTTCLIENT_SUCCESS) {
+        *is_null = 1;
         *error = 1;
+        return NULL;
     }
-
-#ifdef DEBUG
-    closelog ();
-#endif
-
-    return result;
+    *length = sb->len;
+    return sb->buf;
 }
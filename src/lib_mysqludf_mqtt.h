@@ -6,11 +6,62 @@
 #define DEFAULT_RETAINED            0       // default MQTT retain
 #define DEFAULT_TIMEOUT             5000L   // default MQTT timeout
 #define DEFAULT_KEEPALIVEINTERVAL   20      // default MQTT keepalive
+#define DEFAULT_MAX_INFLIGHT        10      // default max in-flight messages of async handles
 
-#define UUID_LEN                    8       // number of hex chars for MQTT unique client id
+#define POOL_MAX_PER_KEY            8       // max idle pooled connections per server/user/options
+#define POOL_IDLE_TIMEOUT           60      // max seconds a pooled connection stays idle
+
+#define QUEUE_DEFAULT_SIZE          4096    // default capacity of the background publisher queue
+#define QUEUE_IDLE_WAIT             100     // max ms the publisher thread sleeps if queue is empty
+#define QUEUE_RECONNECT_WAIT        1000    // ms between publisher reconnect attempts
+#define QUEUE_DEFAULT_BATCH         256     // default max messages published with one completion wait
+
+#define RECONNECT_DEFAULT_DELAY     1000    // default ms before the first automatic reconnect attempt
+#define RECONNECT_DEFAULT_MAX_DELAY 60000   // default max ms between automatic reconnect attempts
+#define OFFLINE_DEFAULT_BUFFER      1000    // default max QoS 1/2 messages buffered while reconnecting
+
+#define PLOG_DEFAULT_SIZE           (16L << 20) // default preallocated size of a persistence log
+#define PLOG_DEFAULT_SYNC           100     // default max ms between syncs of a persistence log
+#define PLOG_BUCKETS                256     // hash buckets of persisted keys
+#define PLOG_ALIGN                  8       // alignment of persistence log records
+
+#define REGISTRY_SHARDS             16      // independently locked handle registry parts
+#define REGISTRY_SLAB_SIZE          256     // handle slots allocated at once
+#define REGISTRY_MAX_SLABS          256     // max slabs per shard
+
+#define NAMED_BUCKETS               64      // hash buckets of named connections
+
+#define RECEIVE_DEFAULT_MAX         100     // default max messages returned by mqtt_receive()
+#define CONSUME_DEFAULT_LATENCY     1000    // default max ms mqtt_consume() waits for a full batch
+#define CONSUME_QOS                 1       // QoS of mqtt_consume() subscriptions
+#define RECEIVE_MAX_LENGTH          16777215L // max result length of mqtt_receive() and mqtt_subscribe()
+
+#define TOPIC_ALIAS_DEFAULT_MAX     256     // default max MQTT 5 topic aliases used per connection
+
+#define COMPRESS_MARKER             0x00    // first byte of a compressed payload
+#define COMPRESS_HEADER_LEN         5       // marker and big-endian uncompressed length
+
+#define STATS_RC_MAX                32      // errors are counted per rc -1..-31, others together
+#define HIST_SUB_BITS               3       // latency histogram: 8 buckets per power of 2 (max error 12.5%)
+#define HIST_BUCKETS                256     // latency histogram buckets, up to 2^34 us
+
+#define UUID_LEN                    16      // number of hex chars for MQTT unique client id
+#define CLIENT_ID_SIZE              (sizeof(LIBNAME) + sizeof(LIBVERSION) + UUID_LEN + 1)
 #define MAX_RET_STRLEN              2048    // max string length returned by functions using strings
 
-//#define DEBUG                       // debug output via syslog
+// trace levels, see mqtt_trace()
+#define TRACE_OFF               0
+#define TRACE_ERROR             1
+#define TRACE_INFO              2
+#define TRACE_DEBUG             3
+
+#ifndef TRACE_MAX_LEVEL
+#define TRACE_MAX_LEVEL         TRACE_DEBUG // trace calls above this level are not compiled in
+#endif
+#define TRACE_RING_SIZE         256     // trace records kept per thread, power of 2
+#define TRACE_MSG_LEN           104     // max trace message length including NUL
+
+//#define DEBUG                       // trace level debug at load, trace records mirrored to syslog
 
 #if defined(_WIN32) || defined(_WIN64) || defined(__WIN32__) || defined(WIN32)
 #define DLLEXP __declspec(dllexport)
@@ -27,7 +78,7 @@ typedef unsigned long long ulonglong;
 typedef long long longlong;
 #endif  // __WIN__
 
-// get_json_value() return codes
+// parse_options() return codes
 #define JSON_OK                  0
 #define JSON_ERROR_EMPTY_STR    -1
 #define JSON_ERROR_INVALID_STR  -2
@@ -36,17 +87,485 @@ typedef long long longlong;
 #define JSON_ERROR_NOT_FOUND    -5
 
 
+#define OPTION_UNSET            -1L     // mqtt_options integer/boolean not given
+
+
+/* Typed content of the options JSON string (see mqtt_connect()) */
+typedef struct MQTT_OPTIONS {
+    json_value *json;                   // parsed document, owner of all strings below
+    // Connection options
+    const char *username;
+    const char *password;
+    long keepAliveInterval;
+    long cleansession;
+    long MQTTVersion;
+    long reliable;
+    long connectTimeout;
+    long maxInflightMessages;
+    const char *clientId;
+    // SSL options
+    const char *CApath;
+    const char *CAfile;
+    const char *keyStore;
+    const char *privateKey;
+    const char *privateKeyPassword;
+    const char *enabledCipherSuites;
+    long verify;
+    long enableServerCertAuth;
+    long sslVersion;
+    // Last Will and Testament options
+    const char *willTopic;
+    const char *willMessage;
+    long willRetained;
+    long willQos;
+    // Library options
+    long pool;
+    long async;
+    long queueSize;
+    const char *queueOverflow;
+    long queueBatch;
+    long queueLinger;
+    long coalesceWindow;
+    long receiveQueue;
+    long maxPayload;
+    const char *shareGroup;
+    long compress;
+    long compressLevel;
+    const char *compressDict;
+    long reconnect;
+    long reconnectDelay;
+    long reconnectMaxDelay;
+    long offlineBuffer;
+    const char *persistence;
+    long persistenceSize;
+    long persistenceSync;
+    // MQTT 5 options
+    long messageExpiry;
+    const char *contentType;
+    json_value *userProperties;
+    long topicAliasMaximum;
+} mqtt_options;
+
+/* Payload compression settings, see payload_deflate() */
+typedef struct COMPRESSION {
+    long threshold;                     // min payload size compressed, 0 disables compression
+    int level;                          // zlib compression level
+    const char *dict;                   // preset dictionary or NULL
+    unsigned int dict_len;
+} compression;
+
+/* Message received by a streaming subscription, see session_message_arrived() */
+typedef struct RECV_MSG {
+    struct RECV_MSG *next;
+    char *topic;                        // owned by Paho, free with MQTTClient_free()
+    int topiclen;
+    MQTTClient_message *message;        // owned by Paho, free with MQTTClient_freeMessage()
+    char *payload;                      // message payload or its decompressed copy
+    int payloadlen;
+} recv_msg;
+
+// counters of client_stats
+#define STAT_PUBLISHED          0       // messages published
+#define STAT_PUBLISHED_BYTES    1       // payload bytes published
+#define STAT_RECEIVED           2       // messages received
+#define STAT_RECEIVED_BYTES     3       // payload bytes received
+#define STAT_ERRORS             4       // failed client calls
+#define STAT_COUNTERS           5
+
+// latency histograms of client_stats
+#define HIST_CONNECT            0       // connect
+#define HIST_PUBLISH            1       // publish call
+#define HIST_WAIT               2       // wait for completion
+#define HIST_TYPES              3
+
+/* Log-linear latency histogram in us, see hist_index() */
+typedef struct HISTOGRAM {
+    atomic_ulong count;
+    atomic_ulong sum;
+    atomic_ulong max;
+    atomic_ulong buckets[HIST_BUCKETS];
+} histogram;
+
+/* Lock-free statistics of a handle or of the whole library */
+typedef struct CLIENT_STATS {
+    atomic_ulong counters[STAT_COUNTERS];
+    atomic_ulong errors[STATS_RC_MAX];  // failed client calls by -rc, 0 for other rc
+    histogram latency[HIST_TYPES];
+} client_stats;
+
+/* MQTT 5 topic alias of a session, see session_publish_message() */
+typedef struct TOPIC_ALIAS {
+    char *topic;                        // NULL if unused
+    unsigned int hash;                  // hash of topic
+    int alias;
+    bool established;                   // sent along with the topic name on the current connection
+} topic_alias;
+
+/* Trace record, see trace_write() */
+typedef struct TRACE_RECORD {
+    atomic_ulong seq;                   // odd while written, see trace_collect()
+    uint64_t time;                      // us since the epoch
+    int tid;                            // OS thread id
+    int level;
+    char msg[TRACE_MSG_LEN];
+} trace_record;
+
+/* Lock-free trace ring buffer written by its owning thread only */
+typedef struct TRACE_RING {
+    struct TRACE_RING *next;            // list of all rings, never unlinked
+    atomic_int in_use;                  // owned by a thread
+    unsigned long pos;                  // next write position
+    trace_record records[TRACE_RING_SIZE];
+} trace_ring;
+
+/* Topic alias of a constant topic cached per statement, see session_publish_message() */
+typedef struct TOPIC_CACHE {
+    unsigned int hash;                  // hash of the topic
+    unsigned long epoch;                // connection the alias was established on, 0 if none
+    int alias;
+} topic_cache;
+
+/* Persistent subscription of a session */
+typedef struct SUBSCRIPTION {
+    struct SUBSCRIPTION *next;
+    int qos;
+    char topic[];
+} subscription;
+
+/* QoS 1/2 message published by a handle while it is reconnected */
+typedef struct OFFLINE_MSG {
+    struct OFFLINE_MSG *next;
+    char *payload;                      // points behind topic
+    int payloadlen;
+    int qos;
+    int retained;
+    char topic[];
+} offline_msg;
+
+// persistence log record types
+#define PLOG_PUT                1
+#define PLOG_REMOVE             2
+
+/* Record of a persistence log, followed by the key and the data */
+typedef struct PLOG_RECORD {
+    uint32_t len;                       // key and data length, 0 ends the log; written last
+    uint32_t crc;                       // crc32 of the members below, key and data
+    uint16_t keylen;
+    uint8_t type;                       // PLOG_PUT or PLOG_REMOVE
+    uint8_t reserved;
+} plog_record;
+
+/* Persisted key, refers to its last PLOG_PUT record */
+typedef struct PLOG_KEY {
+    struct PLOG_KEY *next;
+    size_t offset;                      // of the record within the log
+    unsigned int hash;
+    char key[];
+} plog_key;
+
+/* Settings passed by client_create() to plog_open() */
+typedef struct PLOG_CONFIG {
+    const char *dir;                    // directory of the log files
+    size_t size;                        // initial file size
+    long sync;                          // max ms between syncs, 0 syncs every put
+} plog_config;
+
+/* Paho user persistence of a session, see client_create() */
+typedef struct PLOG_PERSISTENCE {
+    MQTTClient_persistence persistence;
+    plog_config config;                 // context of persistence
+    char dir[];
+} plog_persistence;
+
+/* Memory-mapped append log used as Paho client persistence, see plog_open() */
+typedef struct PLOG {
+    pthread_mutex_t mutex;
+    char *path;
+    int fd;
+    char *map;                          // the whole file mapped shared
+    size_t size;                        // file size
+    size_t end;                         // append position
+    size_t synced;                      // records up to here are on disk
+    long sync;
+    uint64_t last_sync;                 // stats_clock() of the last sync
+    int count;                          // number of keys
+    plog_key *keys[PLOG_BUCKETS];
+    struct PLOG *next;                  // open logs synced by plog_run()
+} plog;
+
+/* Connect options owning all their strings, see connect_keep() */
+typedef struct CONNECT_COPY {
+    MQTTClient_connectOptions conn_opts;
+    MQTTClient_SSLOptions ssl_opts;
+    MQTTClient_willOptions will_opts;
+    char strings[];
+} connect_copy;
+
+/* Growing result buffer for string functions */
+typedef struct STRBUF {
+    char *buf;
+    size_t size;                        // allocated size
+    size_t len;                         // used length
+} strbuf;
+
+/* Library side state of a client handle returned by mqtt_connect() */
+typedef struct SESSION {
+    atomic_int refs;                    // references held by registry and callers
+    MQTTClient client;
+    bool async;                         // mqtt_publish() does not wait for completion
+    int max_inflight;                   // max unconfirmed async QoS 1/2 messages
+    pthread_mutex_t mutex;              // protects the members below
+    pthread_cond_t cond;                // signaled on delivery and connection loss
+    int inflight;                       // unconfirmed async QoS 1/2 messages
+    unsigned long delivered;            // async messages confirmed by the broker
+    unsigned long failed;               // async messages failed or lost
+    unsigned long losses;               // connections lost
+    int rc;                             // rc of last async failure
+    const char *last_func;              // last function called using this handle
+    int last_rc;                        // rc of last_func
+    int recv_max;                       // max queued received messages, 0 discards them
+    int recv_count;                     // queued received messages
+    recv_msg *recv_head;                // queue of received messages
+    recv_msg *recv_tail;
+    unsigned long received;             // messages received by subscriptions
+    unsigned long recv_dropped;         // received messages dropped on a full receive queue
+    subscription *subs;                 // persistent subscriptions (topic filters)
+    char *share_group;                  // subscriptions are shared within this group or NULL
+    long max_payload;                   // max payload returned by mqtt_subscribe(), 0 default
+    compression compress;               // payload compression of publish and subscribe
+    char *compress_dict;                // owned copy of compress.dict
+    int version;                        // MQTT version of client
+    MQTTProperties props;               // MQTT 5 properties of published messages
+    pthread_mutex_t alias_mutex;        // protects the topic aliases
+    topic_alias *aliases;               // MQTT 5 topic aliases of the current connection
+    size_t aliases_mask;                // aliases table size - 1
+    int alias_limit;                    // max aliases used per connection (option topicAliasMaximum)
+    int alias_max;                      // max aliases of the current connection
+    int alias_count;                    // aliases assigned on the current connection
+    bool alias_qos0;                    // only QoS 0 messages use aliases, see session_mqtt5()
+    atomic_ulong alias_epoch;           // unique number of the current connection, see session_connected()
+    unsigned long serial;               // unique number of the session
+    client_stats stats;
+    char *server;                       // server URI, see mqtt_connections()
+    char *client_id;                    // MQTT client id
+    plog_persistence *persistence;      // persistence of client or NULL
+    time_t created;                     // time the session was connected
+    atomic_llong last_used;             // time of the last session_get()
+    // automatic reconnect (option reconnect), see reconnect_run()
+    bool reconnect;
+    connect_copy *connect;              // options of reconnects
+    long reconnect_delay;               // ms before the first attempt, doubled per failed one
+    long reconnect_max_delay;
+    long delay;                         // current delay, reconnect thread only
+    struct timespec retry;              // time of the next attempt, under reconnect_mutex
+    struct SESSION *reconnect_next;     // list of sessions to reconnect, under reconnect_mutex
+    atomic_int offline;                 // connection lost, set until reconnected and the buffer is replayed
+    atomic_int closed;                  // released by mqtt_disconnect()
+    unsigned long reconnects;           // successful automatic reconnects
+    int offline_max;                    // max buffered messages (option offlineBuffer)
+    int offline_count;                  // buffered messages
+    offline_msg *offline_head;          // messages published while offline
+    offline_msg *offline_tail;
+} session;
+
+/* Handle registry slot, see registry_add() */
+typedef struct REGISTRY_SLOT {
+    session *sess;                      // NULL if unused
+    uint32_t gen;                       // generation encoded into the handle
+    int next_free;                      // next unused slot index or -1
+} registry_slot;
+
+/* Handle registry shard with its own lock and slab allocated slots */
+typedef struct REGISTRY_SHARD {
+    pthread_mutex_t mutex;
+    registry_slot *slabs[REGISTRY_MAX_SLABS];
+    int nslabs;
+    int free_head;                      // first unused slot index or -1
+} registry_shard;
+
+/* Connection opened by mqtt_open(), see named_add() */
+typedef struct NAMED_ENTRY {
+    struct NAMED_ENTRY *next;
+    longlong handle;
+    unsigned int hash;                  // hash of name
+    size_t name_len;
+    char name[];
+} named_entry;
+
+/* Registered session listed by mqtt_connections() */
+typedef struct LIVE_SESSION {
+    longlong handle;
+    session *sess;                      // additional reference
+    named_entry *named;                 // name given by mqtt_open() or NULL, valid while named_lock is held
+} live_session;
+
+/* Message collected by mqtt_publish_batch(), topic and payload are arena offsets */
+typedef struct BATCH_MSG {
+    size_t topic;                       // NUL-terminated topic
+    size_t payload;
+    int payloadlen;
+    int qos;
+    int retained;
+} batch_msg;
+
+/* Aggregate state of mqtt_publish_batch() */
+typedef struct BATCH {
+    longlong handle;                    // handle of the first row of the group
+    session *sess;                      // session of handle
+    char *arena;                        // topics and payloads of all messages
+    size_t arena_len;
+    size_t arena_size;
+    batch_msg *msgs;
+    int count;
+    int size;
+    int rejected;                       // rows not collected (NULL or other handle)
+    int timeout;
+    strbuf packed;                      // compressed payload of the current row
+} batch;
+
+/* Idle connection within the server-form connection pool */
+typedef struct POOL_ENTRY {
+    struct POOL_ENTRY *next;
+    MQTTClient client;
+    time_t last_used;                   // time the connection was returned to the pool
+    int keepalive;                      // keepalive interval of the connection (s)
+    unsigned int hash;                  // hash of key
+    size_t key_len;
+    char key[];                         // server, username, password and options
+} pool_entry;
+
+/* Handle opened by a mqtt_connect() statement, reused for identical arguments */
+typedef struct CONNECT_ENTRY {
+    struct CONNECT_ENTRY *next;
+    longlong handle;
+    unsigned int hash;                  // hash of key
+    size_t key_len;
+    char key[];                         // server, username, password and options
+} connect_entry;
+
+// argument kinds of a call form, see plan_compile()
+#define ARG_SERVER              0       // NUL-terminated copies: ARG_SERVER..ARG_PAYLOAD
+#define ARG_USERNAME            1
+#define ARG_PASSWORD            2
+#define ARG_TOPIC               3
+#define ARG_PAYLOAD             4
+#define ARG_QOS                 5       // integers: ARG_QOS..ARG_TIMEOUT
+#define ARG_RETAINED            6
+#define ARG_TIMEOUT             7
+#define ARG_HANDLE              8       // read from args by session_arg()
+#define ARG_OPTIONS             9       // read from args by row_options()
+#define ARG_KINDS               10
+
+/* Argument kinds of a call signature in order, the first min are mandatory */
+typedef struct CALL_FORM {
+    int min;
+    int max;
+    int kinds[ARG_KINDS];
+} call_form;
+
+/* Argument of a call plan */
+typedef struct PLAN_ARG {
+    int index;                          // argument index or -1 if omitted
+    bool constant;                      // value resolved by plan_compile()
+    longlong value;                     // integer value, default if omitted or NULL
+    const char *str;                    // string value or NULL
+    unsigned long len;                  // length of str
+} plan_arg;
+
+/* Call signature of a statement compiled by plan_compile() */
+typedef struct CALL_PLAN {
+    bool server_form;                   // server, username and password instead of handle
+    plan_arg arg[ARG_KINDS];            // by kind
+    int vars[ARG_KINDS];                // kinds of the variable arguments bound per row
+    int nvars;
+    char *consts;                       // copies of the constant strings
+    strbuf row;                         // copies of the variable strings of the current row
+} call_plan;
+
 /* MQTT connection information for MySQL UDF */
 typedef struct CONNECTION {
     MQTTClient client;
     MQTTClient_connectOptions conn_opts;
     MQTTClient_SSLOptions ssl_opts;
     MQTTClient_willOptions will_opts;
-    int mqtt_publish_format;
-    int mqtt_subscribe_format;
+    mqtt_options options;               // options parsed once if argument is constant
+    bool options_const;                 // options are constant for the whole statement
+    int options_arg;                    // argument index of options or -1
+    char *poolkey;                      // pool key of current row (see pool_key())
+    size_t poolkey_size;                // allocated size of poolkey
+    size_t poolkey_len;                 // used length of poolkey
+    unsigned int poolhash;              // hash of poolkey
+    connect_entry *connected;           // handles returned by this mqtt_connect() statement
+    call_plan plan;                     // signature of mqtt_publish() and mqtt_subscribe()
+    recv_msg *held;                     // message whose payload mqtt_subscribe() returned
+    strbuf packed;                      // compressed payload of the current row
+    unsigned long packed_key;           // session serial or 1 (options) packed is valid for if payload is constant
+    bool packed_deflated;               // packed holds the compressed constant payload
+    topic_cache topic;                  // topic alias of a constant topic
     int rc;
 } connection;
 
+// background publisher states
+#define QUEUE_STOPPED           0
+#define QUEUE_RUNNING           1
+#define QUEUE_STOPPING          2
+
+// background publisher queue overflow policies
+#define QUEUE_OVERFLOW_BLOCK    0       // wait up to DEFAULT_TIMEOUT for free space
+#define QUEUE_OVERFLOW_DROP     1       // discard the oldest messages
+#define QUEUE_OVERFLOW_ERROR    2       // reject the new message
+
+/* Message queued by mqtt_enqueue() */
+typedef struct QUEUE_MSG {
+    char *payload;                      // points behind topic
+    int payloadlen;
+    int qos;
+    int retained;
+    int coalesce;                       // only the last message per topic within a batch is published
+    unsigned int hash;                  // hash of topic
+    char topic[];
+} queue_msg;
+
+typedef struct QUEUE_CELL {
+    atomic_size_t seq;
+    queue_msg *msg;
+} queue_cell;
+
+/* Background publisher draining the mqtt_enqueue() queue */
+typedef struct PUBLISHER {
+    atomic_int state;                   // QUEUE_STOPPED, QUEUE_RUNNING or QUEUE_STOPPING
+    atomic_int producers;               // threads within mqtt_enqueue()
+    queue_cell *cells;
+    size_t mask;                        // capacity - 1
+    int overflow;                       // QUEUE_OVERFLOW_*
+    _Alignas(64) atomic_size_t head;    // next enqueue position
+    _Alignas(64) atomic_size_t tail;    // next dequeue position
+    _Alignas(64) atomic_ulong enqueued;
+    atomic_ulong published;
+    atomic_ulong dropped;
+    atomic_ulong failed;
+    atomic_ulong batches;               // published batches
+    atomic_ulong coalesced;             // messages replaced by a later one of the same topic
+    queue_msg **batch;                  // messages taken by the publisher thread
+    MQTTClient_deliveryToken *tokens;   // delivery tokens of batch
+    int batch_max;                      // max messages per batch
+    int linger;                         // max ms to wait for a fuller batch
+    int *slots;                         // coalescing hash table of batch indexes or NULL
+    size_t slots_mask;                  // coalescing hash table size - 1
+    session *sess;                      // long-lived async connection
+    strbuf packed;                      // compressed payload of the message being published
+    connection conn;                    // connect options used for reconnect
+    mqtt_options options;
+    char *username;
+    char *password;
+    pthread_t thread;
+    pthread_mutex_t mutex;              // used for waits only
+    pthread_cond_t cond;
+    atomic_int sleeping;                // publisher thread waits on cond
+    pthread_cond_t space;               // signaled when messages are taken or the last producer leaves
+    atomic_int blocked;                 // producers waiting on space
+} publisher;
+
 #ifdef __cplusplus
 extern "C" {
 #endif  // __cplusplus
@@ -66,13 +585,85 @@ DLLEXP char* mqtt_info(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned
  * mqtt_lasterror
  *
  * Returns last error as JSON string
- * mqtt_lasterror()
+ * mqtt_lasterror({handle})
  *
+ * Without handle the last error of the current session is returned,
+ * otherwise the last error of the last call using the given handle or
+ * connection name.
  */
 DLLEXP bool mqtt_lasterror_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
 DLLEXP void mqtt_lasterror_deinit(UDF_INIT *initid);
 DLLEXP char* mqtt_lasterror(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error);
 
+
+/**
+ * mqtt_stats
+ *
+ * Returns statistics as JSON string
+ * mqtt_stats({handle})
+ *
+ *      handle      BIGINT or String
+ *                  Client handle or connection name, without handle the
+ *                  statistics of all connections of the library
+ *
+ * Counts published and received messages and payload bytes, failed calls
+ * by rc and the latency of connect, publish and wait for completion as
+ * histogram (count, mean, p50, p90, p99, p999 and max in us).
+ */
+DLLEXP bool mqtt_stats_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+DLLEXP void mqtt_stats_deinit(UDF_INIT *initid);
+DLLEXP char* mqtt_stats(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error);
+
+/**
+ * mqtt_connections
+ *
+ * Returns all live broker connections of the library as JSON array
+ * mqtt_connections()
+ *
+ * Lists handles of mqtt_connect() and mqtt_open() ("type":"handle"),
+ * the background publisher ("type":"queue") and idle pooled connections
+ * ("type":"pool") with server, client id, state, in-flight messages,
+ * receive queue depth, bytes in/out, last error and age. Use JSON_TABLE()
+ * to query it as table.
+ */
+DLLEXP bool mqtt_connections_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+DLLEXP void mqtt_connections_deinit(UDF_INIT *initid);
+DLLEXP char* mqtt_connections(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error);
+
+/**
+ * mqtt_trace
+ *
+ * Returns the trace level and sets a new one
+ * mqtt_trace({level})
+ *
+ *      level       INT or String
+ *                  0 or 'off', 1 or 'error', 2 or 'info', 3 or 'debug'
+ *
+ * Trace records are written into an in-memory ring buffer per thread
+ * without locks, only calls up to the level are recorded. Returns the
+ * previous level or NULL for an invalid level.
+ */
+DLLEXP bool mqtt_trace_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+DLLEXP void mqtt_trace_deinit(UDF_INIT *initid);
+DLLEXP ulonglong mqtt_trace(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error);
+
+/**
+ * mqtt_trace_dump
+ *
+ * Returns the recorded trace of all threads as JSON array
+ * mqtt_trace_dump({clear})
+ *
+ *      clear       INT - default 0
+ *                  1 skips the returned records in later dumps
+ *
+ * Records are ordered by time, each with time (us since the epoch),
+ * thread (OS thread id), level and msg. Every thread keeps its last
+ * TRACE_RING_SIZE records.
+ */
+DLLEXP bool mqtt_trace_dump_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+DLLEXP void mqtt_trace_dump_deinit(UDF_INIT *initid);
+DLLEXP char* mqtt_trace_dump(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error);
+
 /**
  * mqtt_connect
  *
@@ -149,6 +740,20 @@ DLLEXP char* mqtt_lasterror(UDF_INIT *initid, UDF_ARGS *args, char* result, unsi
  *                      3 = MQTTVERSION_3_1
  *                      4 = MQTTVERSION_3_1_1
  *                      5 = MQTTVERSION_5
+ *                  "messageExpiry": integer
+ *                      MQTT 5 only: Message expiry interval in seconds of
+ *                      published messages.
+ *                  "contentType": String
+ *                      MQTT 5 only: Content type of published messages.
+ *                  "userProperties": object
+ *                      MQTT 5 only: User properties (name: String value)
+ *                      added to published messages.
+ *                  "topicAliasMaximum": integer
+ *                      MQTT 5 only: Max topic aliases used per connection
+ *                      of a handle, limited by the topic alias maximum of
+ *                      the server (default 256, 0 disables topic aliases).
+ *                      With "cleansession": false or "persistence" only
+ *                      QoS 0 messages use aliases.
  *                  "maxInflightMessages": integer
  *                      The maximum number of messages in flight
  *                  "willTopic": String
@@ -159,8 +764,77 @@ DLLEXP char* mqtt_lasterror(UDF_INIT *initid, UDF_ARGS *args, char* result, unsi
  *                      The retained flag for the LWT messag
  *                  "willQos": integer
  *                      The quality of service setting for the LWT message
+ *                  "async": bool
+ *                      mqtt_publish() using the returned handle returns as
+ *                      soon as the message is queued without waiting for
+ *                      its completion. The number of unconfirmed QoS 1/2
+ *                      messages is limited by "maxInflightMessages"
+ *                      (default 10). Use mqtt_async_status() to get the
+ *                      delivery results. mqtt_subscribe() can't be used
+ *                      with an async handle unless "receiveQueue" is set.
+ *                  "receiveQueue": integer
+ *                      Streaming mode: subscriptions made by mqtt_subscribe()
+ *                      using the returned handle are kept and received
+ *                      messages are queued (up to the given number) in the
+ *                      background. Drain the queue with mqtt_receive() or
+ *                      mqtt_subscribe(). If the queue is full, the Paho
+ *                      client holds back further messages.
+ *                  "shareGroup": String
+ *                      Subscriptions made using the returned handle are
+ *                      shared subscriptions "$share/<group>/<topic>":
+ *                      the server delivers each message to only one of the
+ *                      clients subscribed within the group.
+ *                  "maxPayload": integer
+ *                      Only used by mqtt_subscribe(): Max payload size
+ *                      returned (default 16 MB), larger payloads return NULL.
+ *                      The message was acknowledged already and is lost
+ *                      even with QoS 1/2 (at most once).
+ *                  "compress": integer
+ *                      Compress published payloads of at least the given
+ *                      size using zlib deflate, prefixed by a marker byte
+ *                      and the uncompressed length. Marked payloads are
+ *                      decompressed by mqtt_subscribe(), mqtt_receive()
+ *                      and mqtt_consume() independent of this option.
+ *                  "compressLevel": integer
+ *                      zlib compression level 0..9 (default 6).
+ *                  "compressDict": String
+ *                      Preset dictionary for compression and decompression,
+ *                      e.g. typical JSON keys of small payloads. Publisher
+ *                      and subscriber must use the same dictionary.
+ *                  "queueSize": integer
+ *                      Only used by mqtt_queue_start(): Capacity of the
+ *                      background publisher queue (default 4096, rounded
+ *                      up to a power of 2).
+ *                  "queueOverflow": String
+ *                      Only used by mqtt_queue_start(): Policy if the queue
+ *                      is full: "block" (wait up to 5 s, default), "drop"
+ *                      (discard the oldest messages) or "error".
+ *                  "queueBatch": integer
+ *                      Only used by mqtt_queue_start(): Max messages
+ *                      published with a single completion wait (default 256).
+ *                  "queueLinger": integer
+ *                      Only used by mqtt_queue_start(): Max ms to wait for
+ *                      further messages to fill a batch (default 0).
+ *                  "coalesceWindow": integer
+ *                      Only used by mqtt_queue_start(): Hold messages back
+ *                      up to the given ms; within a batch only the last
+ *                      retained or coalesce flagged message per topic is
+ *                      published (last value wins).
+ *                  "pool": bool
+ *                      Only used by mqtt_publish() called with server:
+ *                      Keep the connection in a process-wide pool for reuse
+ *                      by later calls with the same server, username,
+ *                      password and options (default true).
  *
  *  returns valid handle or 0 on errors
+ *
+ * Rows of the same statement using identical arguments return the same
+ * handle, reconnecting it if the connection was lost. The handles are
+ * owned by the caller and must be freed by mqtt_disconnect().
+ *
+ * Handles are validated on each use, calls using a handle already freed by
+ * mqtt_disconnect() or any other invalid value fail with
+ * MQTTCLIENT_NULL_PARAMETER.
  */
 DLLEXP bool mqtt_connect_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
 DLLEXP void mqtt_connect_deinit(UDF_INIT *initid);
@@ -179,6 +853,63 @@ DLLEXP void mqtt_disconnect_deinit(UDF_INIT *initid);
 DLLEXP ulonglong mqtt_disconnect(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error);
 
 
+/**
+ * mqtt_open
+ *
+ * Open a named connection visible to all sessions and returns its handle.
+ * mqtt_open(name, server {,[username]} {,[password] {,[options]}}})
+ *
+ *        name      String
+ *                  Name of the connection, can be used instead of a handle
+ *                  by mqtt_publish(), mqtt_publish_batch() and
+ *                  mqtt_subscribe() in any session.
+ *        server, username, password, options
+ *                  See mqtt_connect()
+ *
+ *  returns valid handle or 0 on errors
+ *
+ * If name is already open, its handle is returned and the other
+ * parameters are ignored; a lost connection is reconnected. The connection
+ * stays open until mqtt_close() or the library is unloaded.
+ */
+DLLEXP bool mqtt_open_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+DLLEXP void mqtt_open_deinit(UDF_INIT *initid);
+DLLEXP ulonglong mqtt_open(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error);
+
+
+/**
+ * mqtt_close
+ *
+ * Close a named connection opened by mqtt_open().
+ * mqtt_close(name)
+ *  returns 0 if successful
+ */
+DLLEXP bool mqtt_close_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+DLLEXP void mqtt_close_deinit(UDF_INIT *initid);
+DLLEXP ulonglong mqtt_close(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error);
+
+
+/**
+ * mqtt_async_status
+ *
+ * Returns delivery status of an async client handle as JSON string.
+ * mqtt_async_status(handle {,timeout})
+ *
+ *        handle    Handle
+ *                  A valid handle returned from mqtt_connect() call using
+ *                  option "async": true.
+ *        timeout   Integer (ms)
+ *                  Wait up to timeout ms until all in-flight messages are
+ *                  confirmed before returning the status.
+ *
+ * returns JSON object with the number of unconfirmed ("inflight"),
+ * confirmed ("delivered") and failed ("failed") messages and the error
+ * code ("rc") and description ("desc") of the last failure.
+ */
+DLLEXP bool mqtt_async_status_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+DLLEXP void mqtt_async_status_deinit(UDF_INIT *initid);
+DLLEXP char* mqtt_async_status(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error);
+
 /**
  * mqtt_publish
  *
@@ -186,6 +917,7 @@ DLLEXP ulonglong mqtt_disconnect(UDF_INIT *initid, UDF_ARGS *args, char *is_null
  * Possible calls
  * mqtt_publish(server, [username], [password], topic, [payload] {,[qos] {,[retained] {,[timeout] {,[options]}}}})
  * mqtt_publish(client, topic, [payload] {,[qos] {,[retained] {,[timeout] {,[options]}}}})
+ * mqtt_publish(name, topic, [payload] {,[qos] {,[retained] {,[timeout] {,[options]}}}})
  *
  * Parameter in {} are optional an can be omit.
  * Parameter in [] can be NULL - in this case a default value is used.
@@ -207,6 +939,8 @@ DLLEXP ulonglong mqtt_disconnect(UDF_INIT *initid, UDF_ARGS *args, char *is_null
  *                  Password for authentification or NULL if unused
  *        client    Handle
  *                  A valid handle returned from mqtt_connect() call.
+ *        name      String
+ *                  Name of a connection opened by mqtt_open().
  *        topic     String
  *                  The topic to be published
  *        payload   String - default ''
@@ -225,9 +959,13 @@ DLLEXP ulonglong mqtt_disconnect(UDF_INIT *initid, UDF_ARGS *args, char *is_null
  * (see http://www.eclipse.org/paho/files/mqttdoc/MQTTClient/html/_m_q_t_t_client_8h.html)
  *
  * If this function is called with server as first parameter, the function will
- * connect to MQTT, publish the payload and disconnnect after publish.
- * Because this may slow down when a lot of publishing will be done you can do
- * publish using an alternate way with a client handle:
+ * connect to MQTT and publish the payload. After publish the connection is
+ * kept in a process-wide pool and reused by following calls using the same
+ * server, username, password and options. Idle connections are disconnected
+ * after their keepalive interval or POOL_IDLE_TIMEOUT seconds.
+ * Use option "pool": false to disconnect immediately after publish.
+ * For a lot of publishing you can also publish using an alternate way with
+ * a client handle:
  * 1. Call mqtt_connect() to get a valid mqtt connection handle
  * 2. Call mqtt_publish() using 'client' as first parameter.
  * 3. Repeat step 2. as long as possible
@@ -238,6 +976,117 @@ DLLEXP bool mqtt_publish_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
 DLLEXP void mqtt_publish_deinit(UDF_INIT *initid);
 DLLEXP ulonglong mqtt_publish(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error);
 
+/**
+ * mqtt_publish_batch
+ *
+ * Aggregate function publishing all messages of a group at once.
+ * mqtt_publish_batch(client, topic, [payload] {,[qos] {,[retained] {,[timeout]}}})
+ *
+ * Parameter in {} are optional an can be omit.
+ * Parameter in [] can be NULL - in this case a default value is used.
+ *
+ *        client    Handle
+ *                  A valid handle returned from mqtt_connect() call.
+ *                  All rows of a group must use the same handle.
+ *        topic     String
+ *                  The topic to be published
+ *        payload   String - default ''
+ *                  The message published for the topic
+ *        qos       Integer [0-2] - default 0
+ *                  The QOS (Quality Of Service) number
+ *        retained  Integer [0,1] - default 0
+ *                  Flag if message should be retained (1) or not (0)
+ *        timeout   Integer (ms]  - default 5000
+ *                  Timeout value waiting for completion (in ms)
+ *
+ * The rows of a group are collected and published back-to-back when the
+ * group is complete, waiting for the completion only once at the end.
+ *
+ * returns JSON object with the number of messages sent ("sent"), failed
+ * ("failed"), still unconfirmed on async handles ("pending") and the last
+ * error code ("rc").
+ */
+DLLEXP bool mqtt_publish_batch_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+DLLEXP void mqtt_publish_batch_deinit(UDF_INIT *initid);
+DLLEXP void mqtt_publish_batch_clear(UDF_INIT *initid, char *is_null, char *error);
+DLLEXP void mqtt_publish_batch_add(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error);
+DLLEXP char* mqtt_publish_batch(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error);
+
+/**
+ * mqtt_queue_start
+ *
+ * Start the background publisher used by mqtt_enqueue().
+ * mqtt_queue_start(server {,[username]} {,[password] {,[options]}}})
+ *
+ * Parameter are the same as for mqtt_connect(). The publisher uses one
+ * long-lived connection which is reconnected if the connection is lost.
+ * Additional options "queueSize", "queueOverflow", "queueBatch" and
+ * "queueLinger" (see mqtt_connect()) control the queue.
+ *
+ * The publisher thread takes the queued messages in batches, publishes
+ * them in queue order and waits for their completion once per batch. If
+ * the connection is lost the whole batch is published again after
+ * reconnect, so the order per topic is kept but messages may be
+ * duplicated.
+ *
+ * returns 0 if successful, otherwise error code
+ */
+DLLEXP bool mqtt_queue_start_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+DLLEXP void mqtt_queue_start_deinit(UDF_INIT *initid);
+DLLEXP ulonglong mqtt_queue_start(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error);
+
+/**
+ * mqtt_queue_stop
+ *
+ * Stop the background publisher after all queued messages are published.
+ * mqtt_queue_stop()
+ *
+ * returns 0 if successful
+ */
+DLLEXP bool mqtt_queue_stop_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+DLLEXP void mqtt_queue_stop_deinit(UDF_INIT *initid);
+DLLEXP ulonglong mqtt_queue_stop(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error);
+
+/**
+ * mqtt_enqueue
+ *
+ * Queue a message for the background publisher and return immediately
+ * (fire-and-forget).
+ * mqtt_enqueue(topic, [payload] {,[qos] {,[retained] {,[coalesce]}}})
+ *
+ *        topic     String
+ *                  The topic to be published
+ *        payload   String - default ''
+ *                  The message published for the topic
+ *        qos       Integer [0-2] - default 0
+ *                  The QOS (Quality Of Service) number
+ *        retained  Integer [0,1] - default 0
+ *                  Flag if message should be retained (1) or not (0)
+ *        coalesce  Integer [0,1] - default 0
+ *                  Flag if the message may be replaced by a later message
+ *                  of the same topic (see option "coalesceWindow"),
+ *                  retained messages are always coalesced
+ *
+ * returns 0 if the message was queued, otherwise error code
+ *
+ * Messages are queued in the order mqtt_enqueue() is called, not in
+ * transaction commit order, and messages of rolled back transactions are
+ * published too: a loadable function is not notified about commits.
+ */
+DLLEXP bool mqtt_enqueue_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+DLLEXP void mqtt_enqueue_deinit(UDF_INIT *initid);
+DLLEXP ulonglong mqtt_enqueue(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error);
+
+/**
+ * mqtt_queue_status
+ *
+ * Returns background publisher status as JSON string
+ * mqtt_queue_status()
+ */
+DLLEXP bool mqtt_queue_status_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+DLLEXP void mqtt_queue_status_deinit(UDF_INIT *initid);
+DLLEXP char* mqtt_queue_status(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error);
+
 /**
  * mqtt_subscribe
  *
@@ -245,6 +1094,7 @@ DLLEXP ulonglong mqtt_publish(UDF_INIT *initid, UDF_ARGS *args, char *is_null, c
  * Possible calls
  * mqtt_subscribe(server, [username], [password], topic, {,[qos] {,[timeout] {,[options]}}})
  * mqtt_subscribe(client, topic, [payload] {,[qos] {,[timeout] {,[options]}}})
+ * mqtt_subscribe(name, topic, [payload] {,[qos] {,[timeout] {,[options]}}})
  *
  * Parameter in {} are optional an can be omit.
  * Parameter in [] can be NULL - in this case a default value is used.
@@ -265,6 +1115,8 @@ DLLEXP ulonglong mqtt_publish(UDF_INIT *initid, UDF_ARGS *args, char *is_null, c
  *                  Password for authentification or NULL if unused
  *        client    Handle
  *                  A valid handle returned from mqtt_connect() call.
+ *        name      String
+ *                  Name of a connection opened by mqtt_open().
  *        topic     String
  *                  The topic to be subscribe
  *        qos       Integer [0..2] - default 0
@@ -287,11 +1139,81 @@ DLLEXP ulonglong mqtt_publish(UDF_INIT *initid, UDF_ARGS *args, char *is_null, c
  * 3. Repeat step 2. as long as possible
  * 4. Call mqtt_disconnect() to free the handle
  *
+ * With a handle connected using option "receiveQueue" the subscription is
+ * made only once and kept, the function returns the next message queued
+ * for the handle (of any of its subscriptions) waiting up to timeout ms.
+ * With a handle connected using option "shareGroup" the topic is
+ * subscribed as shared subscription within the group.
  */
 DLLEXP bool mqtt_subscribe_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
 DLLEXP void mqtt_subscribe_deinit(UDF_INIT *initid);
 DLLEXP char* mqtt_subscribe(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error);
 
+
+/**
+ * mqtt_receive
+ *
+ * Returns messages received by the streaming subscriptions of a handle.
+ * mqtt_receive(client {,[max_messages] {,[timeout]}})
+ *
+ *        client    Handle or String
+ *                  A valid handle returned from mqtt_connect() call using
+ *                  option "receiveQueue" or the name of a connection
+ *                  opened by mqtt_open() using this option.
+ *        max_messages  Integer - default 100
+ *                  Max number of messages returned
+ *        timeout   Integer (ms) - default 5000
+ *                  Max time to wait for the first message
+ *
+ * returns a JSON array of objects with "topic", "payload", "qos" and
+ * "retained" for all messages queued at the time the first one is
+ * available; an empty array if none arrived within timeout; NULL on errors.
+ */
+DLLEXP bool mqtt_receive_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+DLLEXP void mqtt_receive_deinit(UDF_INIT *initid);
+DLLEXP char* mqtt_receive(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error);
+
+
+/**
+ * mqtt_unsubscribe
+ *
+ * Ends a streaming subscription made by mqtt_subscribe().
+ * mqtt_unsubscribe(client, topic)
+ *  returns 0 if successful
+ */
+DLLEXP bool mqtt_unsubscribe_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+DLLEXP void mqtt_unsubscribe_deinit(UDF_INIT *initid);
+DLLEXP ulonglong mqtt_unsubscribe(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error);
+
+
+/**
+ * mqtt_consume
+ *
+ * Subscribes to a set of topic filters and returns the received messages
+ * in batches, e.g. for multi-row INSERTs using JSON_TABLE().
+ * mqtt_consume(client, [topics] {,[max_messages] {,[max_latency] {,[timeout]}}})
+ *
+ *        client    Handle or String
+ *                  A valid handle or connection name connected using
+ *                  option "receiveQueue" (see mqtt_receive()).
+ *        topics    String
+ *                  JSON array of topic filters or a single topic filter,
+ *                  subscribed with QoS 1 on first use and kept.
+ *                  NULL to use the existing subscriptions only.
+ *        max_messages  Integer - default 100
+ *                  Batch size: max number of messages returned
+ *        max_latency   Integer (ms) - default 1000
+ *                  Max time to wait after the first message for the batch
+ *                  to become full
+ *        timeout   Integer (ms) - default 5000
+ *                  Max time to wait for the first message
+ *
+ * returns a JSON array like mqtt_receive(), NULL on errors.
+ */
+DLLEXP bool mqtt_consume_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+DLLEXP void mqtt_consume_deinit(UDF_INIT *initid);
+DLLEXP char* mqtt_consume(UDF_INIT *initid, UDF_ARGS *args, char* result, unsigned long* length, char *is_null, char *error);
+
 #ifdef __cplusplus
 }
 #endif  // __cplusplus
@@ -71,4 +71,228 @@ SELECT mqtt_publish(@client, 'dev/test', NOW(), NULL, 0   , 1000);
 SELECT mqtt_publish(@client, 'dev/test', NOW(), 0   , NULL, 1000);
 SELECT mqtt_publish(@client, 'dev/test', NOW(), 0   , 0   , NULL);
 
+SELECT mqtt_lasterror(@client);
+SELECT
+    JSON_UNQUOTE(JSON_VALUE(mqtt_lasterror(@client),'$.rc')) AS rc,
+    JSON_UNQUOTE(JSON_VALUE(mqtt_lasterror(@client),'$."func"')) AS 'func',
+    JSON_UNQUOTE(JSON_VALUE(mqtt_lasterror(@client),'$."desc"')) AS 'desc';
+
+SELECT mqtt_disconnect(@client);
+
+
+-- Async mqtt_publish() calls
+SET @client = (SELECT mqtt_connect('tcp://localhost:1883', 'myuser', 'mypasswd', '{"async": true, "maxInflightMessages": 100}'));
+SELECT mqtt_publish(@client, 'dev/test', NOW(), 0);
+SELECT mqtt_publish(@client, 'dev/test', NOW(), 1);
+SELECT mqtt_publish(@client, 'dev/test', NOW(), 2);
+SELECT mqtt_async_status(@client);
+SELECT mqtt_async_status(@client, 1000);
+SELECT
+    JSON_UNQUOTE(JSON_VALUE(mqtt_async_status(@client, 1000),'$.inflight')) AS inflight,
+    JSON_UNQUOTE(JSON_VALUE(mqtt_async_status(@client),'$.delivered')) AS delivered,
+    JSON_UNQUOTE(JSON_VALUE(mqtt_async_status(@client),'$.failed')) AS failed;
+SELECT mqtt_disconnect(@client);
+
+
+-- Aggregate mqtt_publish_batch() calls
+SET @client = (SELECT mqtt_connect('tcp://localhost:1883', 'myuser', 'mypasswd'));
+SELECT mqtt_publish_batch(@client, 'dev/test', payload) FROM (SELECT 'a' AS payload UNION SELECT 'b' UNION SELECT 'c') AS t;
+SELECT mqtt_publish_batch(@client, 'dev/test', payload, 1) FROM (SELECT 'a' AS payload UNION SELECT 'b' UNION SELECT 'c') AS t;
+SELECT grp, mqtt_publish_batch(@client, CONCAT('dev/test/', grp), payload, 1, 0, 1000) FROM (SELECT 1 AS grp, 'a' AS payload UNION SELECT 1, 'b' UNION SELECT 2, 'c') AS t GROUP BY grp;
+SELECT mqtt_disconnect(@client);
+
+
+-- Background publisher
+SELECT mqtt_enqueue('dev/test', 'not started');
+SELECT mqtt_queue_start('tcp://localhost:1883', 'myuser', 'mypasswd', '{"queueSize": 1024, "queueOverflow": "drop"}');
+SELECT mqtt_enqueue('dev/test', NOW());
+SELECT mqtt_enqueue('dev/test', NULL);
+SELECT mqtt_enqueue('dev/test', NOW(), 1);
+SELECT mqtt_enqueue('dev/test', NOW(), 1, 0);
+SELECT mqtt_queue_status();
+SELECT mqtt_queue_stop();
+SELECT mqtt_queue_status();
+SELECT mqtt_queue_start('tcp://localhost:1883', 'myuser', 'mypasswd', '{"queueBatch": 100, "queueLinger": 10}');
+SELECT mqtt_enqueue(CONCAT('dev/test/', seq % 3), seq, 1) FROM (SELECT 1 AS seq UNION SELECT 2 UNION SELECT 3 UNION SELECT 4 UNION SELECT 5 UNION SELECT 6) AS t;
+SELECT mqtt_queue_stop();
+SELECT mqtt_queue_start('tcp://localhost:1883', 'myuser', 'mypasswd', '{"coalesceWindow": 50}');
+SELECT mqtt_enqueue(CONCAT('dev/test/', seq % 2), seq, 0, 0, 1) FROM (SELECT 1 AS seq UNION SELECT 2 UNION SELECT 3 UNION SELECT 4) AS t;
+SELECT mqtt_queue_status();
+SELECT mqtt_queue_stop();
+
+
+-- Invalid handles
+SELECT mqtt_publish(0, 'dev/test', NOW());
+SELECT mqtt_publish(12345, 'dev/test', NOW());
+SET @client = (SELECT mqtt_connect('tcp://localhost:1883', 'myuser', 'mypasswd'));
+SELECT mqtt_disconnect(@client);
+SELECT mqtt_publish(@client, 'dev/test', NOW());
+SELECT mqtt_lasterror(@client);
+SELECT mqtt_disconnect(@client);
+
+
+-- One handle per distinct connect arguments
+CREATE TEMPORARY TABLE mqtt_shards (server VARCHAR(255));
+INSERT INTO mqtt_shards VALUES ('tcp://localhost:1883'), ('tcp://localhost:1883'), ('tcp://127.0.0.1:1883');
+CREATE TEMPORARY TABLE mqtt_clients AS SELECT server, mqtt_connect(server, 'myuser', 'mypasswd') AS client FROM mqtt_shards;
+SELECT * FROM mqtt_clients;
+SELECT client, mqtt_disconnect(client) FROM (SELECT DISTINCT client FROM mqtt_clients) AS c;
+DROP TEMPORARY TABLE mqtt_clients, mqtt_shards;
+
+
+-- Named connections
+SELECT mqtt_open('test', 'tcp://localhost:1883', 'myuser', 'mypasswd');
+SELECT mqtt_open('test', 'tcp://localhost:1883', 'myuser', 'mypasswd');
+SELECT mqtt_publish('test', 'dev/test', NOW());
+SELECT mqtt_publish('test', 'dev/test', NOW(), 1, 0);
+SELECT mqtt_publish('unknown', 'dev/test', NOW());
+SELECT mqtt_lasterror('test');
+-- NULL qos and retained, not the server form with a NULL topic
+SELECT mqtt_publish('test', 'dev/test', 'null options', NULL, NULL);
+SELECT mqtt_subscribe('test', 'dev/test', NULL, NULL);
+SELECT mqtt_close('test');
+SELECT mqtt_close('test');
+
+
+-- Streaming subscriptions
+SET @client = (SELECT mqtt_connect('tcp://localhost:1883', 'myuser', 'mypasswd', '{"receiveQueue":1000}'));
+SELECT mqtt_subscribe(@client, 'dev/stream/#', 1, 0);
+SELECT mqtt_publish(@client, 'dev/stream/a', 'first', 1);
+SELECT mqtt_publish(@client, 'dev/stream/b', 'second', 1);
+SELECT mqtt_receive(@client, 10, 1000);
+SELECT mqtt_receive(@client, 10, 100);
+SELECT mqtt_unsubscribe(@client, 'dev/stream/#');
+SELECT mqtt_disconnect(@client);
+
+
+-- Large payloads
+SET @client = (SELECT mqtt_connect('tcp://localhost:1883', 'myuser', 'mypasswd', '{"receiveQueue":10,"maxPayload":1048576}'));
+SELECT mqtt_subscribe(@client, 'dev/large', 1, 0);
+SELECT mqtt_publish(@client, 'dev/large', REPEAT('x', 500000), 1);
+SELECT LENGTH(mqtt_subscribe(@client, 'dev/large', 1, 1000));
+SELECT mqtt_publish(@client, 'dev/large', REPEAT('x', 2000000), 1);
+SELECT mqtt_subscribe(@client, 'dev/large', 1, 1000);
+SELECT mqtt_lasterror(@client);
+SELECT mqtt_disconnect(@client);
+
+
+-- Batched ingestion
+SELECT mqtt_open('ingest', 'tcp://localhost:1883', 'myuser', 'mypasswd', '{"receiveQueue":1000}');
+SELECT mqtt_consume('ingest', '["dev/ingest/#"]', 10, 100, 0);
+SELECT mqtt_publish('ingest', 'dev/ingest/a', '{"v":1}', 1);
+SELECT mqtt_publish('ingest', 'dev/ingest/b', '{"v":2}', 1);
+CREATE TEMPORARY TABLE mqtt_ingest (topic VARCHAR(255), payload JSON);
+INSERT INTO mqtt_ingest (topic, payload)
+SELECT jt.topic, jt.payload
+  FROM JSON_TABLE(mqtt_consume('ingest', NULL, 10, 100, 1000), '$[*]'
+       COLUMNS (topic VARCHAR(255) PATH '$.topic', payload JSON PATH '$.payload')) AS jt;
+SELECT * FROM mqtt_ingest;
+DROP TEMPORARY TABLE mqtt_ingest;
+SELECT mqtt_close('ingest');
+
+
+-- Payload compression
+SET @client = mqtt_connect('tcp://localhost:1883', 'myuser', 'mypasswd', '{"receiveQueue": 100, "compress": 64, "compressDict": "{\\"temperature\\":,\\"humidity\\":"}');
+SELECT mqtt_subscribe(@client, 'dev/compressed', 1, 0);
+SELECT mqtt_publish(@client, 'dev/compressed', REPEAT('{"temperature":21.5,"humidity":40}', 10), 1);
+SELECT mqtt_receive(@client);
+SELECT mqtt_disconnect(@client);
+
+
+-- MQTT 5 properties and topic aliases
+SET @client = mqtt_connect('tcp://localhost:1883', 'myuser', 'mypasswd', '{"MQTTVersion": 5, "messageExpiry": 3600, "contentType": "application/json", "userProperties": {"source": "mysql"}, "topicAliasMaximum": 16}');
+SELECT mqtt_publish(@client, 'site/berlin/building/1/floor/2/room/12/temperature', '{"value": 21.5}', 1);
+SELECT mqtt_publish(@client, 'site/berlin/building/1/floor/2/room/12/temperature', '{"value": 21.6}', 1);
+SELECT mqtt_publish(@client, 'site/berlin/building/1/floor/2/room/12/temperature', '{"value": 21.7}', 1);
+SELECT mqtt_disconnect(@client);
+SELECT mqtt_publish('tcp://localhost:1883', 'myuser', 'mypasswd', 'dev/test', 'MQTT 5', 0, 0, 5000, '{"MQTTVersion": 5, "messageExpiry": 60}');
+
+
+-- Shared subscriptions
+SELECT mqtt_open('shared1', 'tcp://localhost:1883', 'myuser', 'mypasswd', '{"receiveQueue": 100, "shareGroup": "ingest"}');
+SELECT mqtt_open('shared2', 'tcp://localhost:1883', 'myuser', 'mypasswd', '{"receiveQueue": 100, "shareGroup": "ingest"}');
+SELECT mqtt_consume('shared1', 'dev/shared/#', 10, 0, 0), mqtt_consume('shared2', 'dev/shared/#', 10, 0, 0);
+SELECT mqtt_publish('tcp://localhost:1883', 'myuser', 'mypasswd', CONCAT('dev/shared/', seq), seq, 1) FROM (SELECT 1 AS seq UNION SELECT 2 UNION SELECT 3 UNION SELECT 4) AS t;
+SELECT mqtt_consume('shared1', NULL, 10, 100, 1000), mqtt_consume('shared2', NULL, 10, 100, 1000);
+SELECT mqtt_unsubscribe('shared1', 'dev/shared/#');
+SELECT mqtt_close('shared1');
+SELECT mqtt_close('shared2');
+SELECT mqtt_open('badgroup', 'tcp://localhost:1883', 'myuser', 'mypasswd', '{"shareGroup": "a/b"}');
+
+
+-- Statistics
+SELECT mqtt_stats();
+SET @client = mqtt_connect('tcp://localhost:1883', 'myuser', 'mypasswd');
+SELECT mqtt_publish(@client, 'dev/stats', seq, 1) FROM (SELECT 1 AS seq UNION SELECT 2 UNION SELECT 3) AS t;
+SELECT mqtt_stats(@client);
+SELECT JSON_VALUE(mqtt_stats(@client), '$.latency.wait.p99');
+SELECT mqtt_disconnect(@client);
+SELECT mqtt_stats(@client);
+
+
+-- Live connections
+SET @client = mqtt_connect('tcp://localhost:1883', 'myuser', 'mypasswd');
+SELECT mqtt_connections();
+SELECT c.* FROM JSON_TABLE(mqtt_connections(), '$[*]' COLUMNS(type VARCHAR(8) PATH '$.type', handle BIGINT PATH '$.handle', server VARCHAR(255) PATH '$.server', clientId VARCHAR(64) PATH '$.clientId', state VARCHAR(16) PATH '$.state', lastUsed BIGINT PATH '$.lastUsed')) AS c;
 SELECT mqtt_disconnect(@client);
+SELECT JSON_LENGTH(mqtt_connections());
+
+
+-- Tracing
+SELECT mqtt_trace();
+SELECT mqtt_trace('debug');
+SELECT mqtt_publish('tcp://localhost:1883', 'myuser', 'mypasswd', 'dev/trace', 'traced', 0);
+SELECT mqtt_trace_dump(1);
+SELECT mqtt_trace(0);
+SELECT mqtt_trace('verbose');
+SELECT JSON_LENGTH(mqtt_trace_dump());
+
+
+-- Per-row topics and QoS
+SET @client = mqtt_connect('tcp://localhost:1883', 'myuser', 'mypasswd');
+SELECT mqtt_publish(@client, CONCAT('dev/plan/', seq), seq, seq % 2) FROM (SELECT 1 AS seq UNION SELECT 2 UNION SELECT 3) AS t;
+SELECT mqtt_publish(@client, NULL, 'no topic');
+SELECT mqtt_lasterror(@client);
+SELECT mqtt_disconnect(@client);
+
+
+-- Constant topics and payloads
+SET @client = mqtt_connect('tcp://localhost:1883', 'myuser', 'mypasswd', '{"MQTTVersion": 5, "compress": 16}');
+SELECT mqtt_publish(@client, 'dev/constant', 'the same payload for every row of the statement', 1) FROM (SELECT 1 AS seq UNION SELECT 2 UNION SELECT 3) AS t;
+SELECT mqtt_publish(@client, 'dev/+/invalid', 'rejected');
+SELECT mqtt_disconnect(@client);
+
+
+-- Fixed client id for a persistent session
+SET @client = mqtt_connect('tcp://localhost:1883', 'myuser', 'mypasswd', '{"clientId": "mysql-orders", "cleansession": false}');
+SELECT JSON_EXTRACT(mqtt_connections(), '$[0].clientId');
+SELECT mqtt_disconnect(@client);
+
+
+-- Automatic reconnect
+-- a second client with the same id makes the broker drop the first one
+SET @client = mqtt_connect('tcp://localhost:1883', 'myuser', 'mypasswd', '{"clientId": "mysql-reconnect", "async": true, "reconnect": true, "reconnectDelay": 2000, "offlineBuffer": 100}');
+SET @thief = mqtt_connect('tcp://localhost:1883', 'myuser', 'mypasswd', '{"clientId": "mysql-reconnect"}');
+SELECT SLEEP(0.5);
+SELECT mqtt_publish(@client, 'dev/reconnect', CONCAT('message ', seq), 1) FROM (SELECT 1 AS seq UNION SELECT 2 UNION SELECT 3) AS t;
+-- expected: reconnecting, 3 buffered
+SELECT c.state, c.buffered, c.reconnects FROM JSON_TABLE(mqtt_connections(), '$[*]' COLUMNS(
+        handle BIGINT PATH '$.handle', state VARCHAR(16) PATH '$.state',
+        buffered INT PATH '$.buffered', reconnects INT PATH '$.reconnects')) AS c
+    WHERE c.handle = @client;
+SELECT mqtt_disconnect(@thief);
+SELECT SLEEP(3);
+-- expected: connected, 0 buffered, 1 reconnect
+SELECT c.state, c.buffered, c.reconnects FROM JSON_TABLE(mqtt_connections(), '$[*]' COLUMNS(
+        handle BIGINT PATH '$.handle', state VARCHAR(16) PATH '$.state',
+        buffered INT PATH '$.buffered', reconnects INT PATH '$.reconnects')) AS c
+    WHERE c.handle = @client;
+SELECT mqtt_disconnect(@client);
+
+
+-- Durable in-flight messages across mysqld restarts
+SET @client = mqtt_connect('tcp://localhost:1883', 'myuser', 'mypasswd', '{"clientId": "mysql-durable", "cleansession": false, "persistence": "/var/lib/mysql-files", "persistenceSync": 50}');
+SELECT mqtt_publish(@client, 'dev/durable', CONCAT('message ', seq), 1) FROM (SELECT 1 AS seq UNION SELECT 2 UNION SELECT 3) AS t;
+SELECT mqtt_disconnect(@client);
+SELECT mqtt_connect('tcp://localhost:1883', 'myuser', 'mypasswd', '{"persistence": "/var/lib/mysql-files"}');
+SELECT mqtt_lasterror();